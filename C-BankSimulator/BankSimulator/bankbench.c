@@ -0,0 +1,900 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ is used to make the session fifos larger.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <time.h>
+
+#define SERVER_FIFO "server_fifo"
+#define SOCKET_PATH "bank.sock"
+#define CLIENT_FIFO_TEMPLATE "client_fifo_%d"
+#define CLIENT_FIFO_NAME_LEN 64
+#define MAX_TRANSFER_LEGS 8
+#define RESPONSE_FIFO_TEMPLATE "client_fifo_%d.resp"
+#define DEFAULT_PIPE_SIZE 65536
+#define DEFAULT_CONNECTIONS 4
+#define MAX_CONNECTIONS 256
+#define DEFAULT_DURATION 10 // Seconds.
+#define DEFAULT_ACCOUNTS 100
+#define DEFAULT_READ_PERCENT 50
+#define DEFAULT_IN_FLIGHT 64 // Requests of a connection sent and not answered yet.
+#define MAX_IN_FLIGHT 4096
+#define SETUP_BATCH 256 // Accounts opened with one write, their responses fit in a fifo of the default size.
+#define INITIAL_BALANCE 1000000000 // Accounts made by the benchmark are large enough that withdrawals never remove them.
+#define HISTOGRAM_SUB_BUCKETS 16   // Every power of two of the latency is split into this many buckets.
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+#define RESULT_BUSY 2        // Server is full, the request or the session should be tried again a little later.
+#define MAX_BACKOFF_MS 1000  // Longest wait between two tries.
+#define CONNECT_TIMEOUT_S 30 // Session is given up if no teller takes it in this time.
+
+// Structures
+
+// These structures are the same ones as in client.c, for explanation please refer to that file.
+typedef struct
+{
+    pid_t client_pid;
+    char client_fifo[CLIENT_FIFO_NAME_LEN];
+    int session;
+} Server_Connection_Request;
+
+typedef struct
+{
+    char account_id[20];
+    int amount;
+} Transfer_Leg;
+
+typedef struct
+{
+    pid_t client_pid;
+    char account_id[20];
+    char operation[10];
+    int amount;
+    int possible_request;
+    int leg_count;
+    Transfer_Leg legs[MAX_TRANSFER_LEGS];
+} Request;
+
+typedef struct
+{
+    unsigned int request_id;
+    Request request;
+} Session_Request;
+
+typedef struct
+{
+    unsigned int request_id;
+    int result;
+    char message[100];
+} Session_Response;
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+    long line_number;
+} Workload_Reader;
+
+// Requests are counted separately for every kind of operation.
+enum
+{
+    OP_BALANCE,
+    OP_DEPOSIT,
+    OP_WITHDRAW,
+    OP_CREATE,
+    OP_TRANSFER,
+    OP_COUNT
+};
+const char *operation_names[OP_COUNT] = {"balance", "deposit", "withdraw", "create", "transfer"};
+
+// Latency histogram in microseconds. Buckets are log-linear: values below 16 have a bucket each, every larger power
+// of two is split into 16 buckets, so a bucket is at most about 6% wide whatever the latency is.
+typedef struct
+{
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long rejected; // Answered with a result of 0 (insufficient balance, unknown account...).
+    unsigned long long busy;     // Turned away since the server was full, these are not sent again.
+    double sum_us;
+    double max_us;
+} Histogram;
+
+// A session with the server, over the fifos or over the socket (then both descriptors are the same).
+typedef struct
+{
+    int request_fd;
+    int response_fd;
+    int use_socket;
+    char client_fifo[CLIENT_FIFO_NAME_LEN];
+    char response_fifo[CLIENT_FIFO_NAME_LEN];
+} Session;
+
+// Command line options.
+typedef struct
+{
+    int connections;
+    int duration;
+    double rate; // Requests per second of all the connections together, 0 sends as fast as the server answers.
+    int accounts;
+    int read_percent;
+    int transfer_percent; // Transfers between two accounts among the requests, taken from the deposits and withdrawals.
+    int in_flight;
+    int use_socket;
+    const char *replay_file;
+} Options;
+
+// Explanations for functions are under main where definitions are done.
+void parse_arguments(int argc, char *argv[], Options *options);
+void open_session(Session *session, int in_flight);
+void open_socket_session(Session *session);
+void end_requests(Session *session);
+void close_session(Session *session);
+void cleanup_fifo(int sig);
+int create_accounts(const Options *options, char (*ids)[20]);
+void run_connection(int connection, const Options *options, char (*ids)[20], const Workload_Reader *workload, Histogram *histograms);
+int next_synthetic_request(const Options *options, char (*ids)[20], unsigned int *seed, Request *request);
+int next_replayed_request(Workload_Reader *reader, Request *request);
+int operation_of(const Request *request);
+void histogram_add(Histogram *histogram, double latency_us, int result);
+int retry_delay_ms(const char *message, int attempt);
+double histogram_percentile(const Histogram *histogram, double percentile);
+void print_report(const Options *options, Histogram *histograms, double elapsed);
+double now_seconds();
+void open_workload(const char *filename, Workload_Reader *reader);
+int fit_pipe(int fd, size_t bytes);
+
+// Bankbench runs many client sessions against a running server and reports the throughput and the latency
+// percentiles of every kind of operation. Workload is either made up (random accounts, given read/write mix) or
+// replayed from a file in the client file format.
+int main(int argc, char *argv[])
+{
+    Options options;
+    parse_arguments(argc, argv, &options);
+    // A connection that the server closes should be reported, not kill the benchmark.
+    // Fifos of the sessions are removed when the benchmark is stopped with ctrl+c.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, cleanup_fifo);
+    signal(SIGTERM, cleanup_fifo);
+
+    Workload_Reader workload;
+    memset(&workload, 0, sizeof(workload));
+    char (*ids)[20] = NULL;
+    if (options.replay_file != NULL)
+    {
+        open_workload(options.replay_file, &workload);
+    }
+    else
+    {
+        // Synthetic requests go to accounts that the benchmark opens first, so they exist whatever the database is.
+        ids = malloc(options.accounts * sizeof(*ids));
+        options.accounts = create_accounts(&options, ids);
+        if (options.accounts == 0)
+        {
+            fprintf(stderr, "No accounts could be created.\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("Opened %d accounts for the benchmark.\n", options.accounts);
+    }
+
+    // Every connection is a process with its own session. Histograms are in shared memory and merged at the end.
+    Histogram *histograms = mmap(NULL, options.connections * OP_COUNT * sizeof(Histogram), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (histograms == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    double start = now_seconds();
+    fflush(stdout);
+    for (int i = 0; i < options.connections; i++)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork failed");
+            break;
+        }
+        if (pid == 0)
+        {
+            run_connection(i, &options, ids, &workload, histograms + i * OP_COUNT);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+    double elapsed = now_seconds() - start;
+
+    // Merge the histograms of the connections into the first one.
+    for (int i = 1; i < options.connections; i++)
+    {
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            Histogram *from = &histograms[i * OP_COUNT + op], *to = &histograms[op];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+                to->counts[b] += from->counts[b];
+            to->total += from->total;
+            to->rejected += from->rejected;
+            to->busy += from->busy;
+            to->sum_us += from->sum_us;
+            if (from->max_us > to->max_us)
+                to->max_us = from->max_us;
+        }
+    }
+    print_report(&options, histograms, elapsed);
+    free(ids);
+    return 0;
+}
+
+// Reads the command line options.
+void parse_arguments(int argc, char *argv[], Options *options)
+{
+    options->connections = DEFAULT_CONNECTIONS;
+    options->duration = DEFAULT_DURATION;
+    options->rate = 0;
+    options->accounts = DEFAULT_ACCOUNTS;
+    options->read_percent = DEFAULT_READ_PERCENT;
+    options->transfer_percent = 0;
+    options->in_flight = DEFAULT_IN_FLIGHT;
+    options->use_socket = 0;
+    options->replay_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:r:a:m:x:n:uf:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            options->connections = atoi(optarg);
+            if (options->connections < 1 || options->connections > MAX_CONNECTIONS)
+            {
+                fprintf(stderr, "Connection count should be between 1 and %d\n", MAX_CONNECTIONS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            options->duration = atoi(optarg);
+            if (options->duration < 1)
+            {
+                fprintf(stderr, "Duration should be at least one second\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            options->rate = atof(optarg);
+            if (options->rate < 0)
+            {
+                fprintf(stderr, "Rate can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            options->accounts = atoi(optarg);
+            if (options->accounts < 1)
+            {
+                fprintf(stderr, "Account count should be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            options->read_percent = atoi(optarg);
+            if (options->read_percent < 0 || options->read_percent > 100)
+            {
+                fprintf(stderr, "Read percent should be between 0 and 100\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            options->transfer_percent = atoi(optarg);
+            if (options->transfer_percent < 0 || options->transfer_percent > 100)
+            {
+                fprintf(stderr, "Transfer percent should be between 0 and 100\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            options->in_flight = atoi(optarg);
+            if (options->in_flight < 1 || options->in_flight > MAX_IN_FLIGHT)
+            {
+                fprintf(stderr, "Requests in flight should be between 1 and %d\n", MAX_IN_FLIGHT);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            options->use_socket = 1;
+            break;
+        case 'f':
+            options->replay_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-r rate] [-a accounts] [-m read_percent] [-x transfer_percent] [-n in_flight] [-u] [-f client_file]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options->read_percent + options->transfer_percent > 100)
+    {
+        fprintf(stderr, "Reads and transfers together should be at most 100 percent\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Opens a session with the server the same way the client does.
+void open_session(Session *session, int in_flight)
+{
+    pid_t pid = getpid();
+    srand(pid ^ time(NULL)); // Connections are forked from one process, each one needs its own jitter.
+    session->use_socket = 0;
+    snprintf(session->client_fifo, CLIENT_FIFO_NAME_LEN, CLIENT_FIFO_TEMPLATE, pid);
+    snprintf(session->response_fifo, CLIENT_FIFO_NAME_LEN, RESPONSE_FIFO_TEMPLATE, pid);
+    if ((mkfifo(session->client_fifo, 0666) == -1 && errno != EEXIST) || (mkfifo(session->response_fifo, 0666) == -1 && errno != EEXIST))
+    {
+        perror("mkfifo failed");
+        exit(EXIT_FAILURE);
+    }
+    Server_Connection_Request sc_request;
+    memset(&sc_request, 0, sizeof(sc_request));
+    sc_request.client_pid = pid;
+    strcpy(sc_request.client_fifo, session->client_fifo);
+    sc_request.session = 1;
+    // Connection request is sent again with a backoff while the server answers that it is busy.
+    double deadline = now_seconds() + CONNECT_TIMEOUT_S;
+    for (int attempt = 0;; attempt++)
+    {
+        session->request_fd = -1;
+        session->response_fd = open(session->response_fifo, O_RDONLY | O_NONBLOCK);
+        int server_fd = open(SERVER_FIFO, O_WRONLY | O_NONBLOCK);
+        if (session->response_fd == -1 || server_fd == -1)
+        {
+            printf("Bankbench %d cannot connect to server FIFO\n", pid);
+            close_session(session);
+            exit(EXIT_FAILURE);
+        }
+        int queued = write(server_fd, &sc_request, sizeof(sc_request)) == sizeof(sc_request);
+        close(server_fd);
+        char message[100] = "";
+        while (queued && session->request_fd == -1)
+        {
+            session->request_fd = open(session->client_fifo, O_WRONLY | O_NONBLOCK);
+            if (session->request_fd != -1)
+                break;
+            struct pollfd poll_fd = {session->response_fd, POLLIN, 0};
+            Session_Response response;
+            if (errno != ENXIO || now_seconds() > deadline)
+            {
+                perror("Failed to open session FIFOs");
+                close_session(session);
+                exit(EXIT_FAILURE);
+            }
+            if (poll(&poll_fd, 1, 1) == 1 && read(session->response_fd, &response, sizeof(response)) == sizeof(response) &&
+                response.result == RESULT_BUSY)
+            {
+                strcpy(message, response.message);
+                break;
+            }
+        }
+        if (session->request_fd != -1)
+            break;
+        close(session->response_fd);
+        session->response_fd = -1;
+        int delay = retry_delay_ms(message, attempt);
+        if (now_seconds() + delay / 1000.0 > deadline)
+        {
+            fprintf(stderr, "Bankbench %d gave up, server stayed busy for %d s.\n", pid, CONNECT_TIMEOUT_S);
+            close_session(session);
+            exit(EXIT_FAILURE);
+        }
+        usleep(delay * 1000);
+    }
+    // Response fifo is opened again to wait until the teller opens it too. Sessions are used with blocking
+    // descriptors unless the connection makes them non-blocking itself.
+    int fd = open(session->response_fifo, O_RDONLY);
+    close(session->response_fd);
+    session->response_fd = fd;
+    if (fd == -1)
+    {
+        perror("Failed to open session FIFOs");
+        close_session(session);
+        exit(EXIT_FAILURE);
+    }
+    fcntl(session->request_fd, F_SETFL, fcntl(session->request_fd, F_GETFL) & ~O_NONBLOCK);
+    fit_pipe(session->request_fd, in_flight * sizeof(Session_Request));
+    fit_pipe(session->response_fd, in_flight * sizeof(Session_Response));
+}
+
+// Opens a session over the unix domain socket of the server.
+void open_socket_session(Session *session)
+{
+    session->use_socket = 1;
+    session->client_fifo[0] = session->response_fifo[0] = '\0';
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        printf("Bankbench %d cannot connect to server socket\n", getpid());
+        exit(EXIT_FAILURE);
+    }
+    session->request_fd = session->response_fd = fd;
+}
+
+// Tells the teller that no more requests are coming, responses are still read.
+void end_requests(Session *session)
+{
+    if (session->request_fd == -1)
+        return;
+    if (session->use_socket)
+        shutdown(session->request_fd, SHUT_WR);
+    else
+        close(session->request_fd);
+    session->request_fd = -1;
+}
+
+void close_session(Session *session)
+{
+    if (!session->use_socket && session->request_fd != -1)
+        close(session->request_fd);
+    if (session->response_fd != -1)
+        close(session->response_fd);
+    if (!session->use_socket)
+    {
+        unlink(session->client_fifo);
+        unlink(session->response_fifo);
+    }
+}
+
+// Removes the fifos of this process's session when the benchmark is stopped.
+void cleanup_fifo(int sig)
+{
+    char fifo[CLIENT_FIFO_NAME_LEN];
+    snprintf(fifo, sizeof(fifo), CLIENT_FIFO_TEMPLATE, getpid());
+    unlink(fifo);
+    snprintf(fifo, sizeof(fifo), RESPONSE_FIFO_TEMPLATE, getpid());
+    unlink(fifo);
+    _exit(1);
+}
+
+// Opens the accounts of the synthetic workload over one session and keeps their ids. Requests are sent in groups
+// that fit in flight and each group is answered before the next one. Returns the number of accounts opened.
+int create_accounts(const Options *options, char (*ids)[20])
+{
+    Session session;
+    session.request_fd = session.response_fd = -1;
+    if (options->use_socket)
+        open_socket_session(&session);
+    else
+        open_session(&session, options->in_flight);
+    Session_Request *batch = malloc(SETUP_BATCH * sizeof(Session_Request));
+    int created = 0, attempt = 0;
+    for (int done = 0; done < options->accounts;)
+    {
+        int busy = 0;
+        char message[100] = "";
+        int count = options->accounts - done < SETUP_BATCH ? options->accounts - done : SETUP_BATCH;
+        for (int i = 0; i < count; i++)
+        {
+            memset(&batch[i], 0, sizeof(Session_Request));
+            batch[i].request_id = done + i;
+            batch[i].request.client_pid = getpid();
+            strcpy(batch[i].request.account_id, "N");
+            strcpy(batch[i].request.operation, "deposit");
+            batch[i].request.amount = INITIAL_BALANCE;
+        }
+        if (write(session.request_fd, batch, count * sizeof(Session_Request)) == -1)
+        {
+            perror("Bankbench write requests");
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            Session_Response response;
+            size_t got = 0;
+            while (got < sizeof(response))
+            {
+                ssize_t bytes = read(session.response_fd, (char *)&response + got, sizeof(response) - got);
+                if (bytes <= 0)
+                {
+                    fprintf(stderr, "Session closed by the server while opening accounts.\n");
+                    exit(EXIT_FAILURE);
+                }
+                got += bytes;
+            }
+            if (response.result == 1 && sscanf(response.message, "New account %19s", ids[created]) == 1)
+                created++;
+            else if (response.result == RESULT_BUSY)
+            {
+                busy++;
+                strcpy(message, response.message);
+            }
+        }
+        // Accounts that the server was too busy to open are asked for again with the next group.
+        done += count - busy;
+        if (busy > 0)
+            usleep(retry_delay_ms(message, attempt++) * 1000);
+        else
+            attempt = 0;
+    }
+    end_requests(&session);
+    close_session(&session);
+    free(batch);
+    return created;
+}
+
+// Runs one connection of the benchmark until the duration is over and every request it sent is answered.
+// Requests are sent without blocking as long as fewer than in_flight are waiting. When a rate is given, every
+// request has a planned send time and its latency is measured from that time, so a server that falls behind is
+// not hidden by the requests that are sent late.
+void run_connection(int connection, const Options *options, char (*ids)[20], const Workload_Reader *workload, Histogram *histograms)
+{
+    Session session;
+    session.request_fd = session.response_fd = -1;
+    if (options->use_socket)
+        open_socket_session(&session);
+    else
+        open_session(&session, options->in_flight);
+    // Both sides are non-blocking, so a full fifo or socket never stops the connection from reading its responses.
+    fcntl(session.request_fd, F_SETFL, O_NONBLOCK);
+    if (!session.use_socket)
+        fcntl(session.response_fd, F_SETFL, O_NONBLOCK);
+
+    Workload_Reader reader = *workload;
+    unsigned int seed = (unsigned int)time(NULL) ^ (getpid() << 8) ^ connection;
+    int in_flight = options->in_flight;
+    // Responses come back in any order, so request ids are places in these arrays that are given back when the
+    // response arrives instead of a counter.
+    double *planned = malloc(in_flight * sizeof(double));
+    int *operations = malloc(in_flight * sizeof(int));
+    int *free_ids = malloc(in_flight * sizeof(int));
+    int free_count = in_flight;
+    for (int i = 0; i < in_flight; i++)
+        free_ids[i] = in_flight - 1 - i;
+    Session_Request *batch = malloc(in_flight * sizeof(Session_Request));
+    size_t output_start = 0, output_end = 0;
+    char *input = malloc(in_flight * sizeof(Session_Response));
+    size_t input_length = 0;
+    unsigned long long sent = 0, received = 0;
+    double interval = options->rate > 0 ? options->connections / options->rate : 0;
+    double start = now_seconds(), deadline = start + options->duration, next_send = start;
+    int stopping = 0;
+
+    while (!stopping || received < sent || output_end > output_start)
+    {
+        double t = now_seconds();
+        if (!stopping && t >= deadline)
+            stopping = 1;
+        // Next batch is made only when the previous one is written completely.
+        if (!stopping && output_end == output_start)
+        {
+            int count = 0;
+            while (free_count > 0 && (interval == 0 || next_send <= t))
+            {
+                Session_Request *session_request = &batch[count];
+                memset(session_request, 0, sizeof(Session_Request));
+                int has_request = options->replay_file != NULL ? next_replayed_request(&reader, &session_request->request)
+                                                                 : next_synthetic_request(options, ids, &seed, &session_request->request);
+                if (!has_request)
+                {
+                    stopping = 1;
+                    break;
+                }
+                int id = free_ids[--free_count];
+                session_request->request_id = id;
+                session_request->request.client_pid = getpid();
+                planned[id] = interval > 0 ? next_send : t;
+                operations[id] = operation_of(&session_request->request);
+                next_send += interval;
+                count++;
+            }
+            output_start = 0;
+            output_end = count * sizeof(Session_Request);
+            sent += count;
+        }
+        if (output_end > output_start)
+        {
+            ssize_t bytes = write(session.request_fd, (char *)batch + output_start, output_end - output_start);
+            if (bytes > 0)
+                output_start += bytes;
+            else if (bytes == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                perror("Bankbench write requests");
+                break;
+            }
+        }
+        if (stopping && output_end == output_start)
+            end_requests(&session);
+        if (output_end == output_start && received == sent && stopping)
+            break;
+
+        // Wait for responses, for room to write, or until the next planned request or the end of the run.
+        struct pollfd poll_fds[2];
+        int poll_count = 0, timeout_ms = -1;
+        poll_fds[poll_count++] = (struct pollfd){session.response_fd, POLLIN, 0};
+        if (output_end > output_start)
+        {
+            if (session.use_socket)
+                poll_fds[0].events |= POLLOUT;
+            else
+                poll_fds[poll_count++] = (struct pollfd){session.request_fd, POLLOUT, 0};
+        }
+        else if (!stopping)
+        {
+            double until = deadline;
+            if (free_count > 0)
+                until = interval > 0 && next_send < deadline ? next_send : t;
+            timeout_ms = until <= t ? 0 : (int)((until - t) * 1000) + 1;
+        }
+        if (timeout_ms != 0 && poll(poll_fds, poll_count, timeout_ms) == -1 && errno != EINTR)
+        {
+            perror("poll failed");
+            break;
+        }
+
+        ssize_t bytes = read(session.response_fd, input + input_length, in_flight * sizeof(Session_Response) - input_length);
+        if (bytes == 0)
+        {
+            if (received < sent)
+                fprintf(stderr, "Session closed by the server after %llu of %llu responses.\n", received, sent);
+            break;
+        }
+        if (bytes <= 0)
+            continue;
+        input_length += bytes;
+        t = now_seconds();
+        size_t used = 0;
+        while (input_length - used >= sizeof(Session_Response))
+        {
+            Session_Response response;
+            memcpy(&response, input + used, sizeof(Session_Response));
+            used += sizeof(Session_Response);
+            if (response.request_id >= (unsigned int)in_flight)
+                continue;
+            int id = response.request_id;
+            histogram_add(&histograms[operations[id]], (t - planned[id]) * 1000000.0, response.result);
+            free_ids[free_count++] = id;
+            received++;
+        }
+        memmove(input, input + used, input_length - used);
+        input_length -= used;
+    }
+    end_requests(&session);
+    close_session(&session);
+    free(planned);
+    free(operations);
+    free(free_ids);
+    free(batch);
+    free(input);
+}
+
+// Makes up a request: a balance query with the read percent, a deposit or a withdrawal of one credit otherwise.
+int next_synthetic_request(const Options *options, char (*ids)[20], unsigned int *seed, Request *request)
+{
+    strcpy(request->account_id, ids[rand_r(seed) % options->accounts]);
+    int r = rand_r(seed) % 100;
+    request->amount = 1;
+    if (r < options->read_percent)
+        strcpy(request->operation, "balance");
+    else if (r < options->read_percent + options->transfer_percent && options->accounts > 1)
+    {
+        // Second account is any other one, so a transfer never names the same account twice.
+        int to = rand_r(seed) % (options->accounts - 1);
+        if (strcmp(ids[to], request->account_id) == 0)
+            to = options->accounts - 1;
+        strcpy(request->operation, "transfer");
+        request->leg_count = 2;
+        strcpy(request->legs[0].account_id, request->account_id);
+        request->legs[0].amount = -1;
+        strcpy(request->legs[1].account_id, ids[to]);
+        request->legs[1].amount = 1;
+    }
+    else
+        strcpy(request->operation, r % 2 ? "deposit" : "withdraw");
+    return 1;
+}
+
+// Takes the next request of the replayed file, the file is started again when it ends. Lines that are not
+// "<account> <operation> [amount]" are skipped. Returns 0 if the file has no valid lines at all.
+int next_replayed_request(Workload_Reader *reader, Request *request)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        while (reader->pos < reader->size)
+        {
+            const char *line = reader->data + reader->pos;
+            const char *newline = memchr(line, '\n', reader->size - reader->pos);
+            size_t length = (newline ? newline : reader->data + reader->size) - line;
+            reader->pos += length + (newline != NULL);
+            char text[128];
+            if (length >= sizeof(text))
+                continue;
+            memcpy(text, line, length);
+            text[length] = '\0';
+            request->amount = 0;
+            int fields = sscanf(text, "%19s %9s %d %19s", request->account_id, request->operation, &request->amount,
+                                request->legs[1].account_id);
+            if (strcmp(request->operation, "transfer") == 0)
+            {
+                // Only the "<from> transfer <amount> <to>" form is replayed.
+                if (fields != 4)
+                    continue;
+                request->leg_count = 2;
+                strcpy(request->legs[0].account_id, request->account_id);
+                request->legs[0].amount = -request->amount;
+                request->legs[1].amount = request->amount;
+                return 1;
+            }
+            if (fields == 3 || (fields == 2 && strcmp(request->operation, "balance") == 0))
+                return 1;
+        }
+        reader->pos = 0;
+    }
+    return 0;
+}
+
+// Kind of the request for the statistics.
+int operation_of(const Request *request)
+{
+    if (strcmp(request->operation, "balance") == 0)
+        return OP_BALANCE;
+    if (strcmp(request->operation, "transfer") == 0)
+        return OP_TRANSFER;
+    if (strcmp(request->account_id, "N") == 0)
+        return OP_CREATE;
+    if (strcmp(request->operation, "withdraw") == 0)
+        return OP_WITHDRAW;
+    return OP_DEPOSIT;
+}
+
+// Bucket of a latency, see Histogram.
+static int bucket_of(unsigned long long value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 3) * HISTOGRAM_SUB_BUCKETS + ((value >> (msb - 4)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Largest latency that falls into the bucket.
+static double bucket_limit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int msb = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+    int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (double)((unsigned long long)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (msb - 4)) - 1;
+}
+
+void histogram_add(Histogram *histogram, double latency_us, int result)
+{
+    if (latency_us < 0)
+        latency_us = 0;
+    histogram->counts[bucket_of((unsigned long long)latency_us)]++;
+    histogram->total++;
+    histogram->rejected += result == 0;
+    histogram->busy += result == RESULT_BUSY;
+    histogram->sum_us += latency_us;
+    if (latency_us > histogram->max_us)
+        histogram->max_us = latency_us;
+}
+
+// Latency that the given fraction of the requests did not exceed, within the width of a bucket.
+double histogram_percentile(const Histogram *histogram, double percentile)
+{
+    if (histogram->total == 0)
+        return 0;
+    unsigned long long target = (unsigned long long)(percentile * histogram->total);
+    if (target >= histogram->total)
+        target = histogram->total - 1;
+    unsigned long long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        seen += histogram->counts[b];
+        if (seen > target)
+            return bucket_limit(b) < histogram->max_us ? bucket_limit(b) : histogram->max_us;
+    }
+    return histogram->max_us;
+}
+
+// Prints the throughput and the latency percentiles of every operation and of all of them together.
+void print_report(const Options *options, Histogram *histograms, double elapsed)
+{
+    Histogram all;
+    memset(&all, 0, sizeof(all));
+    printf("\n%d connections, %d requests in flight each, %.1f s", options->connections, options->in_flight, elapsed);
+    if (options->rate > 0)
+        printf(", planned rate %.0f/s", options->rate);
+    if (options->replay_file != NULL)
+        printf(", replaying %s\n", options->replay_file);
+    else
+        printf(", %d accounts, %d%% reads, %d%% transfers\n", options->accounts, options->read_percent, options->transfer_percent);
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "operation", "requests", "rejected", "busy", "per sec",
+           "avg us", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op = 0; op <= OP_COUNT; op++)
+    {
+        Histogram *histogram = op < OP_COUNT ? &histograms[op] : &all;
+        if (op < OP_COUNT)
+        {
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+                all.counts[b] += histogram->counts[b];
+            all.total += histogram->total;
+            all.rejected += histogram->rejected;
+            all.busy += histogram->busy;
+            all.sum_us += histogram->sum_us;
+            if (histogram->max_us > all.max_us)
+                all.max_us = histogram->max_us;
+        }
+        if (histogram->total == 0)
+            continue;
+        printf("%-10s %10llu %10llu %10llu %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", op < OP_COUNT ? operation_names[op] : "total",
+               histogram->total, histogram->rejected, histogram->busy, histogram->total / elapsed, histogram->sum_us / histogram->total,
+               histogram_percentile(histogram, 0.50), histogram_percentile(histogram, 0.99),
+               histogram_percentile(histogram, 0.999), histogram->max_us);
+    }
+}
+
+// Time to wait before trying again after a busy answer, the same way as the client does it.
+int retry_delay_ms(const char *message, int attempt)
+{
+    const char *hint = strstr(message, "retry after ");
+    int delay = hint != NULL ? atoi(hint + strlen("retry after ")) : 10;
+    if (delay < 1)
+        delay = 1;
+    for (int i = 0; i < attempt && delay < MAX_BACKOFF_MS; i++)
+        delay *= 2;
+    if (delay > MAX_BACKOFF_MS)
+        delay = MAX_BACKOFF_MS;
+    return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Maps the replayed file, same as in client.c.
+void open_workload(const char *filename, Workload_Reader *reader)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+    reader->size = st.st_size;
+    reader->pos = 0;
+    reader->line_number = 0;
+    reader->data = NULL;
+    if (reader->size > 0)
+    {
+        reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (reader->data == MAP_FAILED)
+        {
+            perror("mmap failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+}
+
+// Makes the pipe of the fifo large enough for the given number of bytes if it is not already. Returns 0 if it can not.
+int fit_pipe(int fd, size_t bytes)
+{
+    if (bytes <= DEFAULT_PIPE_SIZE)
+        return 1;
+#ifdef F_SETPIPE_SZ
+    return fcntl(fd, F_SETPIPE_SZ, (int)bytes) != -1;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bankformat.h"
+
+#define DB_FILE "database.txt"
+#define DB_BINARY_FILE "database.bin"
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// Structures
+
+// A database.bin that is mapped for reading.
+typedef struct
+{
+    const char *data;
+    size_t size;
+    const Database_Header *header;
+    const void *records;
+} Binary_Database;
+
+// Explanations for functions are under main where definitions are done.
+int import_text(const char *text_path, const char *binary_path, int delta);
+int export_text(const char *binary_path, const char *text_path);
+int print_info(const char *binary_path);
+int open_binary(const char *path, Binary_Database *database);
+int id_number(const char *account_id);
+void usage(const char *program);
+
+// Bankdb converts the database between the text format (database.txt) and the binary one that the server loads
+// and saves (database.bin), and prints the header of a binary database.
+int main(int argc, char *argv[])
+{
+    int delta = 0, opt;
+    while ((opt = getopt(argc, argv, "d")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            delta = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+    const char *command = argv[optind];
+    const char *first = optind + 1 < argc ? argv[optind + 1] : NULL;
+    const char *second = optind + 2 < argc ? argv[optind + 2] : NULL;
+    if (strcmp(command, "import") == 0)
+        return import_text(first ? first : DB_FILE, second ? second : DB_BINARY_FILE, delta);
+    if (strcmp(command, "export") == 0)
+        return export_text(first ? first : DB_BINARY_FILE, second ? second : DB_FILE);
+    if (strcmp(command, "info") == 0)
+        return print_info(first ? first : DB_BINARY_FILE);
+    usage(argv[0]);
+    return 1;
+}
+
+// Reads "<id> <balance>" lines and writes them as a binary database. Lines that are not valid are skipped.
+// With delta the ids are stored as differences of their numbers, if every id is a BankID_ id that can be written
+// back the same way.
+int import_text(const char *text_path, const char *binary_path, int delta)
+{
+    FILE *text = fopen(text_path, "r");
+    if (!text)
+    {
+        perror(text_path);
+        return 1;
+    }
+    size_t capacity = 1024, count = 0;
+    Account *accounts = malloc(capacity * sizeof(Account));
+    char line[256];
+    long line_number = 0, skipped = 0;
+    int max_id = 0;
+    while (fgets(line, sizeof(line), text))
+    {
+        line_number++;
+        char id[64], rest[2];
+        long long balance;
+        int fields = sscanf(line, "%63s %lld %1s", id, &balance, rest);
+        if (fields != 2 || strlen(id) >= sizeof(accounts[0].account_id) || balance < INT_MIN || balance > INT_MAX)
+        {
+            if (sscanf(line, "%1s", rest) == 1)
+            {
+                fprintf(stderr, "Line %ld of %s is not valid and is skipped.\n", line_number, text_path);
+                skipped++;
+            }
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            accounts = realloc(accounts, capacity * sizeof(Account));
+        }
+        memset(&accounts[count], 0, sizeof(Account));
+        strcpy(accounts[count].account_id, id);
+        accounts[count].balance = balance;
+        int number = id_number(id);
+        if (number > max_id)
+            max_id = number;
+        if (number == -1 && delta)
+        {
+            fprintf(stderr, "%s is not written as BankID_ and its number, ids are not delta encoded.\n", id);
+            delta = 0;
+        }
+        count++;
+    }
+    fclose(text);
+    if (count > INT_MAX)
+    {
+        fprintf(stderr, "%s has too many accounts.\n", text_path);
+        return 1;
+    }
+
+    Database_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DB_BINARY_MAGIC, sizeof(header.magic));
+    header.version = DB_BINARY_VERSION;
+    header.count = count;
+    header.next_id = max_id + 1;
+    void *records = accounts;
+    size_t bytes = count * sizeof(Account);
+    header.record_size = sizeof(Account);
+    if (delta)
+    {
+        // Records are written over the accounts, a Delta_Account is smaller than an Account.
+        Delta_Account *deltas = records;
+        int previous = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            int number = id_number(accounts[i].account_id);
+            Delta_Account record = {number - previous, accounts[i].balance};
+            deltas[i] = record;
+            previous = number;
+        }
+        header.flags = DB_DELTA_IDS;
+        header.record_size = sizeof(Delta_Account);
+        bytes = count * sizeof(Delta_Account);
+    }
+    header.checksum = crc32(records, bytes);
+
+    // Written under a temporary name and renamed, so a failed import leaves the old file.
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", binary_path);
+    FILE *binary = fopen(temp_path, "w");
+    if (!binary || fwrite(&header, sizeof(header), 1, binary) != 1 || fwrite(records, 1, bytes, binary) != bytes ||
+        fclose(binary) != 0 || rename(temp_path, binary_path) == -1)
+    {
+        perror(binary_path);
+        unlink(temp_path);
+        free(accounts);
+        return 1;
+    }
+    free(accounts);
+    printf("%zu accounts written to %s (%s, %zu bytes), %ld lines skipped.\n", count, binary_path,
+           delta ? "delta ids" : "fixed ids", sizeof(header) + bytes, skipped);
+    return 0;
+}
+
+// Writes the accounts of a binary database as "<id> <balance>" lines.
+int export_text(const char *binary_path, const char *text_path)
+{
+    Binary_Database database;
+    if (!open_binary(binary_path, &database))
+        return 1;
+    FILE *text = fopen(text_path, "w");
+    if (!text)
+    {
+        perror(text_path);
+        munmap((void *)database.data, database.size);
+        return 1;
+    }
+    setvbuf(text, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    const Account *accounts = database.records;
+    const Delta_Account *deltas = database.records;
+    int number = 0;
+    for (int i = 0; i < database.header->count; i++)
+    {
+        if (database.header->flags & DB_DELTA_IDS)
+        {
+            number += deltas[i].id_delta;
+            fprintf(text, "BankID_%02d %d\n", number, deltas[i].balance);
+        }
+        else
+        {
+            fprintf(text, "%s %d\n", accounts[i].account_id, accounts[i].balance);
+        }
+    }
+    if (fclose(text) != 0)
+    {
+        perror(text_path);
+        munmap((void *)database.data, database.size);
+        return 1;
+    }
+    printf("%d accounts written to %s.\n", database.header->count, text_path);
+    munmap((void *)database.data, database.size);
+    return 0;
+}
+
+int print_info(const char *binary_path)
+{
+    Binary_Database database;
+    if (!open_binary(binary_path, &database))
+        return 1;
+    const Database_Header *header = database.header;
+    printf("version  %d\n", header->version);
+    printf("records  %s, %u bytes each\n", header->flags & DB_DELTA_IDS ? "delta ids" : "fixed ids", header->record_size);
+    printf("accounts %d\n", header->count);
+    printf("next id  %d\n", header->next_id);
+    printf("checksum %08x\n", header->checksum);
+    if (header->version > 1 && (header->flags & DB_HAS_LSN))
+        printf("lsn      %llu\n", header->lsn);
+    printf("size     %zu bytes\n", database.size);
+    munmap((void *)database.data, database.size);
+    return 0;
+}
+
+// Maps a binary database and checks it the same way the server does. Returns 0 if it is not valid.
+int open_binary(const char *path, Binary_Database *database)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    database->size = st.st_size;
+    database->data = database->size >= database_header_size(1) ? mmap(NULL, database->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (database->data == MAP_FAILED)
+    {
+        fprintf(stderr, "%s is not a binary database.\n", path);
+        return 0;
+    }
+    database->header = (const Database_Header *)database->data;
+    const Database_Header *header = database->header;
+    size_t header_size = database_header_size(header->version);
+    database->records = database->data + header_size;
+    size_t record_size = header->flags & DB_DELTA_IDS ? sizeof(Delta_Account) : sizeof(Account);
+    size_t bytes = (size_t)header->count * record_size;
+    if (memcmp(header->magic, DB_BINARY_MAGIC, sizeof(header->magic)) != 0 || header_size == 0 ||
+        header->record_size != record_size || header->count < 0 || database->size != header_size + bytes)
+    {
+        fprintf(stderr, "%s is not a binary database of this version.\n", path);
+        munmap((void *)database->data, database->size);
+        return 0;
+    }
+    if (crc32(database->records, bytes) != header->checksum)
+    {
+        fprintf(stderr, "%s is damaged, its checksum does not match.\n", path);
+        munmap((void *)database->data, database->size);
+        return 0;
+    }
+    if ((header->flags & DB_DELTA_IDS) && !database_deltas_valid(database->records, header->count))
+    {
+        fprintf(stderr, "%s is damaged, its ids do not give valid BankID_ numbers.\n", path);
+        munmap((void *)database->data, database->size);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns the number of a BankID_ id, or -1 if the id would not be written back the same from its number.
+int id_number(const char *account_id)
+{
+    if (strncmp(account_id, "BankID_", 7) != 0)
+        return -1;
+    char *end;
+    long number = strtol(account_id + 7, &end, 10);
+    if (*end != '\0' || account_id[7] < '0' || account_id[7] > '9' || number > INT_MAX)
+        return -1;
+    char again[32];
+    snprintf(again, sizeof(again), "BankID_%02ld", number);
+    return strcmp(again, account_id) == 0 ? (int)number : -1;
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s import [-d] [text_file [binary_file]]\n", program);
+    fprintf(stderr, "       %s export [binary_file [text_file]]\n", program);
+    fprintf(stderr, "       %s info [binary_file]\n", program);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,1031 @@
+#define _GNU_SOURCE // For strptime.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "bankformat.h"
+
+#define STORE_FILE "bank.store"
+#define AUDIT_DIR "audit"
+#define AUDIT_SEGMENT_TEMPLATE "%s/%016llu.seg"
+#define AUDIT_INDEX_TEMPLATE "%s/%016llu.idx"
+#define MAX_THREADS 16
+#define WORK_PIECE 65536       // Audit records or index entries that a thread takes at a time.
+#define DEFAULT_PREFIX 8       // Balances are summed by this many first characters of the ids.
+#define MAX_PREFIX 8           // A prefix is kept in one 64 bit key.
+#define BALANCE_BUCKETS 33     // Negative, zero and one bucket for every power of two.
+#define MISMATCHES_SHOWN 20    // Accounts that do not reconcile printed by every thread.
+
+// Structures
+
+// Accounts of a store, checkpoint or binary database file, as they are in the mapped file.
+typedef struct
+{
+    const char *path;
+    const char *kind;
+    void *data;
+    size_t size;
+    const Account *accounts;      // NULL for a database with delta encoded ids.
+    const Delta_Account *deltas;
+    long count;
+    int has_lsn;                  // Not set for a live store and a database.bin that was not written by the server.
+    unsigned long long lsn;       // Accounts hold exactly the changes of the log up to and including this LSN.
+} Snapshot;
+
+// Accounts copied column by column (struct of arrays), so that the reductions walk over plain arrays of numbers
+// instead of 24 byte records. Accounts of the opening snapshot that are not in the current one any more come after
+// the current ones with a current balance of 0.
+typedef struct
+{
+    long count;                   // Accounts of the current snapshot.
+    long total;                   // Together with the ones that are only in the opening snapshot.
+    char (*ids)[20];
+    int *current;
+    int *opening;
+    long long *net;               // Deposits minus withdrawals of the account in the audit window.
+    unsigned long long *prefixes; // First characters of the id packed into a number, in the order of the characters.
+    int *slots;                   // Open addressing hash table from id to place in the columns, -1 is empty.
+    unsigned int slot_mask;
+} Columns;
+
+// An audit segment with its index, mapped for reading. Index is only used when it is complete.
+typedef struct
+{
+    const Audit_Entry *entries;
+    unsigned int count;
+    const Audit_Index_Header *header;
+    const Audit_Account_Entry *accounts;
+    size_t index_size;
+} Log_Segment;
+
+// Piece of the audit that a thread adds up: records of a segment read one by one, or account entries of a segment
+// index that is entirely in the window.
+typedef struct
+{
+    const Log_Segment *segment;
+    int from_index;
+    unsigned int first;
+    unsigned int last;
+} Audit_Work;
+
+// Sums of prefixes in one thread, an open addressing table that doubles when it is half full. Key 0 is empty.
+typedef struct
+{
+    unsigned long long *keys;
+    long *counts;
+    long long *sums;
+    size_t size;
+    size_t used;
+} Prefix_Table;
+
+// What one thread found, added together by main after the threads finish.
+typedef struct
+{
+    long long balance_sum;
+    int min_balance;
+    int max_balance;
+    long bucket_counts[BALANCE_BUCKETS];
+    long long bucket_sums[BALANCE_BUCKETS];
+    Prefix_Table prefixes;
+    unsigned long long deposit_count;
+    unsigned long long withdraw_count;
+    long long deposit_sum;
+    long long withdraw_sum;
+    unsigned long long records_read;
+    unsigned long long index_entries_read;
+    unsigned long long unknown_records; // Audit of accounts that are in neither snapshot (opened and closed in the window).
+    long long unknown_net;
+    long long opening_sum;
+    long long net_sum;
+    long mismatches;
+    long long mismatch_sum;
+    long shown[MISMATCHES_SHOWN];
+    int shown_count;
+} Thread_Result;
+
+// Range of the columns that a thread works on.
+typedef struct
+{
+    int thread;
+    long from;
+    long to;
+} Part;
+
+// Everything the threads share. Threads only write their own result, their own range of the columns, the hash
+// table slots with compare and swap and the net column with atomic adds.
+Columns columns;
+Snapshot current_snapshot, opening_snapshot;
+int has_opening = 0;
+int prefix_length = DEFAULT_PREFIX;
+long long from_us = LLONG_MIN, to_us = LLONG_MAX;
+unsigned long long from_lsn = 0, to_lsn = ULLONG_MAX; // Audit window is the records after from_lsn up to to_lsn.
+Thread_Result results[MAX_THREADS];
+Audit_Work *audit_work;
+int audit_work_count;
+int next_audit_work = 0;
+
+// Explanations for functions are under main where definitions are done.
+int open_snapshot(const char *path, Snapshot *snapshot);
+int audit_has_lsns(const char *directory);
+void run_threads(void *(*work)(void *), int thread_count, long count);
+void *copy_current(void *arg);
+void *index_current(void *arg);
+void *add_opening(void *arg);
+void *aggregate(void *arg);
+void *add_audit(void *arg);
+void *reconcile(void *arg);
+long find_account(const char *account_id);
+unsigned int hash_account_id(const char *account_id);
+unsigned long long prefix_key(const char *account_id);
+void prefix_add(Prefix_Table *table, unsigned long long key, long count, long long sum);
+int bucket_of(int balance);
+int list_segments(const char *directory, unsigned long long **segments);
+int open_segment(const char *directory, unsigned long long first_seq, Log_Segment *segment);
+void print_report(int thread_count, int segment_count);
+long long parse_time(const char *text);
+void format_time(long long time_us, char *buffer, size_t size);
+double seconds_since(const struct timespec *start);
+void usage(const char *program);
+
+// Bankeod is the end of day job. It reads the accounts of the live store, a checkpoint or a binary database and
+// prints the total of the balances, their sums by id prefix and a histogram of them, and the deposits and
+// withdrawals of the audit log up to the accounts. Given the accounts at the start of the day (-o), it checks that
+// every account changed by exactly what the audit log says: opening balance + deposits - withdrawals = balance.
+int main(int argc, char *argv[])
+{
+    const char *directory = AUDIT_DIR, *opening_path = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+    int from_given = 0, to_given = 0, opt;
+    while ((opt = getopt(argc, argv, "o:d:f:t:p:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            opening_path = optarg;
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'f':
+            from_us = parse_time(optarg);
+            from_given = 1;
+            break;
+        case 't':
+            to_us = parse_time(optarg);
+            to_given = 1;
+            break;
+        case 'p':
+            prefix_length = atoi(optarg);
+            if (prefix_length < 1 || prefix_length > MAX_PREFIX)
+            {
+                fprintf(stderr, "Prefix length should be between 1 and %d\n", MAX_PREFIX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            thread_count = atoi(optarg);
+            if (thread_count < 1 || thread_count > MAX_THREADS)
+            {
+                fprintf(stderr, "Threads should be between 1 and %d\n", MAX_THREADS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc - 1)
+        usage(argv[0]);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (!open_snapshot(optind < argc ? argv[optind] : STORE_FILE, &current_snapshot))
+        exit(EXIT_FAILURE);
+    if (opening_path != NULL)
+    {
+        if (!open_snapshot(opening_path, &opening_snapshot))
+            exit(EXIT_FAILURE);
+        has_opening = 1;
+    }
+    // Audit window is cut at the log positions of the snapshots. A snapshot at LSN n holds exactly the changes of the
+    // audit records up to seq n, so the records in between are the changes from one to the other. Times can only
+    // narrow a report, they can not say which changes a file holds.
+    int lsns_known = audit_has_lsns(directory);
+    if (has_opening)
+    {
+        const Snapshot *unknown = !opening_snapshot.has_lsn ? &opening_snapshot : &current_snapshot;
+        if (from_given || to_given)
+        {
+            fprintf(stderr, "-f and -t can not be used with -o, the window is between the log positions of the files.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!opening_snapshot.has_lsn || !current_snapshot.has_lsn)
+        {
+            fprintf(stderr, "%s (%s) does not say which changes of the log it holds, it can not be reconciled. "
+                            "Use a checkpoint or the files of a stopped server.\n", unknown->path, unknown->kind);
+            exit(EXIT_FAILURE);
+        }
+        if (opening_snapshot.lsn > current_snapshot.lsn)
+        {
+            fprintf(stderr, "%s is newer than %s.\n", opening_snapshot.path, current_snapshot.path);
+            exit(EXIT_FAILURE);
+        }
+        if (!lsns_known)
+        {
+            fprintf(stderr, "Records of %s are not numbered by the log, it can not be reconciled.\n", directory);
+            exit(EXIT_FAILURE);
+        }
+        from_lsn = opening_snapshot.lsn;
+    }
+    if (current_snapshot.has_lsn && lsns_known)
+        to_lsn = current_snapshot.lsn;
+
+    // Columns have place for both snapshots, the hash table is at most half full.
+    long places = current_snapshot.count + (has_opening ? opening_snapshot.count : 0);
+    unsigned long slots = 1024;
+    while (slots < 2 * (unsigned long)places)
+        slots *= 2;
+    columns.count = columns.total = current_snapshot.count;
+    columns.ids = malloc((places + 1) * sizeof(*columns.ids));
+    columns.current = malloc((places + 1) * sizeof(int));
+    columns.opening = calloc(places + 1, sizeof(int));
+    columns.net = calloc(places + 1, sizeof(long long));
+    columns.prefixes = malloc((places + 1) * sizeof(unsigned long long));
+    columns.slots = malloc(slots * sizeof(int));
+    columns.slot_mask = slots - 1;
+    if (!columns.ids || !columns.current || !columns.opening || !columns.net || !columns.prefixes || !columns.slots)
+    {
+        fprintf(stderr, "Not enough memory for %ld accounts.\n", places);
+        exit(EXIT_FAILURE);
+    }
+    memset(columns.slots, -1, slots * sizeof(int));
+
+    run_threads(copy_current, thread_count, current_snapshot.count);
+    run_threads(index_current, thread_count, current_snapshot.count);
+    if (has_opening)
+        run_threads(add_opening, thread_count, opening_snapshot.count);
+    munmap(current_snapshot.data, current_snapshot.size);
+    if (has_opening)
+        munmap(opening_snapshot.data, opening_snapshot.size);
+    fprintf(stderr, "Columns of %ld accounts ready in %.2f s.\n", columns.total, seconds_since(&started));
+    run_threads(aggregate, thread_count, columns.count);
+
+    // Audit is cut into pieces that the threads take one by one, so a large segment is shared by all of them.
+    unsigned long long *first_seqs;
+    int segment_count = list_segments(directory, &first_seqs);
+    Log_Segment *segments = calloc(segment_count + 1, sizeof(Log_Segment));
+    audit_work = malloc(sizeof(Audit_Work));
+    audit_work_count = 0;
+    int work_size = 1;
+    unsigned long long covered = from_lsn; // Records of the window are all there up to this one.
+    unsigned long long missing_from = 0, missing_to = 0;
+    for (int i = 0; i < segment_count; i++)
+    {
+        Log_Segment *segment = &segments[i];
+        if (!open_segment(directory, first_seqs[i], segment) || segment->count == 0)
+            continue;
+        // Records of a segment have consecutive sequence numbers, so the window is a range of places in it.
+        unsigned long long first_seq = first_seqs[i], last_seq = first_seq + segment->count - 1;
+        if (first_seq > covered + 1 && first_seq <= to_lsn && missing_from == 0)
+        {
+            missing_from = covered + 1;
+            missing_to = first_seq - 1;
+        }
+        if (last_seq > covered)
+            covered = last_seq;
+        if (last_seq <= from_lsn || first_seq > to_lsn)
+            continue;
+        unsigned int from = from_lsn >= first_seq ? from_lsn + 1 - first_seq : 0;
+        unsigned int to = to_lsn < last_seq ? to_lsn + 1 - first_seq : segment->count;
+        int from_index = 0;
+        if (segment->header != NULL)
+        {
+            if (segment->header->max_time_us < from_us || segment->header->min_time_us >= to_us)
+                continue;
+            if (segment->header->min_time_us >= from_us && segment->header->max_time_us < to_us &&
+                segment->header->record_count == segment->count && from == 0 && to == segment->count)
+            {
+                from_index = 1;
+                to = segment->header->account_count;
+            }
+        }
+        for (unsigned int first = from; first < to; first += WORK_PIECE)
+        {
+            if (audit_work_count == work_size)
+            {
+                work_size *= 2;
+                audit_work = realloc(audit_work, work_size * sizeof(Audit_Work));
+            }
+            Audit_Work work = {segment, from_index, first, to - first < WORK_PIECE ? to : first + WORK_PIECE};
+            audit_work[audit_work_count++] = work;
+        }
+    }
+    if (has_opening && missing_from == 0 && covered < to_lsn)
+    {
+        missing_from = covered + 1;
+        missing_to = to_lsn;
+    }
+    if (has_opening && missing_from != 0)
+    {
+        fprintf(stderr, "Audit in %s misses the records %llu to %llu of the window, it can not be reconciled.\n", directory,
+                missing_from, missing_to);
+        exit(EXIT_FAILURE);
+    }
+    run_threads(add_audit, thread_count, 0);
+    fprintf(stderr, "Audit of %d segments added up in %.2f s.\n", segment_count, seconds_since(&started));
+    if (has_opening)
+        run_threads(reconcile, thread_count, columns.total);
+
+    print_report(thread_count, segment_count);
+    fprintf(stderr, "Done in %.2f s with %d threads.\n", seconds_since(&started), thread_count);
+    long mismatches = 0;
+    for (int t = 0; t < thread_count; t++)
+        mismatches += results[t].mismatches;
+    return mismatches > 0 ? 2 : 0;
+}
+
+// Maps a store, checkpoint or binary database file and finds its accounts. The kind is known from the magic at its
+// start. Returns 0 if the file can not be used.
+int open_snapshot(const char *path, Snapshot *snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    snapshot->size = st.st_size;
+    // Store is shared with a running server, the other files are private.
+    snapshot->data = snapshot->size >= 8 ? mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (snapshot->data == MAP_FAILED)
+    {
+        fprintf(stderr, "%s is not a store, checkpoint or binary database.\n", path);
+        return 0;
+    }
+    madvise(snapshot->data, snapshot->size, MADV_SEQUENTIAL);
+    const char *data = snapshot->data;
+    size_t bytes = 0;
+    if (memcmp(data, STORE_MAGIC, 8) == 0 && snapshot->size >= STORE_HEADER_SIZE)
+    {
+        // Accounts of a running server are read without its locks, the balances are the ones of that moment and
+        // there is no log position that they are exact at.
+        const Store_Header *header = (const Store_Header *)data;
+        snapshot->kind = header->clean ? "store" : "live store";
+        snapshot->accounts = (const Account *)(data + STORE_HEADER_SIZE);
+        snapshot->count = header->db_size;
+        if ((header->version != STORE_VERSION && header->version != 2) || header->db_size > header->capacity)
+            snapshot->count = -1;
+        bytes = (size_t)header->capacity * sizeof(Account);
+        snapshot->has_lsn = header->clean && header->version == STORE_VERSION;
+        snapshot->lsn = header->lsn;
+        if (snapshot->count >= 0 && snapshot->size >= STORE_HEADER_SIZE + bytes)
+            return 1;
+    }
+    else if (memcmp(data, CHECKPOINT_MAGIC, 8) == 0 && snapshot->size >= sizeof(Checkpoint_Header))
+    {
+        const Checkpoint_Header *header = (const Checkpoint_Header *)data;
+        snapshot->kind = "checkpoint";
+        snapshot->accounts = (const Account *)(header + 1);
+        snapshot->count = header->count;
+        snapshot->has_lsn = 1;
+        snapshot->lsn = header->lsn;
+        bytes = (size_t)header->count * sizeof(Account);
+        if (header->count >= 0 && snapshot->size == sizeof(Checkpoint_Header) + bytes &&
+            crc32(snapshot->accounts, bytes) == header->checksum)
+            return 1;
+    }
+    else if (memcmp(data, DB_BINARY_MAGIC, 8) == 0 && snapshot->size >= database_header_size(1))
+    {
+        const Database_Header *header = (const Database_Header *)data;
+        size_t header_size = database_header_size(header->version);
+        snapshot->kind = "database";
+        snapshot->count = header->count;
+        snapshot->has_lsn = header->version > 1 && (header->flags & DB_HAS_LSN);
+        snapshot->lsn = snapshot->has_lsn ? header->lsn : 0;
+        if (header->flags & DB_DELTA_IDS)
+        {
+            snapshot->deltas = (const Delta_Account *)(data + header_size);
+            bytes = (size_t)header->count * sizeof(Delta_Account);
+        }
+        else
+        {
+            snapshot->accounts = (const Account *)(data + header_size);
+            bytes = (size_t)header->count * sizeof(Account);
+        }
+        if (header_size != 0 && header->count >= 0 && snapshot->size == header_size + bytes &&
+            crc32(data + header_size, bytes) == header->checksum &&
+            (!snapshot->deltas || database_deltas_valid(snapshot->deltas, header->count)))
+            return 1;
+    }
+    fprintf(stderr, "%s is not a store, checkpoint or binary database of this version, or it is damaged.\n", path);
+    munmap(snapshot->data, snapshot->size);
+    return 0;
+}
+
+// Audit records are numbered by the LSNs of their log records only in an audit directory with the format file,
+// older ones numbered them by themselves.
+int audit_has_lsns(const char *directory)
+{
+    char path[PATH_MAX], format[sizeof(AUDIT_FORMAT_MAGIC)] = "";
+    snprintf(path, sizeof(path), "%s/%s", directory, AUDIT_FORMAT_FILE);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+    if (fread(format, 1, sizeof(format) - 1, file) != sizeof(format) - 1)
+        format[0] = '\0';
+    fclose(file);
+    return strcmp(format, AUDIT_FORMAT_MAGIC) == 0;
+}
+
+// Runs the work with a thread for every equal part of count places and waits for them.
+void run_threads(void *(*work)(void *), int thread_count, long count)
+{
+    pthread_t threads[MAX_THREADS];
+    Part parts[MAX_THREADS];
+    for (int t = 0; t < thread_count; t++)
+    {
+        parts[t].thread = t;
+        parts[t].from = count * t / thread_count;
+        parts[t].to = count * (t + 1) / thread_count;
+        pthread_create(&threads[t], NULL, work, &parts[t]);
+    }
+    for (int t = 0; t < thread_count; t++)
+        pthread_join(threads[t], NULL);
+}
+
+// Writes the id of the account of a snapshot, the number of a delta encoded one is the sum of the deltas before it.
+static void snapshot_account(const Snapshot *snapshot, long i, int *number, char *id, int *balance)
+{
+    if (snapshot->accounts != NULL)
+    {
+        memcpy(id, snapshot->accounts[i].account_id, 20);
+        id[19] = '\0';
+        *balance = snapshot->accounts[i].balance;
+        return;
+    }
+    *number += snapshot->deltas[i].id_delta;
+    snprintf(id, 20, "BankID_%02d", *number);
+    *balance = snapshot->deltas[i].balance;
+}
+
+// Number of a delta encoded account, the deltas before the part are added first.
+static int delta_number_before(const Snapshot *snapshot, long from)
+{
+    int number = 0;
+    for (long i = 0; snapshot->deltas != NULL && i < from; i++)
+        number += snapshot->deltas[i].id_delta;
+    return number;
+}
+
+// Copies the accounts of the current snapshot into the columns.
+void *copy_current(void *arg)
+{
+    Part *part = arg;
+    int number = delta_number_before(&current_snapshot, part->from);
+    for (long i = part->from; i < part->to; i++)
+    {
+        snapshot_account(&current_snapshot, i, &number, columns.ids[i], &columns.current[i]);
+        columns.prefixes[i] = prefix_key(columns.ids[i]);
+    }
+    return NULL;
+}
+
+// Puts the current accounts into the hash table. Slots only go from empty to used, so threads take them with
+// compare and swap. An id that is already there is a duplicate and is left out.
+void *index_current(void *arg)
+{
+    Part *part = arg;
+    for (long i = part->from; i < part->to; i++)
+    {
+        unsigned int pos = hash_account_id(columns.ids[i]) & columns.slot_mask;
+        while (1)
+        {
+            int entry = -1;
+            if (__atomic_compare_exchange_n(&columns.slots[pos], &entry, (int)i, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                strcmp(columns.ids[entry], columns.ids[i]) == 0)
+                break;
+            pos = (pos + 1) & columns.slot_mask;
+        }
+    }
+    return NULL;
+}
+
+// Sets the opening balances. An account that is not current any more gets a new place after the current ones,
+// its id is written before it is put into the table so other threads can compare it.
+void *add_opening(void *arg)
+{
+    Part *part = arg;
+    int number = delta_number_before(&opening_snapshot, part->from);
+    for (long i = part->from; i < part->to; i++)
+    {
+        char id[20];
+        int balance;
+        snapshot_account(&opening_snapshot, i, &number, id, &balance);
+        // Two snapshots of the bank mostly have the accounts in the same order, the same place is tried first
+        // so that the hash table is only read for the accounts that moved.
+        if (i < columns.count && strcmp(columns.ids[i], id) == 0)
+        {
+            columns.opening[i] = balance;
+            continue;
+        }
+        unsigned int pos = hash_account_id(id) & columns.slot_mask;
+        long place = -1;
+        while (1)
+        {
+            int entry = __atomic_load_n(&columns.slots[pos], __ATOMIC_ACQUIRE);
+            if (entry == -1)
+            {
+                if (place == -1)
+                {
+                    place = __atomic_fetch_add(&columns.total, 1, __ATOMIC_RELAXED);
+                    memcpy(columns.ids[place], id, sizeof(id));
+                    columns.current[place] = 0;
+                    columns.prefixes[place] = prefix_key(id);
+                }
+                if (__atomic_compare_exchange_n(&columns.slots[pos], &entry, (int)place, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    break;
+            }
+            if (strcmp(columns.ids[entry], id) == 0)
+            {
+                // Place taken for nothing stays with a balance of 0 everywhere, it does not change any sum.
+                place = entry;
+                break;
+            }
+            pos = (pos + 1) & columns.slot_mask;
+        }
+        columns.opening[place] = balance;
+    }
+    return NULL;
+}
+
+// Total, smallest and largest balance, histogram and sums by prefix of the current accounts in the part.
+// Sum, minimum and maximum are one loop over the balance column without branches, which the compiler vectorizes.
+void *aggregate(void *arg)
+{
+    Part *part = arg;
+    Thread_Result *result = &results[part->thread];
+    long long sum = 0;
+    int min = INT_MAX, max = INT_MIN;
+    const int *balances = columns.current;
+    for (long i = part->from; i < part->to; i++)
+    {
+        sum += balances[i];
+        min = balances[i] < min ? balances[i] : min;
+        max = balances[i] > max ? balances[i] : max;
+    }
+    result->balance_sum = sum;
+    result->min_balance = min;
+    result->max_balance = max;
+    for (long i = part->from; i < part->to; i++)
+    {
+        int bucket = bucket_of(balances[i]);
+        result->bucket_counts[bucket]++;
+        result->bucket_sums[bucket] += balances[i];
+    }
+    // Accounts of one prefix are mostly next to each other, so runs are added to the table at once.
+    for (long i = part->from; i < part->to;)
+    {
+        long run = i + 1;
+        long long run_sum = balances[i];
+        while (run < part->to && columns.prefixes[run] == columns.prefixes[i])
+            run_sum += balances[run++];
+        prefix_add(&result->prefixes, columns.prefixes[i], run - i, run_sum);
+        i = run;
+    }
+    return NULL;
+}
+
+// Takes pieces of the audit until there are none left and adds their deposits and withdrawals to the accounts.
+void *add_audit(void *arg)
+{
+    Part *part = arg;
+    Thread_Result *result = &results[part->thread];
+    while (1)
+    {
+        int taken = __atomic_fetch_add(&next_audit_work, 1, __ATOMIC_RELAXED);
+        if (taken >= audit_work_count)
+            break;
+        Audit_Work *work = &audit_work[taken];
+        for (unsigned int i = work->first; i < work->last; i++)
+        {
+            char id[21];
+            long long net;
+            if (work->from_index)
+            {
+                // Index has the totals of every account in the segment, its records are not read.
+                const Audit_Account_Entry *entry = &work->segment->accounts[i];
+                memcpy(id, entry->account_id, 20);
+                net = entry->deposit_sum - entry->withdraw_sum;
+                result->deposit_count += entry->deposit_count;
+                result->withdraw_count += entry->withdraw_count;
+                result->deposit_sum += entry->deposit_sum;
+                result->withdraw_sum += entry->withdraw_sum;
+                result->index_entries_read++;
+            }
+            else
+            {
+                const Audit_Entry *entry = &work->segment->entries[i];
+                result->records_read++;
+                if (entry->time_us < from_us || entry->time_us >= to_us)
+                    continue;
+                memcpy(id, entry->account_id, 20);
+                net = entry->type == 'D' ? entry->amount : -(long long)entry->amount;
+                if (entry->type == 'D')
+                {
+                    result->deposit_count++;
+                    result->deposit_sum += entry->amount;
+                }
+                else
+                {
+                    result->withdraw_count++;
+                    result->withdraw_sum += entry->amount;
+                }
+            }
+            id[20] = '\0';
+            long place = find_account(id);
+            if (place == -1)
+            {
+                result->unknown_records++;
+                result->unknown_net += net;
+            }
+            else
+            {
+                __atomic_fetch_add(&columns.net[place], net, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Checks every account: opening balance + net of the audit should be the current balance.
+void *reconcile(void *arg)
+{
+    Part *part = arg;
+    Thread_Result *result = &results[part->thread];
+    long long opening_sum = 0, net_sum = 0;
+    for (long i = part->from; i < part->to; i++)
+    {
+        opening_sum += columns.opening[i];
+        net_sum += columns.net[i];
+    }
+    result->opening_sum = opening_sum;
+    result->net_sum = net_sum;
+    for (long i = part->from; i < part->to; i++)
+    {
+        long long difference = columns.current[i] - (columns.opening[i] + columns.net[i]);
+        if (difference == 0)
+            continue;
+        result->mismatches++;
+        result->mismatch_sum += difference;
+        if (result->shown_count < MISMATCHES_SHOWN)
+            result->shown[result->shown_count++] = i;
+    }
+    return NULL;
+}
+
+// Returns the place of the account in the columns or -1 if it is in neither snapshot.
+long find_account(const char *account_id)
+{
+    unsigned int pos = hash_account_id(account_id) & columns.slot_mask;
+    while (1)
+    {
+        int entry = columns.slots[pos];
+        if (entry == -1)
+            return -1;
+        if (strcmp(columns.ids[entry], account_id) == 0)
+            return entry;
+        pos = (pos + 1) & columns.slot_mask;
+    }
+}
+
+// Hash function for account ids (FNV-1a), the same as the server's.
+unsigned int hash_account_id(const char *account_id)
+{
+    unsigned int hash = 2166136261u;
+    for (const char *c = account_id; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Packs the first prefix_length characters of the id into a number whose order is the order of the prefixes.
+unsigned long long prefix_key(const char *account_id)
+{
+    unsigned long long key = 0;
+    int length = 0;
+    for (; length < prefix_length && account_id[length] != '\0'; length++)
+        key = key << 8 | (unsigned char)account_id[length];
+    return key << 8 * (MAX_PREFIX - length);
+}
+
+void prefix_add(Prefix_Table *table, unsigned long long key, long count, long long sum)
+{
+    if (2 * (table->used + 1) > table->size)
+    {
+        Prefix_Table grown = {NULL, NULL, NULL, table->size ? table->size * 2 : 64, 0};
+        grown.keys = calloc(grown.size, sizeof(unsigned long long));
+        grown.counts = calloc(grown.size, sizeof(long));
+        grown.sums = calloc(grown.size, sizeof(long long));
+        for (size_t i = 0; i < table->size; i++)
+        {
+            if (table->keys[i] != 0)
+                prefix_add(&grown, table->keys[i], table->counts[i], table->sums[i]);
+        }
+        free(table->keys);
+        free(table->counts);
+        free(table->sums);
+        *table = grown;
+    }
+    size_t pos = (key * 0x9E3779B97F4A7C15ull >> 32) & (table->size - 1);
+    while (table->keys[pos] != 0 && table->keys[pos] != key)
+        pos = (pos + 1) & (table->size - 1);
+    if (table->keys[pos] == 0)
+    {
+        table->keys[pos] = key;
+        table->used++;
+    }
+    table->counts[pos] += count;
+    table->sums[pos] += sum;
+}
+
+// Bucket 0 is negative balances, 1 is zero and bucket b holds the balances from 2^(b-2) up to 2^(b-1).
+int bucket_of(int balance)
+{
+    if (balance < 0)
+        return 0;
+    if (balance == 0)
+        return 1;
+    return 2 + (31 - __builtin_clz(balance));
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Fills segments with the first sequence number of every segment in the directory in increasing order.
+int list_segments(const char *directory, unsigned long long **segments)
+{
+    int count = 0, size = 16;
+    *segments = malloc(size * sizeof(unsigned long long));
+    DIR *dir = opendir(directory);
+    if (!dir)
+        return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        unsigned long long seq;
+        char extension[8];
+        if (sscanf(entry->d_name, "%llu.%7s", &seq, extension) != 2 || strcmp(extension, "seg") != 0)
+            continue;
+        if (count == size)
+        {
+            size *= 2;
+            *segments = realloc(*segments, size * sizeof(unsigned long long));
+        }
+        (*segments)[count++] = seq;
+    }
+    closedir(dir);
+    qsort(*segments, count, sizeof(unsigned long long), compare_seq);
+    return count;
+}
+
+// Maps a segment and its index, the same way banklog does. An index that is not valid is not used.
+int open_segment(const char *directory, unsigned long long first_seq, Log_Segment *segment)
+{
+    char path[PATH_MAX];
+    memset(segment, 0, sizeof(*segment));
+    snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, directory, first_seq);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    fstat(fd, &st);
+    // A record that the server is writing at the moment is left out.
+    segment->count = st.st_size / sizeof(Audit_Entry);
+    if (segment->count > 0)
+    {
+        segment->entries = mmap(NULL, segment->count * sizeof(Audit_Entry), PROT_READ, MAP_SHARED, fd, 0);
+        if (segment->entries == MAP_FAILED)
+        {
+            perror("Could not map audit segment");
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)segment->entries, segment->count * sizeof(Audit_Entry), MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    snprintf(path, sizeof(path), AUDIT_INDEX_TEMPLATE, directory, first_seq);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 1;
+    fstat(fd, &st);
+    if ((size_t)st.st_size >= sizeof(Audit_Index_Header))
+    {
+        void *index = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (index != MAP_FAILED)
+        {
+            const Audit_Index_Header *header = index;
+            size_t expected = sizeof(Audit_Index_Header) + header->block_count * sizeof(Audit_Time_Block) +
+                              header->account_count * sizeof(Audit_Account_Entry) +
+                              header->record_count * sizeof(unsigned int);
+            if (memcmp(header->magic, AUDIT_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                (size_t)st.st_size >= expected && header->record_count <= segment->count)
+            {
+                segment->header = header;
+                segment->index_size = st.st_size;
+                segment->accounts = (const Audit_Account_Entry *)((const Audit_Time_Block *)(header + 1) + header->block_count);
+            }
+            else
+                munmap(index, st.st_size);
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Adds up the results of the threads and prints them.
+void print_report(int thread_count, int segment_count)
+{
+    Thread_Result all;
+    memset(&all, 0, sizeof(all));
+    all.min_balance = INT_MAX;
+    all.max_balance = INT_MIN;
+    for (int t = 0; t < thread_count; t++)
+    {
+        Thread_Result *result = &results[t];
+        all.balance_sum += result->balance_sum;
+        if (result->min_balance < all.min_balance)
+            all.min_balance = result->min_balance;
+        if (result->max_balance > all.max_balance)
+            all.max_balance = result->max_balance;
+        for (int b = 0; b < BALANCE_BUCKETS; b++)
+        {
+            all.bucket_counts[b] += result->bucket_counts[b];
+            all.bucket_sums[b] += result->bucket_sums[b];
+        }
+        for (size_t i = 0; i < result->prefixes.size; i++)
+        {
+            if (result->prefixes.keys[i] != 0)
+                prefix_add(&all.prefixes, result->prefixes.keys[i], result->prefixes.counts[i], result->prefixes.sums[i]);
+        }
+        all.deposit_count += result->deposit_count;
+        all.withdraw_count += result->withdraw_count;
+        all.deposit_sum += result->deposit_sum;
+        all.withdraw_sum += result->withdraw_sum;
+        all.records_read += result->records_read;
+        all.index_entries_read += result->index_entries_read;
+        all.unknown_records += result->unknown_records;
+        all.unknown_net += result->unknown_net;
+        all.opening_sum += result->opening_sum;
+        all.net_sum += result->net_sum;
+        all.mismatches += result->mismatches;
+        all.mismatch_sum += result->mismatch_sum;
+    }
+
+    printf("accounts    %s %s, %ld accounts\n", current_snapshot.kind, current_snapshot.path, columns.count);
+    printf("balances    total %lld, smallest %d, largest %d, average %.2f\n", all.balance_sum,
+           columns.count ? all.min_balance : 0, columns.count ? all.max_balance : 0,
+           columns.count ? (double)all.balance_sum / columns.count : 0.0);
+
+    printf("\n%-12s %12s %18s\n", "prefix", "accounts", "balance");
+    unsigned long long *keys = malloc((all.prefixes.used + 1) * sizeof(unsigned long long));
+    size_t key_count = 0;
+    for (size_t i = 0; i < all.prefixes.size; i++)
+    {
+        if (all.prefixes.keys[i] != 0)
+            keys[key_count++] = all.prefixes.keys[i];
+    }
+    qsort(keys, key_count, sizeof(unsigned long long), compare_keys);
+    for (size_t k = 0; k < key_count; k++)
+    {
+        char prefix[MAX_PREFIX + 1];
+        for (int c = 0; c < MAX_PREFIX; c++)
+            prefix[c] = keys[k] >> 8 * (MAX_PREFIX - 1 - c);
+        prefix[MAX_PREFIX] = '\0';
+        size_t pos = (keys[k] * 0x9E3779B97F4A7C15ull >> 32) & (all.prefixes.size - 1);
+        while (all.prefixes.keys[pos] != keys[k])
+            pos = (pos + 1) & (all.prefixes.size - 1);
+        printf("%-12s %12ld %18lld\n", prefix, all.prefixes.counts[pos], all.prefixes.sums[pos]);
+    }
+    free(keys);
+
+    printf("\n%-25s %12s %18s\n", "balance", "accounts", "total");
+    for (int b = 0; b < BALANCE_BUCKETS; b++)
+    {
+        if (all.bucket_counts[b] == 0)
+            continue;
+        char range[32];
+        if (b == 0)
+            snprintf(range, sizeof(range), "negative");
+        else if (b == 1)
+            snprintf(range, sizeof(range), "0");
+        else
+            snprintf(range, sizeof(range), "%lld - %lld", 1LL << (b - 2), (1LL << (b - 1)) - 1);
+        printf("%-25s %12ld %18lld\n", range, all.bucket_counts[b], all.bucket_sums[b]);
+    }
+
+    char from_text[64] = "start", to_text[64] = "end", to_seq[32] = "end";
+    if (from_us != LLONG_MIN)
+        format_time(from_us, from_text, sizeof(from_text));
+    if (to_us != LLONG_MAX)
+        format_time(to_us, to_text, sizeof(to_text));
+    if (to_lsn != ULLONG_MAX)
+        snprintf(to_seq, sizeof(to_seq), "%llu", to_lsn);
+    printf("\naudit       after LSN %llu up to %s, %s to %s, %d segments, %llu records and %llu index entries read\n",
+           from_lsn, to_seq, from_text, to_text, segment_count, all.records_read, all.index_entries_read);
+    printf("deposits    %12llu %18lld\n", all.deposit_count, all.deposit_sum);
+    printf("withdrawals %12llu %18lld\n", all.withdraw_count, all.withdraw_sum);
+    printf("net         %12llu %18lld\n", all.deposit_count + all.withdraw_count, all.deposit_sum - all.withdraw_sum);
+    if (!has_opening)
+        return;
+
+    // Accounts opened and closed within the window are in neither snapshot, their records should add up to 0.
+    printf("\nopening     %s %s at LSN %llu, %ld accounts, total %lld\n", opening_snapshot.kind, opening_snapshot.path,
+           opening_snapshot.lsn, opening_snapshot.count, all.opening_sum);
+    printf("expected    opening %lld + net %lld = %lld, current %lld\n", all.opening_sum,
+           all.deposit_sum - all.withdraw_sum, all.opening_sum + all.deposit_sum - all.withdraw_sum, all.balance_sum);
+    if (all.unknown_records > 0)
+        printf("unknown     %llu records of accounts in neither snapshot, net %lld\n", all.unknown_records, all.unknown_net);
+    printf("reconciled  %ld accounts, %ld do not match (difference %lld)\n", columns.total, all.mismatches, all.mismatch_sum);
+    if (all.mismatches == 0)
+        return;
+    printf("\n%-20s %12s %14s %12s %12s\n", "account", "opening", "audit net", "current", "difference");
+    for (int t = 0; t < thread_count; t++)
+    {
+        for (int s = 0; s < results[t].shown_count; s++)
+        {
+            long i = results[t].shown[s];
+            printf("%-20s %12d %14lld %12d %12lld\n", columns.ids[i], columns.opening[i], columns.net[i], columns.current[i],
+                   columns.current[i] - (columns.opening[i] + columns.net[i]));
+        }
+    }
+}
+
+// Times are given as "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or "YYYY-MM-DD HH:MM:SS" in local time, or as seconds since epoch.
+long long parse_time(const char *text)
+{
+    const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    for (int i = 0; i < 3; i++)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(text, formats[i], &tm);
+        if (end != NULL && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            return (long long)mktime(&tm) * 1000000;
+        }
+    }
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0')
+    {
+        fprintf(stderr, "Could not read the time \"%s\".\n", text);
+        exit(EXIT_FAILURE);
+    }
+    return seconds * 1000000;
+}
+
+void format_time(long long time_us, char *buffer, size_t size)
+{
+    time_t seconds = time_us / 1000000;
+    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-o opening] [-d audit_dir] [-f from] [-t to] [-p prefix_length] [-j threads] [accounts_file]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
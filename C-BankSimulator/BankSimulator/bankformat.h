@@ -0,0 +1,228 @@
+#ifndef BANKFORMAT_H
+#define BANKFORMAT_H
+
+// Layouts of the files that the server writes and the tools read (store, checkpoints, database.bin, write ahead log
+// and audit segments). They are kept only here so that the server and the tools can not disagree about them, every
+// program includes this file. Changing a layout needs a new magic or version, the sizes are checked below.
+
+#include <stddef.h>
+#include <limits.h>
+
+#define DB_BINARY_MAGIC "ADABINDB"
+#define DB_BINARY_VERSION 2 // Version 1 had no lsn in the header, it is still read.
+#define DB_DELTA_IDS 1 // Flag of database.bin, records keep the number of their BankID_ id as the difference from the one before.
+#define DB_HAS_LSN 2   // Flag of database.bin, it was written by the server and lsn is set.
+#define STORE_MAGIC "ADASTORE"
+#define STORE_VERSION 3 // Version 2 had no lsn, the server still opens it.
+#define STORE_HEADER_SIZE 4096
+#define CHECKPOINT_MAGIC "ADACKPT2"
+#define DELTA_MAGIC "ADADELT1"
+#define AUDIT_INDEX_MAGIC "ADAIDX01"
+#define AUDIT_FORMAT_FILE "format"     // File in the audit directory that holds AUDIT_FORMAT_MAGIC.
+#define AUDIT_FORMAT_MAGIC "ADAAUD02"  // Audit directory whose sequence numbers are the LSNs of the log records.
+#define AUDIT_TIME_BLOCK 4096 // Index keeps the time range of every this many records of a segment.
+#define WAL_CREATE 'C'
+#define WAL_DEPOSIT 'D'
+#define WAL_WITHDRAW 'W'
+#define WAL_TRANSFER 'T'      // Leg of a transfer, more legs of the same transfer follow it.
+#define WAL_TRANSFER_END 'E'  // Last leg of a transfer. A transfer without it at the end of the log is not replayed.
+
+// This is used to store information related to a bank account.
+typedef struct
+{
+    char account_id[20];
+    int balance;
+} Account;
+
+// One record of the write ahead log. Records are written as they are to the segment files.
+typedef struct
+{
+    unsigned long long lsn;
+    long long time_us;     // Microseconds since epoch.
+    char account_id[20];
+    int type;              // WAL_CREATE, WAL_DEPOSIT, WAL_WITHDRAW, WAL_TRANSFER or WAL_TRANSFER_END.
+    int amount;
+    int balance;           // Balance after the operation, 0 means that the account is removed.
+    unsigned int checksum; // crc32 of the record up to this field, used to find torn writes at the end of a segment.
+} Wal_Record;
+
+// One record of an audit segment. Audit writer writes one for every record of the write ahead log once it is on
+// disk, seq is the LSN of that record. So the sequence numbers go on across the segments and the runs of the server
+// and a checkpoint at LSN n holds exactly the changes of the audit records up to seq n.
+typedef struct
+{
+    unsigned long long seq;
+    long long time_us;
+    char account_id[20];
+    int amount;
+    char type;
+    char padding[7];
+} Audit_Entry;
+
+// Index of a closed audit segment (audit/<first seq>.idx). It starts with this header, then come block_count
+// time blocks, account_count accounts sorted by id and record_count postings. Postings are the record numbers
+// in the segment, grouped by account, so the history of an account is read without scanning the segment.
+typedef struct
+{
+    char magic[8];
+    unsigned long long first_seq;
+    unsigned int record_count;
+    unsigned int account_count;
+    unsigned int block_count;
+    unsigned int padding;
+    long long min_time_us;
+    long long max_time_us;
+    unsigned long long deposit_count;
+    unsigned long long withdraw_count;
+    long long deposit_sum;
+    long long withdraw_sum;
+} Audit_Index_Header;
+
+// Time range of AUDIT_TIME_BLOCK records of the segment. Records are nearly but not strictly in time order
+// since shards take their times themselves, so both ends are kept.
+typedef struct
+{
+    long long min_time_us;
+    long long max_time_us;
+} Audit_Time_Block;
+
+typedef struct
+{
+    char account_id[20];
+    unsigned int first_posting;
+    unsigned int posting_count;
+    unsigned int deposit_count;
+    unsigned int withdraw_count;
+    unsigned int padding;
+    long long deposit_sum;
+    long long withdraw_sum;
+} Audit_Account_Entry;
+
+// Accounts are kept in a memory mapped file (bank.store) so that the database can grow past a fixed size and
+// only the pages that are used are read from disk. The file is laid out as:
+// Store_Header (padded to STORE_HEADER_SIZE) | Account accounts[capacity] | int account_index[index_size]
+// Account index is an open addressing hash table over account ids. Each entry holds the place of the account in
+// accounts array, INDEX_EMPTY for an unused entry or INDEX_DELETED for an entry whose account was removed.
+typedef struct
+{
+    char magic[8];
+    int version;
+    int capacity;      // Number of account places in the file.
+    int index_size;    // Number of index entries, a power of two twice the capacity to keep probe sequences short.
+    int db_size;       // Number of accounts in use.
+    int next_id;       // Used to assign new account id's.
+    int index_deleted; // Number of INDEX_DELETED entries, index is rebuilt when there are too many of them.
+    int generation;    // Increased every time the file grows, processes map the file again when it changes.
+    int clean;         // Set when the server is stopped with ctrl+c, a store that is not clean is recovered from the checkpoint and the log.
+    unsigned long long lsn; // Set with clean, the accounts hold exactly the changes of the log up to and including this LSN.
+} Store_Header;
+
+// Checkpoint file (bank.checkpoint) is this header followed by the accounts. All the changes up to and including
+// lsn are in the checkpoint, so recovery only replays the log records after it.
+// Incremental checkpoints (ckpt/*.delta) have the same layout but only hold the accounts that changed after the
+// checkpoint with prev_lsn, an account with balance 0 is one that is removed.
+typedef struct
+{
+    char magic[8];
+    unsigned long long lsn;
+    unsigned long long prev_lsn; // Only used by incremental checkpoints.
+    int count;
+    int next_id;
+    unsigned int checksum; // crc32 of the accounts.
+} Checkpoint_Header;
+
+// database.bin is this header followed by count records. Records are the accounts as they are in the store, so the
+// file is loaded and saved with one copy. With DB_DELTA_IDS (written by bankdb) they are Delta_Accounts instead.
+// The header of version 1 ends before lsn, see database_header_size.
+typedef struct
+{
+    char magic[8];
+    int version;
+    int flags;
+    int count;
+    int next_id;
+    unsigned int record_size;
+    unsigned int checksum; // crc32 of the records.
+    unsigned long long lsn; // With DB_HAS_LSN, the accounts hold exactly the changes of the log up to and including this LSN.
+} Database_Header;
+
+// Account whose id is "BankID_" followed by its number with at least two digits, the number is kept as the
+// difference from the number of the record before. Ids are mostly in increasing order, so the differences are small.
+typedef struct
+{
+    int id_delta;
+    int balance;
+} Delta_Account;
+
+// Files written by an older build would be read wrongly if a layout changed without a new magic or version.
+_Static_assert(sizeof(Account) == 24, "Account layout changed");
+_Static_assert(sizeof(Wal_Record) == 56, "Wal_Record layout changed");
+_Static_assert(sizeof(Audit_Entry) == 48, "Audit_Entry layout changed");
+_Static_assert(sizeof(Audit_Index_Header) == 80, "Audit_Index_Header layout changed");
+_Static_assert(sizeof(Audit_Time_Block) == 16, "Audit_Time_Block layout changed");
+_Static_assert(sizeof(Audit_Account_Entry) == 56, "Audit_Account_Entry layout changed");
+_Static_assert(sizeof(Store_Header) == 48 && sizeof(Store_Header) <= STORE_HEADER_SIZE, "Store_Header layout changed");
+_Static_assert(sizeof(Checkpoint_Header) == 40, "Checkpoint_Header layout changed");
+_Static_assert(sizeof(Database_Header) == 40 && offsetof(Database_Header, lsn) == 32, "Database_Header layout changed");
+_Static_assert(sizeof(Delta_Account) == 8, "Delta_Account layout changed");
+
+// Records of a database.bin start after a header of this size, 0 for a version that is not known.
+static inline size_t database_header_size(int version)
+{
+    if (version == 1)
+        return offsetof(Database_Header, lsn);
+    return version == DB_BINARY_VERSION ? sizeof(Database_Header) : 0;
+}
+
+// Tells if the delta encoded ids of a database.bin give valid BankID_ numbers. A file with a good checksum can still
+// have wrong deltas, the running number must not go below 0 or past INT_MAX.
+static inline int database_deltas_valid(const Delta_Account *records, int count)
+{
+    long long number = 0;
+    for (int i = 0; i < count; i++)
+    {
+        number += records[i].id_delta;
+        if (number < 0 || number > INT_MAX)
+            return 0;
+    }
+    return 1;
+}
+
+// Standard crc32 (the one used by zip), tables are built on the first call. Eight bytes are taken at a time with
+// eight tables (slicing by 8), which gives the same result as one byte at a time several times faster.
+// It is static inline since every program is a single file that includes this header.
+static inline unsigned int crc32(const void *data, size_t length)
+{
+    static unsigned int table[8][256];
+    static int table_ready = 0;
+    if (!table_ready)
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[0][i] = c;
+        }
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            for (int t = 1; t < 8; t++)
+                table[t][i] = table[0][table[t - 1][i] & 0xFF] ^ (table[t - 1][i] >> 8);
+        }
+        table_ready = 1;
+    }
+    const unsigned char *bytes = data;
+    unsigned int crc = 0xFFFFFFFFu;
+    for (; length >= 8; bytes += 8, length -= 8)
+    {
+        unsigned int low = crc ^ (bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24);
+        unsigned int high = bytes[4] | bytes[5] << 8 | bytes[6] << 16 | (unsigned int)bytes[7] << 24;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    }
+    for (; length > 0; bytes++, length--)
+        crc = table[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+#endif
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE // For strptime.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "bankformat.h"
+
+#define AUDIT_DIR "audit"
+#define AUDIT_SEGMENT_TEMPLATE "%s/%016llu.seg"
+#define AUDIT_INDEX_TEMPLATE "%s/%016llu.idx"
+
+// Structures
+
+// A segment with its index mapped. The segment being written by the server has no index yet, it is scanned.
+typedef struct
+{
+    unsigned long long first_seq;
+    const Audit_Entry *entries;
+    unsigned int count;
+    const Audit_Index_Header *header; // NULL when the segment has no index.
+    const Audit_Time_Block *blocks;
+    const Audit_Account_Entry *accounts;
+    const unsigned int *postings;
+    size_t index_size;
+} Log_Segment;
+
+// What a query asks for. Times are microseconds since epoch, from is included and to is not.
+typedef struct
+{
+    const char *directory;
+    long long from_us;
+    long long to_us;
+    const char *account_id; // NULL for totals of all accounts.
+} Query;
+
+// Sums of a query and how much work it took, printed at the end so that the use of the indexes can be seen.
+typedef struct
+{
+    unsigned long long deposit_count;
+    unsigned long long withdraw_count;
+    long long deposit_sum;
+    long long withdraw_sum;
+    int segments;
+    int skipped;      // Segments left out by their time range or because the account is not in them.
+    int from_index;   // Segments answered by the totals of the index alone.
+    int scanned;      // Segments without an index, read record by record.
+    unsigned long long records_read;
+} Query_Result;
+
+// Explanations for functions are under main where definitions are done.
+int list_segments(const char *directory, unsigned long long **segments);
+int open_segment(const char *directory, unsigned long long first_seq, Log_Segment *segment);
+int index_valid(const Log_Segment *segment);
+void close_segment(Log_Segment *segment);
+const Audit_Account_Entry *find_account(const Log_Segment *segment, const char *account_id);
+int in_window(const Query *query, long long time_us);
+void add_entry(Query_Result *result, const Audit_Entry *entry);
+void print_entry(const Audit_Entry *entry);
+void history(const Query *query, const Log_Segment *segment, Query_Result *result);
+void totals(const Query *query, const Log_Segment *segment, Query_Result *result);
+void print_segment(const Log_Segment *segment);
+long long parse_time(const char *text);
+void format_time(long long time_us, char *buffer, size_t size);
+void usage(const char *program);
+
+// Banklog answers questions about the audit segments that the server writes to audit/: the history of an
+// account, the totals of a time window and the list of segments. The index of a segment tells which accounts
+// and which times it holds, so only the segments and records that matter are read.
+int main(int argc, char *argv[])
+{
+    Query query = {AUDIT_DIR, LLONG_MIN, LLONG_MAX, NULL};
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            query.directory = optarg;
+            break;
+        case 'f':
+            query.from_us = parse_time(optarg);
+            break;
+        case 't':
+            query.to_us = parse_time(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+    const char *command = argv[optind];
+    if (optind + 1 < argc)
+        query.account_id = argv[optind + 1];
+    int is_history = strcmp(command, "history") == 0, is_totals = strcmp(command, "totals") == 0,
+        is_segments = strcmp(command, "segments") == 0;
+    if ((!is_history && !is_totals && !is_segments) || (is_history && query.account_id == NULL))
+        usage(argv[0]);
+
+    unsigned long long *first_seqs;
+    int count = list_segments(query.directory, &first_seqs);
+    if (count == 0)
+    {
+        fprintf(stderr, "No audit segments in %s.\n", query.directory);
+        exit(EXIT_FAILURE);
+    }
+    if (is_segments)
+        printf("%16s %10s %9s %-26s %-26s %s\n", "first seq", "records", "accounts", "from", "to", "index");
+
+    Query_Result result;
+    memset(&result, 0, sizeof(result));
+    for (int i = 0; i < count; i++)
+    {
+        Log_Segment segment;
+        if (!open_segment(query.directory, first_seqs[i], &segment))
+            continue;
+        result.segments++;
+        if (is_segments)
+            print_segment(&segment);
+        else if (is_history)
+            history(&query, &segment, &result);
+        else
+            totals(&query, &segment, &result);
+        close_segment(&segment);
+    }
+    free(first_seqs);
+
+    if (is_totals)
+    {
+        printf("deposits    %12llu %18lld\n", result.deposit_count, result.deposit_sum);
+        printf("withdrawals %12llu %18lld\n", result.withdraw_count, result.withdraw_sum);
+        printf("net         %12llu %18lld\n", result.deposit_count + result.withdraw_count,
+               result.deposit_sum - result.withdraw_sum);
+    }
+    if (!is_segments)
+        fprintf(stderr, "%d segments: %d skipped, %d answered from the index, %d scanned, %llu records read.\n",
+                result.segments, result.skipped, result.from_index, result.scanned, result.records_read);
+    return 0;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Fills segments with the first sequence number of every segment in the directory in increasing order.
+int list_segments(const char *directory, unsigned long long **segments)
+{
+    int count = 0, size = 16;
+    *segments = malloc(size * sizeof(unsigned long long));
+    DIR *dir = opendir(directory);
+    if (!dir)
+        return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        unsigned long long seq;
+        char extension[8];
+        if (sscanf(entry->d_name, "%llu.%7s", &seq, extension) != 2 || strcmp(extension, "seg") != 0)
+            continue;
+        if (count == size)
+        {
+            size *= 2;
+            *segments = realloc(*segments, size * sizeof(unsigned long long));
+        }
+        (*segments)[count++] = seq;
+    }
+    closedir(dir);
+    qsort(*segments, count, sizeof(unsigned long long), compare_seq);
+    return count;
+}
+
+// Maps a segment and its index. Only the pages that a query touches are read from the disk. An index that is
+// missing, from another version, shorter than its header says or whose postings point outside of the segment is
+// not used, the segment is scanned instead.
+int open_segment(const char *directory, unsigned long long first_seq, Log_Segment *segment)
+{
+    char path[PATH_MAX];
+    memset(segment, 0, sizeof(*segment));
+    segment->first_seq = first_seq;
+    snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, directory, first_seq);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    fstat(fd, &st);
+    // A record that the server is writing at the moment is left out.
+    segment->count = st.st_size / sizeof(Audit_Entry);
+    if (segment->count > 0)
+    {
+        segment->entries = mmap(NULL, segment->count * sizeof(Audit_Entry), PROT_READ, MAP_SHARED, fd, 0);
+        if (segment->entries == MAP_FAILED)
+        {
+            perror("Could not map audit segment");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+
+    snprintf(path, sizeof(path), AUDIT_INDEX_TEMPLATE, directory, first_seq);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 1;
+    fstat(fd, &st);
+    if ((size_t)st.st_size >= sizeof(Audit_Index_Header))
+    {
+        void *index = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (index != MAP_FAILED)
+        {
+            const Audit_Index_Header *header = index;
+            size_t expected = sizeof(Audit_Index_Header) + header->block_count * sizeof(Audit_Time_Block) +
+                              header->account_count * sizeof(Audit_Account_Entry) +
+                              header->record_count * sizeof(unsigned int);
+            if (memcmp(header->magic, AUDIT_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                (size_t)st.st_size >= expected && header->record_count <= segment->count)
+            {
+                segment->header = header;
+                segment->index_size = st.st_size;
+                segment->blocks = (const Audit_Time_Block *)(header + 1);
+                segment->accounts = (const Audit_Account_Entry *)(segment->blocks + header->block_count);
+                segment->postings = (const unsigned int *)(segment->accounts + header->account_count);
+                if (!index_valid(segment))
+                {
+                    fprintf(stderr, "Index of audit segment %llu is damaged, the segment is scanned.\n", first_seq);
+                    segment->header = NULL;
+                    munmap(index, st.st_size);
+                }
+            }
+            else
+                munmap(index, st.st_size);
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+// Checks that the queries can follow the index without leaving the mappings: the time blocks cover the records,
+// the posting range of every account is inside the index and every posting is a record of the segment.
+int index_valid(const Log_Segment *segment)
+{
+    const Audit_Index_Header *header = segment->header;
+    if (header->block_count != (header->record_count + AUDIT_TIME_BLOCK - 1) / AUDIT_TIME_BLOCK)
+        return 0;
+    for (unsigned int a = 0; a < header->account_count; a++)
+    {
+        const Audit_Account_Entry *account = &segment->accounts[a];
+        if ((unsigned long long)account->first_posting + account->posting_count > header->record_count)
+            return 0;
+    }
+    for (unsigned int p = 0; p < header->record_count; p++)
+    {
+        if (segment->postings[p] >= segment->count)
+            return 0;
+    }
+    return 1;
+}
+
+void close_segment(Log_Segment *segment)
+{
+    if (segment->entries)
+        munmap((void *)segment->entries, segment->count * sizeof(Audit_Entry));
+    if (segment->header)
+        munmap((void *)segment->header, segment->index_size);
+}
+
+// Accounts of an index are sorted by id, so an account is found with a binary search.
+const Audit_Account_Entry *find_account(const Log_Segment *segment, const char *account_id)
+{
+    int low = 0, high = (int)segment->header->account_count - 1;
+    while (low <= high)
+    {
+        int middle = low + (high - low) / 2;
+        int order = strncmp(segment->accounts[middle].account_id, account_id, sizeof(segment->accounts[middle].account_id));
+        if (order == 0)
+            return &segment->accounts[middle];
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return NULL;
+}
+
+int in_window(const Query *query, long long time_us)
+{
+    return time_us >= query->from_us && time_us < query->to_us;
+}
+
+void add_entry(Query_Result *result, const Audit_Entry *entry)
+{
+    if (entry->type == 'D')
+    {
+        result->deposit_count++;
+        result->deposit_sum += entry->amount;
+    }
+    else
+    {
+        result->withdraw_count++;
+        result->withdraw_sum += entry->amount;
+    }
+}
+
+void print_entry(const Audit_Entry *entry)
+{
+    char time_text[64];
+    format_time(entry->time_us, time_text, sizeof(time_text));
+    printf("%llu %s %.20s %c %d\n", entry->seq, time_text, entry->account_id, entry->type, entry->amount);
+}
+
+// Prints the records of an account in a segment. With an index only the postings of the account are read.
+void history(const Query *query, const Log_Segment *segment, Query_Result *result)
+{
+    if (segment->header)
+    {
+        const Audit_Account_Entry *account = NULL;
+        if (segment->header->max_time_us >= query->from_us && segment->header->min_time_us < query->to_us)
+            account = find_account(segment, query->account_id);
+        if (account == NULL)
+        {
+            result->skipped++;
+            return;
+        }
+        for (unsigned int p = account->first_posting; p < account->first_posting + account->posting_count; p++)
+        {
+            const Audit_Entry *entry = &segment->entries[segment->postings[p]];
+            result->records_read++;
+            if (in_window(query, entry->time_us))
+                print_entry(entry);
+        }
+        return;
+    }
+    result->scanned++;
+    for (unsigned int i = 0; i < segment->count; i++)
+    {
+        const Audit_Entry *entry = &segment->entries[i];
+        result->records_read++;
+        if (strncmp(entry->account_id, query->account_id, sizeof(entry->account_id)) == 0 && in_window(query, entry->time_us))
+            print_entry(entry);
+    }
+}
+
+// Adds the deposits and withdrawals of a segment in the window, of one account or of all of them. A segment that
+// is entirely in the window is answered from the totals in its index. Otherwise only the postings of the account,
+// or the time blocks that overlap the window, are read.
+void totals(const Query *query, const Log_Segment *segment, Query_Result *result)
+{
+    const Audit_Index_Header *header = segment->header;
+    if (header)
+    {
+        if (header->max_time_us < query->from_us || header->min_time_us >= query->to_us)
+        {
+            result->skipped++;
+            return;
+        }
+        int whole = header->min_time_us >= query->from_us && header->max_time_us < query->to_us;
+        if (query->account_id)
+        {
+            const Audit_Account_Entry *account = find_account(segment, query->account_id);
+            if (account == NULL)
+            {
+                result->skipped++;
+                return;
+            }
+            if (whole)
+            {
+                result->from_index++;
+                result->deposit_count += account->deposit_count;
+                result->withdraw_count += account->withdraw_count;
+                result->deposit_sum += account->deposit_sum;
+                result->withdraw_sum += account->withdraw_sum;
+                return;
+            }
+            for (unsigned int p = account->first_posting; p < account->first_posting + account->posting_count; p++)
+            {
+                const Audit_Entry *entry = &segment->entries[segment->postings[p]];
+                result->records_read++;
+                if (in_window(query, entry->time_us))
+                    add_entry(result, entry);
+            }
+            return;
+        }
+        if (whole)
+        {
+            result->from_index++;
+            result->deposit_count += header->deposit_count;
+            result->withdraw_count += header->withdraw_count;
+            result->deposit_sum += header->deposit_sum;
+            result->withdraw_sum += header->withdraw_sum;
+            return;
+        }
+        for (unsigned int b = 0; b < header->block_count; b++)
+        {
+            if (segment->blocks[b].max_time_us < query->from_us || segment->blocks[b].min_time_us >= query->to_us)
+                continue;
+            unsigned int end = (b + 1) * AUDIT_TIME_BLOCK;
+            if (end > header->record_count)
+                end = header->record_count;
+            for (unsigned int i = b * AUDIT_TIME_BLOCK; i < end; i++)
+            {
+                result->records_read++;
+                if (in_window(query, segment->entries[i].time_us))
+                    add_entry(result, &segment->entries[i]);
+            }
+        }
+        return;
+    }
+    result->scanned++;
+    for (unsigned int i = 0; i < segment->count; i++)
+    {
+        const Audit_Entry *entry = &segment->entries[i];
+        result->records_read++;
+        if ((query->account_id == NULL || strncmp(entry->account_id, query->account_id, sizeof(entry->account_id)) == 0) &&
+            in_window(query, entry->time_us))
+            add_entry(result, entry);
+    }
+}
+
+// Prints one line of the segment list. Time range of a segment without an index is taken from its records.
+void print_segment(const Log_Segment *segment)
+{
+    char from[64] = "-", to[64] = "-";
+    char accounts[16] = "-";
+    if (segment->header)
+    {
+        format_time(segment->header->min_time_us, from, sizeof(from));
+        format_time(segment->header->max_time_us, to, sizeof(to));
+        snprintf(accounts, sizeof(accounts), "%u", segment->header->account_count);
+    }
+    else if (segment->count > 0)
+    {
+        long long min_us = segment->entries[0].time_us, max_us = segment->entries[0].time_us;
+        for (unsigned int i = 1; i < segment->count; i++)
+        {
+            if (segment->entries[i].time_us < min_us)
+                min_us = segment->entries[i].time_us;
+            if (segment->entries[i].time_us > max_us)
+                max_us = segment->entries[i].time_us;
+        }
+        format_time(min_us, from, sizeof(from));
+        format_time(max_us, to, sizeof(to));
+    }
+    printf("%16llu %10u %9s %-26s %-26s %s\n", segment->first_seq, segment->count, accounts, from, to,
+           segment->header ? "yes" : "no");
+}
+
+// Times are given as "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or "YYYY-MM-DD HH:MM:SS" in local time, or as seconds since epoch.
+long long parse_time(const char *text)
+{
+    const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    for (int i = 0; i < 3; i++)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(text, formats[i], &tm);
+        if (end != NULL && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            return (long long)mktime(&tm) * 1000000;
+        }
+    }
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0')
+    {
+        fprintf(stderr, "Could not read the time \"%s\".\n", text);
+        exit(EXIT_FAILURE);
+    }
+    return seconds * 1000000;
+}
+
+void format_time(long long time_us, char *buffer, size_t size)
+{
+    time_t seconds = time_us / 1000000;
+    size_t length = strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    snprintf(buffer + length, size - length, ".%06lld", time_us % 1000000);
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-d audit_dir] [-f from] [-t to] history account_id\n", program);
+    fprintf(stderr, "       %s [-d audit_dir] [-f from] [-t to] totals [account_id]\n", program);
+    fprintf(stderr, "       %s [-d audit_dir] segments\n", program);
+    exit(EXIT_FAILURE);
+}
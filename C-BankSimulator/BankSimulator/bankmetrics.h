@@ -0,0 +1,65 @@
+#ifndef BANKMETRICS_H
+#define BANKMETRICS_H
+
+// Layout of the counters that the server keeps in shared memory and bankstat reads. They are kept only here so that
+// the two programs can not disagree about them. Changing the layout needs a new magic, the size is checked below.
+
+#include <sys/types.h>
+
+#define METRICS_SHM_KEY 1235 // Counters read by bankstat, kept apart from the rest of the shared data of the server.
+#define METRICS_MAGIC "ADASTAT3"
+#define METRIC_BUCKETS 32 // Latency histograms have a bucket for every power of two microseconds.
+#define METRIC_SHARDS 16  // Queue depths are kept for this many shards, the most the server can run with.
+
+// Kinds of requests that are counted separately.
+enum
+{
+    METRIC_DEPOSIT,
+    METRIC_WITHDRAW,
+    METRIC_CREATE,
+    METRIC_BALANCE,
+    METRIC_TRANSFER,
+    METRIC_INVALID,
+    METRIC_OPS
+};
+
+// Latency histogram, bucket i counts the values between 2^i and 2^(i+1) microseconds (bucket 0 also the smaller ones).
+typedef struct
+{
+    unsigned long long counts[METRIC_BUCKETS];
+    unsigned long long total_us;
+} Metric_Histogram;
+
+// Counters of the server in their own shared memory segment, bankstat attaches to it and prints their rates.
+// Every process adds to them with atomic additions, nothing is ever reset while the server runs.
+typedef struct
+{
+    char magic[8];
+    pid_t server_pid;
+    int shard_count;
+    long long started;                            // Unix time the server started.
+    unsigned long long requests[METRIC_OPS];      // Requests answered, by kind.
+    unsigned long long rejects[METRIC_OPS];       // Requests answered with a result of 0.
+    unsigned long long lock_waits;                // Times a stripe lock or the database semaphore was not free.
+    unsigned long long lock_wait_us;
+    unsigned long long handler_batches;           // Batches the handlers took from their rings.
+    unsigned long long handler_batch_requests;    // Requests in those batches, divided by batches gives the batch size.
+    unsigned int queue_depth[METRIC_SHARDS];      // Requests left in the ring of the shard after its last batch.
+    unsigned long long forks;
+    unsigned long long fork_us;
+    unsigned long long wal_syncs;                 // Groups written by the log writer, each with one fsync.
+    unsigned long long wal_records;
+    unsigned long long wal_bytes;
+    unsigned long long wal_write_us;              // Time in write and fdatasync.
+    Metric_Histogram request_latency;             // From the teller giving a request to a handler to having the result.
+    Metric_Histogram lock_wait_latency;
+    Metric_Histogram wal_sync_latency;
+    Metric_Histogram fork_latency;
+    unsigned long long busy_connections;          // Sessions turned away since too many were waiting for a teller.
+    unsigned long long busy_requests;             // Requests turned away since their handler had too many waiting.
+} Bank_Metrics;
+
+_Static_assert(sizeof(Metric_Histogram) == 264, "Metric_Histogram layout changed");
+_Static_assert(sizeof(Bank_Metrics) == 1336, "Bank_Metrics layout changed");
+
+#endif
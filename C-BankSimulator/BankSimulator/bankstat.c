@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include "bankmetrics.h"
+
+#define HEADER_EVERY 20 // Column names are printed again after this many lines, like vmstat does.
+
+// Explanations for functions are under main where definitions are done.
+void print_header();
+void print_rates(const Bank_Metrics *now, const Bank_Metrics *before, double seconds);
+void print_histograms(const Bank_Metrics *metrics);
+double per(unsigned long long part, unsigned long long whole);
+
+// Bankstat attaches to the counters of a running server and prints their rates every interval, in the manner of
+// vmstat. First line is the average since the server started. With -h it prints the latency histograms instead.
+int main(int argc, char *argv[])
+{
+    int histograms = 0, opt;
+    while ((opt = getopt(argc, argv, "h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            histograms = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h] [interval_s [count]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    int interval = optind < argc ? atoi(argv[optind]) : 1;
+    int count = optind + 1 < argc ? atoi(argv[optind + 1]) : -1;
+    if (interval < 1)
+    {
+        fprintf(stderr, "Interval should be at least one second\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Counters are only read, the segment is attached read only.
+    int shm_id = shmget(METRICS_SHM_KEY, 0, 0);
+    if (shm_id == -1)
+    {
+        fprintf(stderr, "No server is running (no metrics segment with key %d).\n", METRICS_SHM_KEY);
+        exit(EXIT_FAILURE);
+    }
+    const Bank_Metrics *metrics = shmat(shm_id, NULL, SHM_RDONLY);
+    if (metrics == (void *)-1)
+    {
+        perror("shmat failed");
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(metrics->magic, METRICS_MAGIC, sizeof(metrics->magic)) != 0)
+    {
+        fprintf(stderr, "Metrics segment is not from this version of the server.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (histograms)
+    {
+        print_histograms(metrics);
+        shmdt(metrics);
+        return 0;
+    }
+
+    // First line compares with an empty copy, so it shows the averages since the start.
+    Bank_Metrics before, now;
+    memset(&before, 0, sizeof(before));
+    double seconds = time(NULL) - metrics->started;
+    if (seconds < 1)
+        seconds = 1;
+    for (int line = 0; count < 0 || line < count; line++)
+    {
+        if (line % HEADER_EVERY == 0)
+            print_header();
+        memcpy(&now, metrics, sizeof(now));
+        print_rates(&now, &before, seconds);
+        before = now;
+        seconds = interval;
+        if (count < 0 || line + 1 < count)
+            sleep(interval);
+    }
+    shmdt(metrics);
+    return 0;
+}
+
+void print_header()
+{
+    printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %6s %6s %8s %8s %7s %8s %8s %6s\n", "dep/s", "wd/s", "new/s", "bal/s", "xfer/s",
+           "rej/s", "busy/s", "sbusy/s", "req_us", "batch", "depth", "lockw/s", "lock_us", "sync/s", "sync_us", "log_kB/s", "fork/s");
+}
+
+// Prints one line of rates between two copies of the counters.
+void print_rates(const Bank_Metrics *now, const Bank_Metrics *before, double seconds)
+{
+    unsigned long long rejects = 0;
+    for (int op = 0; op < METRIC_OPS; op++)
+        rejects += now->rejects[op] - before->rejects[op];
+    unsigned long long requests = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++)
+        requests += now->request_latency.counts[b] - before->request_latency.counts[b];
+    unsigned int depth = 0;
+    for (int i = 0; i < now->shard_count && i < METRIC_SHARDS; i++)
+        depth += now->queue_depth[i];
+    printf("%8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %6.1f %6u %8.0f %8.0f %7.0f %8.0f %8.0f %6.1f\n",
+           (now->requests[METRIC_DEPOSIT] - before->requests[METRIC_DEPOSIT]) / seconds,
+           (now->requests[METRIC_WITHDRAW] - before->requests[METRIC_WITHDRAW]) / seconds,
+           (now->requests[METRIC_CREATE] - before->requests[METRIC_CREATE]) / seconds,
+           (now->requests[METRIC_BALANCE] - before->requests[METRIC_BALANCE]) / seconds,
+           (now->requests[METRIC_TRANSFER] - before->requests[METRIC_TRANSFER]) / seconds,
+           rejects / seconds,
+           (now->busy_requests - before->busy_requests) / seconds,
+           (now->busy_connections - before->busy_connections) / seconds,
+           per(now->request_latency.total_us - before->request_latency.total_us, requests),
+           per(now->handler_batch_requests - before->handler_batch_requests, now->handler_batches - before->handler_batches),
+           depth,
+           (now->lock_waits - before->lock_waits) / seconds,
+           per(now->lock_wait_us - before->lock_wait_us, now->lock_waits - before->lock_waits),
+           (now->wal_syncs - before->wal_syncs) / seconds,
+           per(now->wal_write_us - before->wal_write_us, now->wal_syncs - before->wal_syncs),
+           (now->wal_bytes - before->wal_bytes) / 1024.0 / seconds,
+           (now->forks - before->forks) / seconds);
+    fflush(stdout);
+}
+
+// Prints the count and approximate percentiles of every histogram. A percentile is the upper end of the
+// power of two bucket it falls into.
+void print_histograms(const Bank_Metrics *metrics)
+{
+    const char *names[] = {"request", "lock wait", "log sync", "fork"};
+    const Metric_Histogram *histograms[] = {&metrics->request_latency, &metrics->lock_wait_latency,
+                                            &metrics->wal_sync_latency, &metrics->fork_latency};
+    const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("%-10s %12s %10s %10s %10s %10s %10s\n", "latency", "count", "avg us", "p50 us", "p90 us", "p99 us", "p999 us");
+    for (int h = 0; h < 4; h++)
+    {
+        Metric_Histogram copy = *histograms[h];
+        unsigned long long total = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++)
+            total += copy.counts[b];
+        printf("%-10s %12llu %10.0f", names[h], total, per(copy.total_us, total));
+        for (int p = 0; p < 4; p++)
+        {
+            unsigned long long target = (unsigned long long)(percentiles[p] * total), seen = 0;
+            int b = 0;
+            while (b < METRIC_BUCKETS - 1 && seen + copy.counts[b] <= target)
+                seen += copy.counts[b++];
+            if (total == 0)
+                printf(" %10s", "-");
+            else
+                printf(" %10llu", (1ULL << (b + 1)) - 1);
+        }
+        printf("\n");
+    }
+}
+
+// Average of part over whole, 0 when there is nothing to divide.
+double per(unsigned long long part, unsigned long long whole)
+{
+    return whole == 0 ? 0 : (double)part / whole;
+}
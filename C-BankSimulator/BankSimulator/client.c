@@ -1,17 +1,34 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ is used to make the session fifos larger.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <errno.h>
+#include <time.h>
 
 #define SERVER_FIFO "server_fifo"
+#define SOCKET_PATH "bank.sock"
 #define CLIENT_FIFO_TEMPLATE "client_fifo_%d"
 #define CLIENT_FIFO_NAME_LEN 64
+#define MAX_TRANSFER_LEGS 8
+#define RESPONSE_FIFO_TEMPLATE "client_fifo_%d.resp"
+#define DEFAULT_IN_FLIGHT 256 // Requests sent and not answered yet.
+#define MAX_IN_FLIGHT 4096
+#define DEFAULT_PIPE_SIZE 65536 // Fifos are made larger when this is not enough for the requests in flight.
+#define RESULT_BUSY 2           // Server is full, the request or the session should be tried again a little later.
+#define MAX_RETRIES 8           // Busy answers a request gets before the client gives it up.
+#define MAX_BACKOFF_MS 1000     // Longest wait between two tries.
+#define CONNECT_TIMEOUT_S 30    // Client gives up opening a session if no teller takes it in this time.
 
 // Structures
 
@@ -20,8 +37,16 @@ typedef struct
 {
     pid_t client_pid;
     char client_fifo[CLIENT_FIFO_NAME_LEN];
+    int session; // 1 opens a session, requests are sent on client_fifo and responses come back on the response fifo.
 } Server_Connection_Request;
 
+// One account of a transfer. Negative amount is taken from the account, positive amount is added to it.
+typedef struct
+{
+    char account_id[20];
+    int amount;
+} Transfer_Leg;
+
 // This is used to hold actual request information to be sent to a teller after connection to server is acceppted.
 typedef struct
 {
@@ -29,7 +54,11 @@ typedef struct
     char account_id[20];
     char operation[10];
     int amount;
-    int possible_request;
+    int possible_request; // Not used anymore, server validates the request while applying it.
+    // Transfers only. Account and amount above are set to the first debited account, which chooses the handler,
+    // and to the total that is moved.
+    int leg_count;
+    Transfer_Leg legs[MAX_TRANSFER_LEGS];
 } Request;
 
 // A Simple message structure to hold response returned from the teller.
@@ -38,116 +67,302 @@ typedef struct
     char message[100];
 } Response;
 
+// Requests and responses of a session carry an id since many of them are on the way at the same time and
+// responses may come back in a different order.
+typedef struct
+{
+    unsigned int request_id;
+    Request request;
+} Session_Request;
+
+typedef struct
+{
+    unsigned int request_id;
+    int result;
+    char message[100];
+} Session_Response;
+
+// Client file is memory mapped and parsed one line at a time while the requests are sent, so a file of any size
+// is read without copying it and only the part that is being sent is in memory.
+typedef struct
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+    long line_number;
+    const char *next_id; // Rest of the account list of a bulk balance query, NULL when there is none.
+    const char *ids_end;
+} Workload_Reader;
+
 // Explanations for functions are under main where definitions are done.
-void printMsg(char operations[][10], int amounts[], int client_num);
+void printMsg(const Request *request, int request_num);
 void cleanup_fifo(int sig);
-void readClientFile(const char *filename, char bank_ids[][20], char operations[][10], int amounts[], int *line_count);
+void open_workload(const char *filename, Workload_Reader *reader);
+int next_request(Workload_Reader *reader, Request *request);
+int fit_pipe(int fd, size_t bytes);
+int fit_socket(int fd, size_t bytes);
+int fallback_in_flight();
+int connect_socket();
+int connect_session(const char *client_fifo, const char *response_fifo, pid_t pid, int *request_fd, int *response_fd);
+int retry_delay_ms(const char *message, int attempt);
+long long now_ms();
 void setup_sigaction(int signum, void (*handler)(int));
 
 //This function takes client's file name as argument.
 int main(int argc, char *argv[])
 {
+    // Number of requests in flight and quiet mode (only the summary is printed) can be given as options.
+    // With -u the session goes over the unix domain socket of the server instead of the fifos.
+    int in_flight = DEFAULT_IN_FLIGHT, quiet = 0, use_socket = 0, opt;
+    while ((opt = getopt(argc, argv, "n:qu")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            in_flight = atoi(optarg);
+            if (in_flight < 1 || in_flight > MAX_IN_FLIGHT)
+            {
+                fprintf(stderr, "Requests in flight should be between 1 and %d\n", MAX_IN_FLIGHT);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'u':
+            use_socket = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n in_flight] [-q] [-u] <client_file>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     //Argument check. 
-    if (argc != 2)
+    if (optind != argc - 1)
     {
-        fprintf(stderr, "Usage: %s <client_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-n in_flight] [-q] [-u] <client_file>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // Data structures related to client requests
-    char bank_ids[100][20];
-    char operations[100][10];
-    int amounts[100];
-    int line_count;
-
-    // Read the clients file to obtain the requests.
-    readClientFile(argv[1], bank_ids, operations, amounts, &line_count);
-    printf("Reading clients.file... Found %d requests.\n", line_count);
+    // Map the clients file, requests are read from it as they are sent.
+    Workload_Reader reader;
+    open_workload(argv[optind], &reader);
+    printf("Reading %s... %zu bytes.\n", argv[optind], reader.size);
 
     // Handle signals when delivered clean the resources such as fifos created.
     setup_sigaction(SIGINT, cleanup_fifo);
     setup_sigaction(SIGTERM, cleanup_fifo);
 
-
-    // For conquerrency, create a child for each request so that they can be handled conquerrently.
-    for (int i = 0; i < line_count; i++)
+    // All the requests are sent over one session instead of forking a child with its own fifo for each of them.
+    // Requests go on the client fifo and responses come back on the response fifo. Over the socket both go on the same connection.
+    char client_fifo[CLIENT_FIFO_NAME_LEN];
+    char response_fifo[CLIENT_FIFO_NAME_LEN];
+    pid_t pid = getpid();
+    snprintf(client_fifo, CLIENT_FIFO_NAME_LEN, CLIENT_FIFO_TEMPLATE, pid);
+    snprintf(response_fifo, CLIENT_FIFO_NAME_LEN, RESPONSE_FIFO_TEMPLATE, pid);
+    int request_fd, response_fd;
+    if (use_socket)
     {
-        if (fork() == 0)
+        request_fd = response_fd = connect_socket();
+        // Client only blocks on reading responses, so every request in flight should fit in the socket buffer.
+        if (!fit_socket(request_fd, in_flight * sizeof(Session_Request)))
         {
-            // Create client FIFO, each specific to a client (using pid).
-            char client_fifo[CLIENT_FIFO_NAME_LEN];
-            pid_t pid = getpid();
-            snprintf(client_fifo, CLIENT_FIFO_NAME_LEN, CLIENT_FIFO_TEMPLATE, pid);
-            if (mkfifo(client_fifo, 0666) == -1 && errno != EEXIST)
-            {
-                perror("mkfifo failed");
-                exit(EXIT_FAILURE);
-            }
+            // Kernel counts its bookkeeping in the buffer too, see fit_socket.
+            in_flight = fallback_in_flight() / 2;
+            fprintf(stderr, "Socket buffer can not be made larger, %d requests are kept in flight.\n", in_flight);
+        }
+    }
+    else
+    {
+        if ((mkfifo(client_fifo, 0666) == -1 && errno != EEXIST) || (mkfifo(response_fifo, 0666) == -1 && errno != EEXIST))
+        {
+            perror("mkfifo failed");
+            exit(EXIT_FAILURE);
+        }
 
-            // Child process handles one request
-            Server_Connection_Request sc_request;
-            sc_request.client_pid = pid;
-            strcpy(sc_request.client_fifo, client_fifo);
+        // Connection request is sent again with a backoff while the server answers that it is busy.
+        if (!connect_session(client_fifo, response_fifo, pid, &request_fd, &response_fd))
+        {
+            unlink(client_fifo); // clean up FIFOs on failure
+            unlink(response_fifo);
+            exit(EXIT_FAILURE);
+        }
+        // Client only blocks on reading responses, so every request and response in flight should fit in the fifos.
+        // Otherwise both sides could wait for each other to read.
+        if (!fit_pipe(request_fd, in_flight * sizeof(Session_Request)) || !fit_pipe(response_fd, in_flight * sizeof(Session_Response)))
+        {
+            in_flight = fallback_in_flight();
+            fprintf(stderr, "Fifos can not be made larger, %d requests are kept in flight.\n", in_flight);
+        }
+    }
+    printf("Client PID%d opened a session with %d requests in flight.\n", pid, in_flight);
 
-            // Send connection request first to bank server.
-            int server_fd = open(SERVER_FIFO, O_WRONLY);
-            if (server_fd == -1)
+    // Requests are sent in batches as long as there are fewer than in_flight unanswered ones. Time a request is sent
+    // is kept by its id, the time to its response is its end to end latency. Responses may come back in a different
+    // order, so a new request is only sent when its id is within in_flight of the oldest unanswered one, otherwise
+    // two requests could use the same place.
+    // A request that is answered busy is kept by its id too and sent again when its retry time comes, its latency
+    // counts from the first time it is sent.
+    Session_Request *batch = malloc(in_flight * sizeof(Session_Request));
+    Session_Request *requests = malloc(in_flight * sizeof(Session_Request));
+    struct timespec *sent_at = malloc(in_flight * sizeof(struct timespec));
+    long long *retry_at = calloc(in_flight, sizeof(long long));
+    unsigned char *attempts = calloc(in_flight, 1);
+    char *answered = calloc(in_flight, 1);
+    long retrying = 0, retries = 0;
+    srand(pid ^ time(NULL));
+    long oldest = 1;
+    size_t buffer_size = in_flight * sizeof(Session_Response);
+    char *buffer = malloc(buffer_size);
+    size_t buffered = 0;
+    long sent = 0, received = 0, accepted = 0;
+    double total_latency_ms = 0, max_latency_ms = 0;
+    int done = 0;
+    while (!done || received < sent)
+    {
+        int count = 0;
+        while (!done && sent + count + 1 - oldest < in_flight)
+        {
+            Session_Request *session_request = &batch[count];
+            memset(session_request, 0, sizeof(Session_Request));
+            if (!next_request(&reader, &session_request->request))
             {
-                printf("Client %d cannot connect to server FIFO\n", i);
-                unlink(client_fifo); // clean up FIFO on failure
-                exit(EXIT_FAILURE);
+                done = 1;
+                break;
             }
-            printMsg(operations, amounts, i);
-            write(server_fd, &sc_request, sizeof(sc_request));
-            close(server_fd);
-
-            // Send actual transaction request to teller.(Create a request structure)
-            Request request;
-            request.client_pid = pid;
-            strcpy(request.account_id, bank_ids[i]);
-            strcpy(request.operation, operations[i]);
-            request.amount = amounts[i];
-            request.possible_request = 0; // Initialize it to zero, if transaction is possible, teller will change it to 1.
-
-            int client_fd = open(client_fifo, O_WRONLY);
-            if (client_fd == -1)
+            session_request->request_id = sent + count + 1;
+            session_request->request.client_pid = pid;
+            if (!quiet)
+                printMsg(&session_request->request, session_request->request_id);
+            clock_gettime(CLOCK_MONOTONIC, &sent_at[session_request->request_id % in_flight]);
+            requests[session_request->request_id % in_flight] = *session_request;
+            attempts[session_request->request_id % in_flight] = 0;
+            count++;
+        }
+        // Requests whose retry time has come go with the new ones. They are unanswered, so they are in the window.
+        int new_count = count;
+        long long next_retry = 0;
+        if (retrying > 0)
+        {
+            long long now_time = now_ms();
+            for (long id = oldest; id <= sent; id++)
             {
-                perror("Failed to open client FIFO for writing");
-                exit(EXIT_FAILURE);
+                long long *at = &retry_at[id % in_flight];
+                if (*at == 0)
+                    continue;
+                if (*at <= now_time)
+                {
+                    batch[count++] = requests[id % in_flight];
+                    *at = 0;
+                    retrying--;
+                    retries++;
+                }
+                else if (next_retry == 0 || *at < next_retry)
+                    next_retry = *at;
             }
-            write(client_fd, &request, sizeof(Request));
-            close(client_fd);
+        }
+        if (count > 0)
+            write(request_fd, batch, count * sizeof(Session_Request));
+        sent += new_count;
+        if (received == sent)
+            continue;
 
-            // Read the response from the teller.
-            client_fd = open(client_fifo, O_RDONLY);
-            if (client_fd == -1)
+        // Read whatever responses are there, a read may end in the middle of a response. While requests wait for
+        // their retry time, reading waits only until the first of them is due.
+        if (next_retry != 0)
+        {
+            struct pollfd poll_fd = {response_fd, POLLIN, 0};
+            long long wait_ms = next_retry - now_ms();
+            if (poll(&poll_fd, 1, wait_ms > 0 ? (int)wait_ms : 0) == 0)
+                continue;
+        }
+        ssize_t bytes = read(response_fd, buffer + buffered, buffer_size - buffered);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+        {
+            fprintf(stderr, "Session closed by the server after %ld of %ld responses.\n", received, sent);
+            break;
+        }
+        buffered += bytes;
+        size_t used = 0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (buffered - used >= sizeof(Session_Response))
+        {
+            Session_Response response;
+            memcpy(&response, buffer + used, sizeof(Session_Response));
+            used += sizeof(Session_Response);
+            unsigned int slot = response.request_id % in_flight;
+            if (response.result == RESULT_BUSY && attempts[slot] < MAX_RETRIES)
             {
-                perror("Failed to open client FIFO for reading");
-                exit(EXIT_FAILURE);
+                // Server turned the request away without applying it, it is sent again after a jittered backoff.
+                retry_at[slot] = now_ms() + retry_delay_ms(response.message, attempts[slot]++);
+                retrying++;
+                continue;
+            }
+            struct timespec *start = &sent_at[response.request_id % in_flight];
+            double latency_ms = (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+            total_latency_ms += latency_ms;
+            if (latency_ms > max_latency_ms)
+                max_latency_ms = latency_ms;
+            accepted += response.result == 1;
+            // Response is the final result of the request: new balance, id of the new account or why it is rejected.
+            if (!quiet)
+                printf("Response from server for request %u (%.2f ms): %s\n", response.request_id, latency_ms, response.message);
+            received++;
+            answered[response.request_id % in_flight] = 1;
+            while (oldest <= sent && answered[oldest % in_flight])
+            {
+                answered[oldest % in_flight] = 0;
+                oldest++;
             }
-
-            Response response;
-            read(client_fd, &response, sizeof(Response));
-            close(client_fd);
-
-            printf("Response from server for request %d: %s\n", i + 1, response.message);
-            unlink(client_fifo);
-            exit(0);
         }
+        memmove(buffer, buffer + used, buffered - used);
+        buffered -= used;
     }
-
-    // Parent waits for all child processes
-    for (int i = 0; i < line_count; i++)
+    printf("%ld requests sent, %ld answered (%ld accepted), average latency %.2f ms, max %.2f ms.\n",
+           sent, received, accepted, received ? total_latency_ms / received : 0.0, max_latency_ms);
+    if (retries > 0)
+        printf("%ld requests were sent again since the server was busy.\n", retries);
+    // Request fifo is only closed at the end, a busy answer may come for any request until then. Closing it tells
+    // the teller that no more requests are coming.
+    if (!use_socket)
+        close(request_fd);
+    close(response_fd);
+    if (!use_socket)
     {
-        wait(NULL);
+        unlink(client_fifo);
+        unlink(response_fifo);
     }
+    free(batch);
+    free(requests);
+    free(sent_at);
+    free(retry_at);
+    free(attempts);
+    free(answered);
+    free(buffer);
+    munmap((void *)reader.data, reader.size);
     return 0;
 }
 
 // This functions prints the message in the client side.
-void printMsg(char operations[][10], int amounts[], int client_num)
+void printMsg(const Request *request, int request_num)
 {
-    printf("Client0%d connected..%sing %d credits\n", client_num, operations[client_num], amounts[client_num]);
+    if (strcmp(request->operation, "balance") == 0)
+    {
+        if (request->leg_count > 0)
+            printf("Client0%d connected..checking the balances of %d accounts\n", request_num, request->leg_count);
+        else
+            printf("Client0%d connected..checking the balance of %s\n", request_num, request->account_id);
+        return;
+    }
+    if (strcmp(request->operation, "transfer") == 0)
+    {
+        printf("Client0%d connected..transferring %d credits between %d accounts\n", request_num, request->amount, request->leg_count);
+        return;
+    }
+    printf("Client0%d connected..%sing %d credits\n", request_num, request->operation, request->amount);
 }
 
 // This function cleans up the resourdes if SIGINT or SIGTERM is delivered.
@@ -156,11 +371,13 @@ void cleanup_fifo(int sig)
     char fifo[64];
     snprintf(fifo, sizeof(fifo), CLIENT_FIFO_TEMPLATE, getpid());
     unlink(fifo);
+    snprintf(fifo, sizeof(fifo), RESPONSE_FIFO_TEMPLATE, getpid());
+    unlink(fifo);
     exit(1);
 }
 
-// Function to read the client file into arrays
-void readClientFile(const char *filename, char bank_ids[][20], char operations[][10], int amounts[], int *line_count)
+// Maps the client file for reading. Pages are read from disk as the reader reaches them.
+void open_workload(const char *filename, Workload_Reader *reader)
 {
     int fd = open(filename, O_RDONLY);
     if (fd == -1)
@@ -168,34 +385,373 @@ void readClientFile(const char *filename, char bank_ids[][20], char operations[]
         perror("open failed");
         exit(EXIT_FAILURE);
     }
-
-    char buffer[4096];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-    if (bytes_read < 0)
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     {
-        perror("read failed");
+        perror("fstat failed");
         close(fd);
         exit(EXIT_FAILURE);
     }
-    buffer[bytes_read] = '\0';
+    reader->size = st.st_size;
+    reader->pos = 0;
+    reader->line_number = 0;
+    reader->next_id = NULL;
+    reader->data = NULL;
+    // An empty file can not be mapped, it simply has no requests.
+    if (reader->size > 0)
+    {
+        reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (reader->data == MAP_FAILED)
+        {
+            perror("mmap failed");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)reader->data, reader->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
 
-    char *line = strtok(buffer, "\n");
-    *line_count = 0;
+// Copies the next whitespace separated word of the line into word. Returns 0 if there is none or it does not fit.
+static int next_word(const char **c, const char *end, char *word, size_t size)
+{
+    while (*c < end && (**c == ' ' || **c == '\t' || **c == '\r'))
+        (*c)++;
+    size_t length = 0;
+    while (*c < end && **c != ' ' && **c != '\t' && **c != '\r')
+    {
+        if (length + 1 >= size)
+            return 0;
+        word[length++] = *(*c)++;
+    }
+    word[length] = '\0';
+    return length > 0;
+}
 
-    while (line != NULL)
+// Takes the next accounts of a bulk balance query ("BankID_01,BankID_02 balance"). Up to MAX_TRANSFER_LEGS of them
+// go in one request as its legs and the teller reads their balances together, a longer list is sent as several
+// requests. Returns 0 when the list is finished.
+static int next_query_ids(Workload_Reader *reader, Request *request)
+{
+    request->leg_count = 0;
+    memset(request->legs, 0, sizeof(request->legs));
+    while (reader->next_id != NULL && reader->next_id < reader->ids_end && request->leg_count < MAX_TRANSFER_LEGS)
     {
-        if (sscanf(line, "%s %s %d", bank_ids[*line_count], operations[*line_count], &amounts[*line_count]) == 3)
+        const char *id = reader->next_id;
+        const char *comma = memchr(id, ',', reader->ids_end - id);
+        const char *id_end = comma ? comma : reader->ids_end;
+        reader->next_id = id_end + (comma != NULL);
+        size_t length = id_end - id;
+        if (length == 0)
+            continue;
+        if (length >= sizeof(request->account_id))
         {
-            (*line_count)++;
+            fprintf(stderr, "Invalid account in line %ld: %.*s\n", reader->line_number, (int)length, id);
+            continue;
         }
-        else
+        memcpy(request->legs[request->leg_count++].account_id, id, length);
+    }
+    if (request->leg_count == 0)
+    {
+        reader->next_id = NULL;
+        return 0;
+    }
+    strcpy(request->account_id, request->legs[0].account_id);
+    strcpy(request->operation, "balance");
+    request->amount = 0;
+    return 1;
+}
+
+// Parses a transfer, either "<from> transfer <amount> <to>" or "<account>:<amount>[,<account>:<amount>...] transfer"
+// where negative amounts are taken from their accounts and positive ones are added. Server checks that the legs add
+// up to zero. Returns 0 if the transfer can not be read.
+static int parse_transfer(const char *legs, size_t length, const char **c, const char *end, Request *request)
+{
+    char amount[16], target[20];
+    char *amount_end;
+    request->leg_count = 0;
+    memset(request->legs, 0, sizeof(request->legs));
+    if (memchr(legs, ':', length) == NULL)
+    {
+        if (length >= sizeof(request->account_id) || !next_word(c, end, amount, sizeof(amount)) ||
+            !next_word(c, end, target, sizeof(target)))
+            return 0;
+        long value = strtol(amount, &amount_end, 10);
+        if (*amount_end != '\0' || value <= 0 || value > INT_MAX)
+            return 0;
+        memcpy(request->legs[0].account_id, legs, length);
+        request->legs[0].amount = -value;
+        strcpy(request->legs[1].account_id, target);
+        request->legs[1].amount = value;
+        request->leg_count = 2;
+    }
+    else
+    {
+        const char *leg = legs, *legs_end = legs + length;
+        while (leg < legs_end)
+        {
+            const char *comma = memchr(leg, ',', legs_end - leg);
+            const char *leg_end = comma ? comma : legs_end;
+            const char *colon = memchr(leg, ':', leg_end - leg);
+            size_t id_length = colon ? (size_t)(colon - leg) : 0;
+            size_t amount_length = colon ? (size_t)(leg_end - colon - 1) : 0;
+            if (id_length == 0 || id_length >= sizeof(request->account_id) || amount_length == 0 ||
+                amount_length >= sizeof(amount) || request->leg_count == MAX_TRANSFER_LEGS)
+                return 0;
+            memcpy(amount, colon + 1, amount_length);
+            amount[amount_length] = '\0';
+            long value = strtol(amount, &amount_end, 10);
+            if (*amount_end != '\0' || value < -INT_MAX || value > INT_MAX)
+                return 0;
+            Transfer_Leg *transfer_leg = &request->legs[request->leg_count++];
+            memcpy(transfer_leg->account_id, leg, id_length);
+            transfer_leg->amount = value;
+            leg = leg_end + (comma != NULL);
+        }
+    }
+    long long moved = 0;
+    const char *first_debit = request->legs[0].account_id;
+    for (int i = request->leg_count - 1; i >= 0; i--)
+    {
+        if (request->legs[i].amount < 0)
         {
-            fprintf(stderr, "Invalid format in line: %s\n", line);
+            moved -= request->legs[i].amount;
+            first_debit = request->legs[i].account_id;
         }
-        line = strtok(NULL, "\n");
     }
+    strcpy(request->account_id, first_debit);
+    request->amount = moved > INT_MAX ? INT_MAX : moved;
+    return request->leg_count > 0;
+}
 
-    close(fd);
+// Parses the next valid line of the client file into request. Lines that are not "<account> <operation> <amount>",
+// "<account>[,<account>...] balance" or a transfer are reported and skipped. Returns 0 at the end of the file.
+int next_request(Workload_Reader *reader, Request *request)
+{
+    if (next_query_ids(reader, request))
+        return 1;
+    while (reader->pos < reader->size)
+    {
+        const char *line = reader->data + reader->pos;
+        const char *newline = memchr(line, '\n', reader->size - reader->pos);
+        const char *end = newline ? newline : reader->data + reader->size;
+        reader->pos = end - reader->data + (newline != NULL);
+        reader->line_number++;
+
+        // Account is kept as a span since a balance query or a transfer may list many of them.
+        const char *c = line;
+        while (c < end && (*c == ' ' || *c == '\t'))
+            c++;
+        const char *account = c;
+        while (c < end && *c != ' ' && *c != '\t' && *c != '\r')
+            c++;
+        size_t account_length = c - account;
+        char amount[16];
+        char *amount_end;
+        if (account_length > 0 && next_word(&c, end, request->operation, sizeof(request->operation)))
+        {
+            if (strcmp(request->operation, "balance") == 0 && memchr(account, ',', account_length) != NULL)
+            {
+                reader->next_id = account;
+                reader->ids_end = account + account_length;
+                if (next_query_ids(reader, request))
+                    return 1;
+                continue;
+            }
+            if (strcmp(request->operation, "balance") == 0)
+            {
+                if (account_length < sizeof(request->account_id))
+                {
+                    memcpy(request->account_id, account, account_length);
+                    request->account_id[account_length] = '\0';
+                    request->amount = 0;
+                    request->leg_count = 0;
+                    return 1;
+                }
+            }
+            else if (strcmp(request->operation, "transfer") == 0)
+            {
+                if (parse_transfer(account, account_length, &c, end, request))
+                    return 1;
+            }
+            else if (account_length < sizeof(request->account_id) && next_word(&c, end, amount, sizeof(amount)))
+            {
+                memcpy(request->account_id, account, account_length);
+                request->account_id[account_length] = '\0';
+                request->amount = strtol(amount, &amount_end, 10);
+                if (*amount_end == '\0')
+                    return 1;
+            }
+        }
+        // Empty lines are skipped silently.
+        if (end > line && !(end - line == 1 && *line == '\r'))
+            fprintf(stderr, "Invalid format in line %ld: %.*s\n", reader->line_number, (int)(end - line), line);
+    }
+    return 0;
+}
+
+// Makes the pipe of the fifo large enough for the given number of bytes if it is not already. Returns 0 if it can not.
+int fit_pipe(int fd, size_t bytes)
+{
+    if (bytes <= DEFAULT_PIPE_SIZE)
+        return 1;
+#ifdef F_SETPIPE_SZ
+    return fcntl(fd, F_SETPIPE_SZ, (int)bytes) != -1;
+#else
+    return 0;
+#endif
+}
+
+// Requests kept in flight when the buffers can not be made larger: as many as fit in a buffer of the default size.
+// A request has room for the legs of a transfer, so it is the larger of the two structures.
+int fallback_in_flight()
+{
+    size_t larger = sizeof(Session_Request) > sizeof(Session_Response) ? sizeof(Session_Request) : sizeof(Session_Response);
+    return DEFAULT_PIPE_SIZE / larger;
+}
+
+// Connects to the unix domain socket of the server. Teller that accepts the connection serves the session.
+int connect_socket()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        printf("Client %d cannot connect to server socket\n", getpid());
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Opens a session over the fifos. Response fifo is opened for reading first without waiting for a writer, so the
+// server can answer busy on it when too many sessions are waiting for a teller. Then the client waits a little and
+// asks again. Returns 0 if the server is not there or no teller takes the session in CONNECT_TIMEOUT_S.
+int connect_session(const char *client_fifo, const char *response_fifo, pid_t pid, int *request_fd, int *response_fd)
+{
+    Server_Connection_Request sc_request;
+    memset(&sc_request, 0, sizeof(sc_request));
+    sc_request.client_pid = pid;
+    strcpy(sc_request.client_fifo, client_fifo);
+    sc_request.session = 1;
+    long long deadline = now_ms() + CONNECT_TIMEOUT_S * 1000LL;
+    for (int attempt = 0;; attempt++)
+    {
+        *response_fd = open(response_fifo, O_RDONLY | O_NONBLOCK);
+        if (*response_fd == -1)
+        {
+            perror("Failed to open session FIFOs");
+            return 0;
+        }
+        // Server fifo is not waited for either, a server that is not running fails right away.
+        int server_fd = open(SERVER_FIFO, O_WRONLY | O_NONBLOCK);
+        if (server_fd == -1)
+        {
+            printf("Client %d cannot connect to server FIFO\n", pid);
+            close(*response_fd);
+            return 0;
+        }
+        // A full server fifo is the same as a busy answer.
+        int queued = write(server_fd, &sc_request, sizeof(sc_request)) == sizeof(sc_request);
+        close(server_fd);
+
+        // Request fifo can be opened as soon as a teller opens it for reading. Until then the response fifo is
+        // checked for a busy answer.
+        char message[100] = "";
+        while (queued)
+        {
+            *request_fd = open(client_fifo, O_WRONLY | O_NONBLOCK);
+            if (*request_fd != -1)
+            {
+                // Teller opens the response fifo after the request fifo. Opening it again without O_NONBLOCK waits
+                // for that, otherwise the first read could see no writer and end the session. Session is served
+                // with blocking reads and writes like before.
+                int fd = open(response_fifo, O_RDONLY);
+                close(*response_fd);
+                *response_fd = fd;
+                if (fd == -1)
+                {
+                    perror("Failed to open session FIFOs");
+                    close(*request_fd);
+                    return 0;
+                }
+                fcntl(*request_fd, F_SETFL, fcntl(*request_fd, F_GETFL) & ~O_NONBLOCK);
+                return 1;
+            }
+            if (errno != ENXIO)
+            {
+                perror("Failed to open session FIFOs");
+                close(*response_fd);
+                return 0;
+            }
+            struct pollfd poll_fd = {*response_fd, POLLIN, 0};
+            Session_Response response;
+            if (poll(&poll_fd, 1, 1) == 1 && read(*response_fd, &response, sizeof(response)) == sizeof(response) &&
+                response.result == RESULT_BUSY)
+            {
+                strcpy(message, response.message);
+                break;
+            }
+            if (now_ms() > deadline)
+            {
+                fprintf(stderr, "Client %d gave up waiting for a teller after %d s.\n", pid, CONNECT_TIMEOUT_S);
+                close(*response_fd);
+                return 0;
+            }
+        }
+        close(*response_fd);
+        int delay = retry_delay_ms(message, attempt);
+        if (now_ms() + delay > deadline)
+        {
+            fprintf(stderr, "Client %d gave up, server stayed busy for %d s.\n", pid, CONNECT_TIMEOUT_S);
+            return 0;
+        }
+        usleep(delay * 1000);
+    }
+}
+
+// Time to wait before trying again after a busy answer. Server says how long to wait in the message, the wait
+// is doubled with every try up to MAX_BACKOFF_MS. Random half of it is taken away so that clients that were turned
+// away together do not all come back at the same time.
+int retry_delay_ms(const char *message, int attempt)
+{
+    const char *hint = strstr(message, "retry after ");
+    int delay = hint != NULL ? atoi(hint + strlen("retry after ")) : 10;
+    if (delay < 1)
+        delay = 1;
+    for (int i = 0; i < attempt && delay < MAX_BACKOFF_MS; i++)
+        delay *= 2;
+    if (delay > MAX_BACKOFF_MS)
+        delay = MAX_BACKOFF_MS;
+    return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+// Monotonic time in milliseconds, used for the retry times.
+long long now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Makes the send buffer of the socket large enough for the given number of bytes. Returns 0 if it can not.
+// Kernel counts its own bookkeeping in the buffer too, so twice the bytes are asked for.
+int fit_socket(int fd, size_t bytes)
+{
+    int size = 2 * bytes, actual;
+    socklen_t length = sizeof(actual);
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1 ||
+        getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &actual, &length) == -1)
+        return 0;
+    return actual >= size;
 }
 
 //Sets up the signals
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE // For struct ucred of the socket credentials.
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -8,38 +11,108 @@
 #include <sys/wait.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <semaphore.h>
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bankformat.h"
+#include "bankmetrics.h"
 
 #define SERVER_FIFO "server_fifo"
 #define CLIENT_FIFO_TEMPLATE "client_fifo_%d"
 #define CLIENT_FIFO_NAME_LEN 64
-#define REQUEST_PIPE "teller_to_server.pipe"
+#define SOCKET_PATH "bank.sock" // Clients that use -u connect here instead of writing to the server fifo.
+#define RESPONSE_FIFO_TEMPLATE "%s.resp" // Responses of a session come back on a second fifo next to the client fifo.
 #define MAX_BUFFER 256
 #define SHM_KEY 1234
 #define SEM_NAME "/bank_semaphore"
 #define DB_FILE "database.txt"
+#define DB_BINARY_FILE "database.bin"
+#define DB_BINARY_TEMP_FILE "database.bin.tmp"
+#define STORE_FILE "bank.store"
+#define CHECKPOINT_FILE "bank.checkpoint"
+#define CHECKPOINT_TEMP_FILE "bank.checkpoint.tmp"
+#define CHECKPOINT_DIR "ckpt"
+#define DELTA_TEMPLATE "ckpt/%016llu.delta" // Incremental checkpoints are named by their LSN.
+#define DELTA_TEMP_FILE "ckpt/delta.tmp"
+#define MAX_DELTA_CHAIN 8 // Deltas are merged into the full checkpoint when there are this many of them.
+#define DEFAULT_CHECKPOINT_INTERVAL 30 // Seconds between incremental checkpoints.
+#define MAX_REPLAY_THREADS 8
+#define MAX_LOAD_THREADS 16
+#define LOAD_CHUNK_MIN (1 << 20) // database.txt is split into chunks of at least this many bytes, one for every thread.
 #define LOG_FILE "AdaBank.bankLog"
-#define MAX_ACCOUNTS 100
+#define LOG_ROTATED_TEMPLATE "AdaBank.bankLog.%d" // Older logs, .1 is the newest of them.
+#define LOG_ROTATE_KEEP 4
+#define DEFAULT_LOG_ROTATE_MB 64
+#define AUDIT_BUFFER_SIZE (256 * 1024) // Audit writer writes the log file in pieces of this size.
+#define AUDIT_DIR "audit"
+#define AUDIT_SEGMENT_TEMPLATE "audit/%016llu.seg" // Audit segments are named by the sequence number of their first record.
+#define AUDIT_INDEX_TEMPLATE "audit/%016llu.idx"
+#define AUDIT_INDEX_TEMP_TEMPLATE "audit/%016llu.tmp"
+#define AUDIT_SEGMENT_RECORDS (1 << 18) // Audit segment is closed and indexed when it has this many records.
+#define WAL_DIR "wal"
+#define WAL_SEGMENT_TEMPLATE "wal/%016llu.seg" // Segments are named by the LSN of their first record.
+#define WAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define WAL_BUFFER_RECORDS 4096
+#define WAL_GROUP_MAX 1024          // Log writer does not wait for the rest of the commit window when this many records are waiting.
+#define DEFAULT_COMMIT_WINDOW 1000 // Microseconds the log writer waits for more records before a fsync.
+#define MAX_TRANSFER_LEGS 8
+#define INITIAL_CAPACITY 1024 // Store starts with this many account places and doubles when it is full.
+#define MAX_CAPACITY (1 << 28)
+#define INDEX_EMPTY -1
+#define INDEX_DELETED -2
+#define MAX_TELLERS 64
+#define DEFAULT_TELLERS 4
+#define DEFAULT_SOCKET_TELLERS 2
+#define SOCKET_BACKLOG 128
+#define EVENT_BATCH 64 // Events an event teller takes from epoll at once.
+#define CONNECTION_QUEUE_SIZE 128
+#define RESULT_BUSY 2       // Result of a request or a session that is turned away since the server is full.
+#define BUSY_RETRY_MS 10    // Time that a busy answer tells the client to wait before trying again.
+#define REAP_INTERVAL_MS 1000 // Longest time a dead teller waits to be restarted when no client comes to the server fifo.
+#define SESSION_WINDOW 64 // Requests of a session that a teller has given to the handlers and not answered yet.
+// Every teller has at most SESSION_WINDOW requests in the rings, so a ring of this size (a power of two) can hold the
+// requests of all the tellers and never fills up.
+#define REQUEST_RING_SIZE (MAX_TELLERS * SESSION_WINDOW)
+#define DEFAULT_PENDING_REQUESTS 256 // Requests that may wait in a ring before new ones are answered busy (-p).
+#define REQUEST_BATCH 64      // Handler takes at most this many requests from its ring at once.
+#define MAX_SHARDS METRIC_SHARDS // bankstat shows the queue depth of every shard.
+#define DEFAULT_SHARDS 1
+#define LOCK_STRIPES 64 // Power of two, accounts are locked by the stripe their id hashes to.
+#define DIRTY_REMOVED_MAX 4096 // A full checkpoint is written instead of an incremental one when more accounts are removed.
 
 // Structures
 
-// This is used to store information related to a bank account.
-typedef struct
-{
-    char account_id[20];
-    int balance;
-} Account;
+// On disk layouts (Account, Wal_Record, Audit_Entry, store, checkpoint and database.bin headers) are in bankformat.h.
 
 // These structures are the same ones as in client.c, for explanation please refer to that file.
 typedef struct
 {
     pid_t client_pid;
     char client_fifo[CLIENT_FIFO_NAME_LEN];
+    int session;
 } Server_Connection_Request;
 
+typedef struct
+{
+    char account_id[20];
+    int amount;
+} Transfer_Leg;
+
 typedef struct
 {
     pid_t client_pid;
@@ -47,6 +120,8 @@ typedef struct
     char operation[10];
     int amount;
     int possible_request;
+    int leg_count;
+    Transfer_Leg legs[MAX_TRANSFER_LEGS];
 } Request;
 
 typedef struct
@@ -54,45 +129,378 @@ typedef struct
     char message[100];
 } Response;
 
+typedef struct
+{
+    unsigned int request_id;
+    Request request;
+} Session_Request;
+
+typedef struct
+{
+    unsigned int request_id;
+    int result;
+    char message[100];
+} Session_Response;
+
+// This is what a teller sends to the handler through the request ring. Teller id and entry tell the handler where
+// to report the result to and sequence number makes sure that the teller does not take a result of an older request.
+typedef struct
+{
+    Request request;
+    int teller_id;
+    int entry;
+    unsigned int seq;
+} Teller_Request;
+
+// Result of one request of a teller.
+typedef struct
+{
+    unsigned int done_seq;   // Sequence number of the request that is applied, set last by the handler.
+    unsigned long long lsn;  // LSN of the log record of the request, 0 if nothing is logged.
+    int result;              // Return value of update_database.
+    char message[100];
+} Teller_Result;
+
+// Handlers report the results of a teller's requests here. Every teller has its own slot. A teller serving a session
+// has many requests in the handlers at the same time, each of them uses its own entry.
+typedef struct
+{
+    sem_t done;            // Posted by a handler when a request is applied.
+    unsigned int next_seq; // Kept in shared memory so that a restarted teller does not reuse the numbers of the old one.
+    Teller_Result results[SESSION_WINDOW];
+} Teller_Slot;
+
+// A client connection of an event teller. Requests of all the connections share the entries of the teller's slot.
+// Responses that the socket does not take at once wait in output, connection is not read until they are sent.
+typedef struct Event_Connection
+{
+    int fd;
+    pid_t client_pid;
+    unsigned int events; // Events that epoll watches for this connection.
+    char input[SESSION_WINDOW * sizeof(Session_Request)];
+    size_t input_length;
+    char output[2 * SESSION_WINDOW * sizeof(Session_Response)];
+    size_t output_start, output_end;
+    int in_flight;
+    int eof;     // Client has shut down its sending side.
+    int broken;  // Socket failed, results of the requests that are still in the handlers are dropped.
+    int stalled; // Not read because every entry of the slot is in use.
+    int touched; // Has new responses in the current batch of results.
+    int served;
+    int released; // Closed and on the list of connections that are freed after the current events.
+    struct Event_Connection *next_stalled;
+    struct Event_Connection *next_released;
+} Event_Connection;
+
+// Records wait in this circular buffer until the log writer writes them to disk and the audit writer writes them to
+// the audit segments. Record with LSN n is kept at n % WAL_BUFFER_RECORDS. Mutex and conditions are process shared
+// since the buffer lives in shared memory.
+// Audit writer holds the writes back: when it is WAL_BUFFER_RECORDS records behind, handlers wait in wal_append with
+// the lock of their stripe held until it moves audited_lsn. So a slow audit disk slows every change the same way a
+// slow log disk does. A dead audit writer would stop them for good, the server is stopped then (see reap_tellers).
+typedef struct
+{
+    Wal_Record records[WAL_BUFFER_RECORDS];
+    unsigned long long next_lsn;    // LSN of the next record to be added.
+    unsigned long long durable_lsn; // Records up to and including this LSN are on disk.
+    unsigned long long audited_lsn; // Records up to and including this LSN are in the audit segments, their places can be reused.
+    int audit_closing;              // Set by the server when it stops, audit writer exits once it has written every durable record.
+    pthread_mutex_t lock;
+    pthread_cond_t appended; // Signalled when a record is added, log writer waits on it.
+    pthread_cond_t flushed;  // Broadcast after every fsync and every write of the audit writer, everyone waiting for either of them waits on it.
+} Wal_Buffer;
+
+// This is a bounded circular queue of connection requests. Server puts the requests it reads from the server fifo
+// into it and the tellers in the pool take them out. Semaphores are process shared since the queue lives in shared memory.
+typedef struct
+{
+    Server_Connection_Request requests[CONNECTION_QUEUE_SIZE];
+    int head;
+    int tail;
+    sem_t empty_slots; // Counts free places in the queue, server waits on it when the queue is full.
+    sem_t full_slots;  // Counts waiting requests, idle tellers wait on it.
+    sem_t queue_lock;  // Protects head and tail.
+} Connection_Queue;
+
+// Requests go from the tellers to the handler through this ring in shared memory instead of a pipe, so sending
+// a request is a few atomic operations and no system call unless the handler is sleeping.
+// Many tellers put requests and only the handler takes them. A cell can be written when its seq equals the position
+// a teller reserved and it can be read when seq is one more than that. Positions are reserved by increasing tail
+// with compare and swap. Handler sleeps on wakeups with a futex, tellers only wake it when sleeping is set.
+typedef struct
+{
+    unsigned int seq;
+    Teller_Request request;
+} Request_Cell;
+
+typedef struct
+{
+    Request_Cell cells[REQUEST_RING_SIZE];
+    unsigned int tail;    // Next position to be reserved by a teller.
+    unsigned int head;    // Next position to be read by the handler, only the handler changes it.
+    int sleeping;         // Set by the handler before it sleeps.
+    unsigned int wakeups; // Futex word, increased by a teller that wakes the handler.
+} Request_Ring;
+
+// Accounts are split into shards by the hash of their id and every shard has its own handler process. Balance of an
+// account is only changed by the handler of its shard.
+typedef struct
+{
+    Request_Ring ring; // Requests of the accounts in this shard, new accounts are spread over the shards.
+} Shard;
+
+// Changes since the last checkpoint. This is shared by all the handlers, so it is kept in an anonymous shared
+// mapping that is created before they are forked. Only the pages of the bitmap that are used take memory.
+typedef struct
+{
+    unsigned long long changes;         // Number of changes, checkpoint is skipped when nothing has changed.
+    int removed_count;
+    int overflow;                       // Too many removals to remember, next checkpoint is a full one.
+    Account removed[DIRTY_REMOVED_MAX]; // Ids of the removed accounts, only changed while holding all the locks.
+    unsigned long long bits[MAX_CAPACITY / 64]; // One bit for every account place, set with atomic or since shards share words.
+} Dirty_Map;
+
+// Work of one recovery thread. Each thread replays the log records of the accounts whose hash falls into its partition.
+typedef struct
+{
+    Wal_Record **records;  // Records of the partition in LSN order.
+    int count;
+    Wal_Record **changes;  // Accounts that have to be created or removed, these are done after the threads finish.
+    int change_count;
+    int max_created_id;    // Largest number of the accounts created in the log, next_id is moved past it.
+} Replay_Partition;
+
+// Part of database.txt that one loading thread parses. Chunks start at the beginning of a line.
+typedef struct
+{
+    const char *start;
+    const char *end;
+    long lines;     // Lines in the chunk, its accounts are parsed into the places after the lines of the chunks before it.
+    long first;     // Place of the first account of the chunk in the accounts array.
+    long count;     // Accounts parsed, lines that are not valid leave no account.
+    long skipped;
+    long duplicates;
+    int max_id;     // Largest number of the BankID_ ids in the chunk.
+} Load_Chunk;
+
 // This is used for communication between tellers and the bank server as shared memory as required in the homework.
 typedef struct
 {
-    Account accounts[MAX_ACCOUNTS];
-    int db_size;
-    int next_id;
+    Connection_Queue teller_queue;
+    Teller_Slot teller_slots[MAX_TELLERS];
+    Shard shards[MAX_SHARDS];
+    // Balance of an account is read and changed while holding the lock of its stripe, so a teller checking one account
+    // only waits for the requests of the accounts in the same stripe. Creating and removing accounts moves other
+    // accounts and may grow the store, so those are done while holding the database semaphore and all the stripe locks.
+    pthread_mutex_t stripe_locks[LOCK_STRIPES];
+    // Sequence lock of every stripe, odd while its lock is held. Tellers read balances without taking any lock and
+    // read again if the sequence changed meanwhile. Creating and removing accounts holds every stripe, so every
+    // sequence is odd while accounts are moved.
+    unsigned int stripe_seqs[LOCK_STRIPES];
+    Wal_Buffer wal;
+    pthread_mutex_t checkpoint_lock; // Held while a checkpoint file is written, so only one is written at a time.
 } SharedData;
 
 // Some globals to be used throughout the program.
 // This will refer to the shared data.
 SharedData *shared_data;
-// This semaphore will be used to ensure that no race conditions occur on operations regarding the database.
+// This semaphore will be used to ensure that no race conditions occur on operations that change the structure of the
+// database (creating and removing accounts, growing the store). Balance changes only take the lock of their shard.
 sem_t *db_semaphore;
 int shm_id;
-// Handler pid, usage is explained inside handler function.
-pid_t handler_pid;
+Bank_Metrics *metrics;
+int metrics_shm_id;
+// Every applied request is printed only when this is set (-v), printing is slow compared to applying a request.
+int verbose = 0;
+// These refer to the memory mapped account store. Every process has its own mapping, see remap_store.
+Store_Header *store;
+Account *accounts;
+int *account_index;
+int store_fd = -1;
+size_t store_mapped_size;
+int store_mapped_generation;
+int store_mapped_capacity; // Capacity of this process's mapping, tellers reading without locks do not go past it.
+// When set, the store is created again from database.bin (or database.txt) instead of using the existing store file.
+int import_database = 0;
+// Handler pids, one for every shard. Usage is explained inside handler function.
+pid_t handler_pids[MAX_SHARDS];
+int shard_count = DEFAULT_SHARDS;
+// Log writer writes the write ahead log to disk, many records are written with one fsync (group commit).
+pid_t log_writer_pid;
+// Audit writer writes the log file (AdaBank.bankLog) and the audit segments from the records of the write ahead log
+// that are on disk, the log file is rotated when it is this large.
+pid_t audit_writer_pid;
+long log_rotate_mb = DEFAULT_LOG_ROTATE_MB;
+// Found by audit_open before the audit writer is forked, then private to it.
+FILE *audit_log;
+FILE *audit_segment;                  // Segment that is written, NULL until the first record of this run.
+unsigned long long audit_segment_seq; // Sequence number of the first record of the segment.
+unsigned long long audit_next_seq;    // Sequence number that the next record of the segment must have.
+int wal_fd = -1;
+off_t wal_segment_bytes; // Size of the segment that is being written.
+int commit_window = DEFAULT_COMMIT_WINDOW;
+// Incremental checkpoints are taken by the handler of the first shard, the rest of these are private to it.
+int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+Dirty_Map *dirty_map;
+unsigned long long last_checkpoint_lsn; // LSN of the last checkpoint, full or incremental.
+int delta_chain;                        // Number of incremental checkpoints after the full one.
+pid_t checkpoint_writer_pid = -1;       // Process writing an incremental checkpoint in the background.
+Account *checkpoint_entries;            // Accounts given to the checkpoint writer, kept until it succeeds.
+int checkpoint_entry_count;
+unsigned long long checkpoint_pending_lsn;
+int checkpoint_pending_compact;
+int checkpoint_pending_full;
+time_t last_checkpoint_time;
+// Pids of the tellers in the pool, the index of a teller in this array is its teller id.
+pid_t teller_pids[MAX_TELLERS];
+int teller_ids[MAX_TELLERS];
+int teller_count = DEFAULT_TELLERS;
+// Socket tellers come after the fifo tellers in the pool and accept their clients from the listening socket themselves.
+int socket_teller_count = DEFAULT_SOCKET_TELLERS;
+int listen_fd = -1;
+// When set, every socket teller serves many connections at once with epoll and handlers wake it through its eventfd.
+int event_tellers = 0;
+int teller_event_fds[MAX_TELLERS];
+// Admission limits. A session is turned away when this many are waiting for a teller, a request when its handler
+// has this many requests in its ring. Clients are told to come back later instead of waiting without limit.
+int max_waiting_connections = CONNECTION_QUEUE_SIZE;
+int max_pending_requests = DEFAULT_PENDING_REQUESTS;
 
 // Explanations for functions are under main where definitions are done.
 void init_log_file();
-void log_transaction(const char *account_id, const char *operation, int amount);
 void finalize_log_file();
+void audit_writer();
+void audit_write(const Wal_Record *record);
+void close_audit_segment();
+FILE *open_audit_segment(unsigned long long first_seq);
+void audit_open();
+void move_audit_aside(const char *reason);
+void sync_audit_segment();
+void start_audit_index(unsigned long long first_seq);
+void build_audit_index(unsigned long long first_seq);
+void stop_audit_writer();
+FILE *rotate_log_file(FILE *log);
 void load_database_from_file();
+int load_database_binary();
+void write_database_binary();
+int load_thread_count(size_t bytes);
+void index_loaded_accounts(Load_Chunk *chunks, int chunk_count, const char *source);
+void *count_load_chunk(void *arg);
+void *parse_load_chunk(void *arg);
+void *index_load_chunk(void *arg);
+void run_load_threads(void *(*work)(void *), Load_Chunk *chunks, int count);
+size_t store_file_size(int capacity);
+void map_store();
+void remap_store();
+void open_store();
+int grow_store();
+void create_empty_store();
+void init_checkpoint_lock();
+void lock_checkpoint();
+int write_checkpoint_file(const char *temp_path, const char *path, Checkpoint_Header *header, const Account *entries);
+void write_checkpoint();
+int load_checkpoint(unsigned long long *lsn);
+int load_delta_checkpoints(unsigned long long *lsn);
+void init_dirty_map();
+void mark_dirty(int position);
+void mark_removed(const char *account_id);
+void clear_dirty();
+int compact_checkpoints(unsigned long long lsn, int next_id);
+void start_background_checkpoint();
+void reap_checkpoint_writer();
+void handler_loop(int shard);
+int shard_of(const char *account_id);
+void init_stripe_locks();
+void recover_stripe(int stripe);
+int stripe_of(const char *account_id);
+void lock_stripe(int stripe);
+void unlock_stripe(int stripe);
+void lock_all_stripes();
+void unlock_all_stripes();
+int needs_structure_lock(const Request *req);
+int apply_transfer(const Request *req, char *response, unsigned long long *lsn);
+int transfer_removes_account(const Request *req);
+int update_transfer(const Request *req, char *response, unsigned long long *lsn);
+int read_balance(const char *account_id, int *balance);
+int read_balances(const Transfer_Leg *legs, int count, int *balances, int *found);
+int probe_balance(const char *account_id, int *balance);
+int list_lsn_files(const char *directory, const char *extension, unsigned long long **lsns);
+void wal_remove_segments(unsigned long long lsn);
+long long wal_read_records(unsigned long long from_lsn, Wal_Record **records);
+void *replay_partition(void *arg);
+void recover_from_wal(unsigned long long from_lsn);
+void stop_server_processes();
 void save_database_to_file(int sig);
-int update_database(const char *account_id, const char *operation, int amount, int possible_request, char *response);
+void stop_after_death(const char *name, pid_t pid, int status);
+void release_server_resources();
+int update_database(const char *account_id, const char *operation, int amount, char *response, unsigned long long *lsn);
+int wal_list_segments(unsigned long long **segments);
+void wal_open_segment(unsigned long long first_lsn);
+void wal_open();
+void init_wal_buffer(Wal_Buffer *wal);
+void lock_wal(Wal_Buffer *wal);
+int wait_wal(pthread_cond_t *cond, Wal_Buffer *wal, const struct timespec *deadline);
+unsigned long long wal_append(int type, const char *account_id, int amount, int balance);
+unsigned long long wal_append_group(Wal_Record *group, int count);
+void wal_wait_durable(unsigned long long lsn);
+void wal_write(unsigned long long first, unsigned long long last);
+void log_writer();
+void init_metrics();
+long long now_us();
+void metric_add(unsigned long long *counter, unsigned long long value);
+void metric_record(Metric_Histogram *histogram, long long us);
+int metric_op(const Request *request);
+pid_t timed_fork();
+unsigned int hash_account_id(const char *account_id);
+int find_account(const char *account_id);
+void index_insert(const char *account_id, int position);
+void index_remove(const char *account_id);
+void rebuild_index();
+int add_account(const char *account_id, int balance);
+void remove_account(int position);
+void init_teller_queue(Connection_Queue *queue);
+void enqueue_connection(Connection_Queue *queue, const Server_Connection_Request *sc_request);
+void dequeue_connection(Connection_Queue *queue, Server_Connection_Request *sc_request);
+void serve_client(Server_Connection_Request *sc_request, int teller_id);
+void serve_session(Server_Connection_Request *sc_request, int teller_id);
+int serve_session_fds(int request_fd, int response_fd, int teller_id);
+int open_listening_socket();
+void serve_socket_clients(int teller_id);
+void serve_socket_events(int teller_id);
+unsigned int submit_request(int teller_id, int entry, const Request *request);
+int request_shard(int teller_id, int entry, const Request *request);
+int handler_busy(int shard);
+int answer_busy(char *response);
+void reject_connection(const Server_Connection_Request *sc_request);
+int is_balance_query(const Request *request);
+int answer_balance_query(const Request *request, char *response);
+int answer_bulk_balance_query(const Request *request, char *response);
+void init_request_ring(Request_Ring *ring);
+void ring_push(Request_Ring *ring, const Teller_Request *treq);
+int ring_pop_batch(Request_Ring *ring, Teller_Request *batch, int max);
+void ring_wait(Request_Ring *ring, int timeout_ms);
 void *func(void *arg);
 pid_t Teller(void *func, void *arg_func);
 int waitTeller(pid_t pid, int *status);
+void start_teller(int teller_id);
+void reap_tellers();
 void setup_sigaction(int signum, void (*handler)(int));
+void parse_arguments(int argc, char *argv[]);
 
-int main()
+int main(int argc, char *argv[])
 {
+    // Read the teller pool size from the command line.
+    parse_arguments(argc, argv);
+    // Output is line buffered so that messages of tellers and handler are not lost when they are killed.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     // Handle termination signal which is "the only way" to terminate the bank server.
     setup_sigaction(SIGINT, save_database_to_file);
     // Initialize the log file, write the time stamp when it is updated.
     init_log_file();
 
-    // Create server fifo (between server and client) and request pipe (between tellers and server)
+    // Create server fifo (between server and client)
     mkfifo(SERVER_FIFO, 0666);
-    mkfifo(REQUEST_PIPE, 0666);
     printf("Creating the bank database...\n");
     printf("Adabank is active... Waiting for clients at %s\n", SERVER_FIFO);
 
@@ -110,16 +518,70 @@ int main()
         exit(1);
     }
 
-    // Initialize database size to be zero first (it is determined by the line count in the database file later).
-    shared_data->db_size = 0;
-    // next_id variable is used to assign new account id's.
-    shared_data->next_id = 1;
+    // Counters are attached before any process is forked so that all of them have them.
+    init_metrics();
+
+    // Log is opened first since the store may need to be recovered from it.
+    init_checkpoint_lock();
+    init_dirty_map();
+    init_wal_buffer(&shared_data->wal);
+    wal_open();
+    // Audit segments are written from the log, so the log records that are not in them yet are kept.
+    audit_open();
+    // Open the account store, database.bin or database.txt is only read when there is no store or checkpoint yet.
+    open_store();
+    init_teller_queue(&shared_data->teller_queue);
+    for (int i = 0; i < shard_count; i++)
+    {
+        init_request_ring(&shared_data->shards[i].ring);
+    }
+    init_stripe_locks();
+    for (int i = 0; i < MAX_TELLERS; i++)
+    {
+        sem_init(&shared_data->teller_slots[i].done, 1, 0);
+    }
+    // Event tellers wait for the results and the client sockets with one epoll_wait, so handlers write to an eventfd
+    // instead of posting the semaphore. They are created before the handlers are forked so that all of them have them.
+    for (int i = 0; i < MAX_TELLERS; i++)
+    {
+        teller_event_fds[i] = -1;
+        if (event_tellers && i >= teller_count && i < teller_count + socket_teller_count)
+        {
+            teller_event_fds[i] = eventfd(0, EFD_NONBLOCK);
+            if (teller_event_fds[i] == -1)
+            {
+                perror("eventfd");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Log writer is a separate process so that neither the handler nor the tellers wait for the disk while writing.
+    fflush(stdout);
+    log_writer_pid = timed_fork();
+    if (log_writer_pid == 0)
+    {
+        // Log writer is stopped by the server after the last records are written, see stop_server_processes.
+        setup_sigaction(SIGINT, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        log_writer();
+        exit(0);
+    }
 
-    // Load the existing database.
-    load_database_from_file();
-    shared_data->next_id = shared_data->db_size + 1;
+    // Audit writer keeps the writes of the log file and the audit segments away from the handlers.
+    fflush(stdout);
+    audit_writer_pid = timed_fork();
+    if (audit_writer_pid == 0)
+    {
+        setup_sigaction(SIGINT, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        audit_writer();
+        exit(0);
+    }
 
     // Initialize the semaphore that will protect the data in the database.
+    // An old semaphore is removed first, it may have been left locked by a server that crashed.
+    sem_unlink(SEM_NAME);
     db_semaphore = sem_open(SEM_NAME, O_CREAT, 0666, 1);
     if (db_semaphore == SEM_FAILED)
     {
@@ -127,35 +589,39 @@ int main()
         exit(1);
     }
 
-    // To help concurrency, server forks a handler that will listen and do the updates to the database so that server can continue accepting requests.
-    handler_pid = fork();
-    if (handler_pid == 0)
+    // To help concurrency, server forks handlers that will listen and do the updates to the database so that server can continue accepting requests.
+    // There is one handler for every shard so that updates of different accounts are done in parallel.
+    for (int i = 0; i < shard_count; i++)
     {
-        // Update the handler behaviour to be the default inside handler
-        // because otherwise when server is terminated via ctrl+c, signal handler is executed twice
-        // which is not what I want.
-        setup_sigaction(SIGINT, SIG_DFL);
-
-        // Listen appropriate requets from teller, and update the database.
-        int pipe_fd = open(REQUEST_PIPE, O_RDONLY);
-        while (1)
+        fflush(stdout);
+        handler_pids[i] = timed_fork();
+        if (handler_pids[i] == 0)
         {
-            Request req;
-            if (read(pipe_fd, &req, sizeof(Request)) > 0)
-            {
-                char response_msg[100];
-                // Protect the database operation using a semaphore. (Detailed discussion is in the report)
-                sem_wait(db_semaphore);
-                update_database(req.account_id, req.operation, req.amount, req.possible_request, response_msg);
-                sem_post(db_semaphore);
-            }
+            // Ignore ctrl+c inside handler because otherwise when server is terminated via ctrl+c, signal handler
+            // is executed twice which is not what I want. Server stops the handler itself when it is not in the middle of an update.
+            setup_sigaction(SIGINT, SIG_IGN);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+            handler_loop(i);
+            exit(0);
         }
-        close(pipe_fd);
-        exit(0);
     }
 
+    // Socket is created before the tellers are forked so that every socket teller can accept on it.
+    if (socket_teller_count > 0)
+        listen_fd = open_listening_socket();
+
+    // Fork the teller pool once. Tellers live as long as the server and take connection requests from the shared queue,
+    // socket tellers take them from the listening socket.
+    for (int i = 0; i < teller_count + socket_teller_count; i++)
+    {
+        start_teller(i);
+    }
+    printf("%d tellers are waiting for clients on %s, %d on %s.\n", teller_count, SERVER_FIFO, socket_teller_count, SOCKET_PATH);
+
     // Open server fifo to listen server connection requests.
-    int server_fd = open(SERVER_FIFO, O_RDONLY);
+    // It is opened for writing as well so that read blocks instead of returning end of file when no client is connected.
+    int server_fd = open(SERVER_FIFO, O_RDWR);
     if (server_fd == -1)
     {
         perror("Server FIFO open");
@@ -166,35 +632,41 @@ int main()
     // ! Server can only be stopped using ctrl+c (SIGTERM) signal, otherwise will run forever !
     while (1)
     {
+        // Fifo is waited with a timeout so that the tellers are looked after even when all clients use the socket.
         Server_Connection_Request sc_request;
-        if (read(server_fd, &sc_request, sizeof(sc_request)) > 0)
+        struct pollfd poll_fd = {server_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, REAP_INTERVAL_MS) > 0 && read(server_fd, &sc_request, sizeof(sc_request)) == sizeof(sc_request))
         {
-            Server_Connection_Request *req_copy = malloc(sizeof(Server_Connection_Request));
-            memcpy(req_copy, &sc_request, sizeof(Server_Connection_Request));
-            // Call the teller function to fork child processes, just as required in the homework document.
-            pid_t pid = Teller(func, req_copy);
-            int status;
-            // Wait the child processes to clean up the resources.
-            waitTeller(pid, &status);
-            free(req_copy);
+            // Hand the request to the pool, a free teller will pick it up. When too many are already waiting the
+            // client is told to try again later, so server never blocks on a full queue.
+            int waiting;
+            sem_getvalue(&shared_data->teller_queue.full_slots, &waiting);
+            if (waiting >= max_waiting_connections)
+                reject_connection(&sc_request);
+            else
+                enqueue_connection(&shared_data->teller_queue, &sc_request);
         }
+        // Restart the tellers that have died so that the pool size stays the same.
+        reap_tellers();
     }
 
     // All this resource cleaning is done when server is delivered SIGTERM signal which is the only way to stop it.
     /* close(server_fd);
     unlink(SERVER_FIFO);
-    unlink(REQUEST_PIPE);
     sem_close(db_semaphore);
     sem_unlink(SEM_NAME);
+    munmap(store, store_mapped_size);
+    close(store_fd);
     shmdt(shared_data);
     shmctl(shm_id, IPC_RMID, NULL); */
     return 0;
 }
 
 // Initializes the log file, creating it and writing timestamp and some message to it.
+// Log is appended to so that the history of the earlier runs is kept.
 void init_log_file()
 {
-    FILE *log = fopen(LOG_FILE, "w");
+    FILE *log = fopen(LOG_FILE, "a");
     if (!log)
     {
         perror("Could not open log file");
@@ -208,271 +680,3367 @@ void init_log_file()
     fclose(log);
 }
 
-// This function is used to create a log message which corresponds to a line in the log file.
-void log_transaction(const char *account_id, const char *operation, int amount)
+// Futex is used directly since it works on any word in shared memory. FUTEX_PRIVATE_FLAG is not used because
+// the tellers and the handler are different processes.
+static long futex(unsigned int *word, int op, unsigned int value, const struct timespec *timeout)
 {
-    FILE *log = fopen(LOG_FILE, "a");
-    if (!log)
-        return;
-    fprintf(log, "%s %c %d\n", account_id, (operation[0] == 'd' || operation[0] == 'D') ? 'D' : 'W', amount);
-    fclose(log);
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
 }
 
-// It prints the end statmenet for the log file and closes it.
-void finalize_log_file()
+// Main loop of the audit writer. It follows the write ahead log: every record that the log writer has synced is
+// written as a line of the log file and as an audit record whose sequence number is the LSN of the record. So a
+// change that was acknowledged always has its audit record, and records that were lost in a crash are written again
+// from the log segments at the next start. Files are written through large stdio buffers and flushed before
+// audited_lsn is moved, the log keeps the records until then (see wal_remove_segments).
+// Handlers wait for it when the log buffer is full (see Wal_Buffer). It exits when it can not write, rather than go
+// on with an audit that misses records, and the server is stopped.
+void audit_writer()
 {
-    FILE *log = fopen(LOG_FILE, "a");
-    if (log)
+    Wal_Buffer *wal = &shared_data->wal;
+    audit_log = fopen(LOG_FILE, "a");
+    if (!audit_log)
     {
-        fprintf(log, "## end of log.\n");
-        fclose(log);
+        perror("Could not open log file");
+        exit(1);
+    }
+    setvbuf(audit_log, NULL, _IOFBF, AUDIT_BUFFER_SIZE);
+    // Segments without an index (the last one after a crash) are indexed now.
+    unsigned long long *segments;
+    int count = list_lsn_files(AUDIT_DIR, "seg", &segments);
+    for (int i = 0; i < count; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), AUDIT_INDEX_TEMPLATE, segments[i]);
+        if (access(path, F_OK) != 0)
+            start_audit_index(segments[i]);
+    }
+    free(segments);
+
+    lock_wal(wal);
+    unsigned long long audited = wal->audited_lsn;
+    unsigned long long durable = wal->durable_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    // Records of the runs before that are not in the audit segments are read from the log segments.
+    if (durable > audited)
+    {
+        Wal_Record *records;
+        long long record_count = wal_read_records(audited, &records);
+        for (long long i = 0; i < record_count && records[i].lsn <= durable; i++)
+            audit_write(&records[i]);
+        if (record_count == 0 || records[record_count - 1].lsn < durable)
+            fprintf(stderr, "Audit misses records up to LSN %llu, they are not in the log any more.\n", durable);
+        else
+            printf("Audit records %llu to %llu are written again from the log.\n", audited + 1, durable);
+        free(records);
+        audited = durable;
+    }
+
+    while (1)
+    {
+        if (durable > audited)
+        {
+            // Records after audited_lsn are not overwritten while they are read, appenders wait for it to move.
+            for (unsigned long long lsn = audited + 1; lsn <= durable; lsn++)
+                audit_write(&wal->records[lsn % WAL_BUFFER_RECORDS]);
+            if (log_rotate_mb > 0 && ftell(audit_log) >= log_rotate_mb * 1024 * 1024)
+                audit_log = rotate_log_file(audit_log);
+            if (fflush(audit_log) == EOF || (audit_segment && fflush(audit_segment) == EOF))
+            {
+                perror("Audit write failed");
+                exit(1);
+            }
+            audited = durable;
+        }
+        // Index builders that have finished are reaped.
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        lock_wal(wal);
+        wal->audited_lsn = audited;
+        pthread_cond_broadcast(&wal->flushed);
+        while (wal->durable_lsn == audited && !wal->audit_closing)
+            wait_wal(&wal->flushed, wal, NULL);
+        durable = wal->durable_lsn;
+        int closing = wal->audit_closing;
+        pthread_mutex_unlock(&wal->lock);
+        if (closing && durable == audited)
+            break;
     }
+    fclose(audit_log);
+    // Last segment is indexed as well, the next run starts a new one.
+    close_audit_segment();
+    while (wait(NULL) > 0)
+        ;
 }
 
-// This function reads a pre-existing database file to fill up a datastructure referring to db in the server.
-void load_database_from_file()
+// Writes the line and the audit record of a log record. Records of a segment have consecutive sequence numbers, so a
+// gap in the LSNs (log segments that were lost) starts a new segment, the same as a full segment does.
+void audit_write(const Wal_Record *record)
 {
-    FILE *file = fopen(DB_FILE, "r");
-    if (!file)
+    if (audit_segment && (record->lsn != audit_next_seq || audit_next_seq - audit_segment_seq == AUDIT_SEGMENT_RECORDS))
+        close_audit_segment();
+    if (!audit_segment)
     {
-        perror("Could not open database.txt");
-        return;
+        audit_segment_seq = record->lsn;
+        audit_segment = open_audit_segment(audit_segment_seq);
     }
-    char id[20];
-    int amount;
-    while (fscanf(file, "%s %d", id, &amount) == 2 && shared_data->db_size < MAX_ACCOUNTS)
+    Audit_Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.seq = record->lsn;
+    entry.time_us = record->time_us;
+    memcpy(entry.account_id, record->account_id, sizeof(entry.account_id));
+    // Legs of a transfer keep the signed amount, the money taken out of an account is a withdrawal.
+    entry.type = (record->type == WAL_WITHDRAW || record->amount < 0) ? 'W' : 'D';
+    entry.amount = record->amount < 0 ? -record->amount : record->amount;
+    if (fprintf(audit_log, "%s %c %d\n", entry.account_id, entry.type, entry.amount) < 0 ||
+        fwrite(&entry, sizeof(entry), 1, audit_segment) != 1)
     {
-        strcpy(shared_data->accounts[shared_data->db_size].account_id, id);
-        shared_data->accounts[shared_data->db_size].balance = amount;
-        shared_data->db_size++;
+        perror("Audit write failed");
+        exit(1);
     }
-    fclose(file);
+    audit_next_seq = record->lsn + 1;
 }
 
-// This function writes the current database stored in the datastructures in the server to database file.
-// It is also the signal handler for sigterm, so all the cleanup's are done here.
-void save_database_to_file(int sig)
+// Closes the segment that is written. It is synced first since the log records it holds may be removed once it is
+// closed, then it is indexed in the background.
+void close_audit_segment()
 {
-    printf("\nSignal received, cleaning up and closing active tellers.\n");
-    printf("Adabank says “Bye”...\n");
-    FILE *file = fopen(DB_FILE, "w");
-    if (!file)
+    if (!audit_segment)
+        return;
+    if (fflush(audit_segment) == EOF || fdatasync(fileno(audit_segment)) == -1)
+    {
+        perror("Audit segment sync failed");
+        exit(1);
+    }
+    fclose(audit_segment);
+    audit_segment = NULL;
+    start_audit_index(audit_segment_seq);
+}
+
+// Creates the audit segment that starts with the given sequence number.
+FILE *open_audit_segment(unsigned long long first_seq)
+{
+    char path[64];
+    snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, first_seq);
+    FILE *segment = fopen(path, "a");
+    if (!segment)
     {
-        perror("Could not write to database.txt");
+        perror("Could not create audit segment");
         exit(1);
     }
-    for (int i = 0; i < shared_data->db_size; i++)
+    setvbuf(segment, NULL, _IOFBF, AUDIT_BUFFER_SIZE);
+    // Directory is synced as well, otherwise a new segment could disappear after a crash.
+    int dir_fd = open(AUDIT_DIR, O_RDONLY);
+    if (dir_fd != -1)
     {
-        fprintf(file, "%s %d\n", shared_data->accounts[i].account_id, shared_data->accounts[i].balance);
+        fsync(dir_fd);
+        close(dir_fd);
     }
-    // Clean up all the resources.
-
-    // Kill all child processes (tellers + handler)
-    signal(SIGTERM, SIG_IGN);   // Ignore SIGTERM for ourselves because we already received one.
-    killpg(getpgrp(), SIGTERM); // Kill all tellers
-    fclose(file);
-    finalize_log_file();
-    // handler_pid is used here to kill the handler when server dies in order to avoid orphaned process.
-    kill(handler_pid, SIGINT);
-    sem_close(db_semaphore);
-    sem_unlink(SEM_NAME);
-    shmdt(shared_data);
-    shmctl(shm_id, IPC_RMID, NULL);
-    unlink(SERVER_FIFO);
-    unlink(REQUEST_PIPE);
-    exit(0);
+    return segment;
 }
 
-// This function updates the database according to request arrived.
-// It is only called from server-handler, so database is updated only by server, as required in the homework document.
-int update_database(const char *account_id, const char *operation, int amount, int possible_request, char *response)
+// Finds the sequence number to continue from and tells the log how far the audit segments go. The last segment may
+// end with a torn record if the server was killed, it is cut off. Audit records are only written for records that
+// are on disk in the log, so an audit directory that goes past the end of the log, or one written by a server that
+// numbered the records itself, does not belong to this log and is moved aside.
+void audit_open()
 {
-    if (possible_request == 1)
+    mkdir(AUDIT_DIR, 0777);
+    unsigned long long *segments;
+    int count = list_lsn_files(AUDIT_DIR, "seg", &segments);
+    char format[sizeof(AUDIT_FORMAT_MAGIC)] = "";
+    FILE *format_file = fopen(AUDIT_DIR "/" AUDIT_FORMAT_FILE, "r");
+    if (format_file)
+    {
+        if (fread(format, 1, sizeof(format) - 1, format_file) != sizeof(format) - 1)
+            format[0] = '\0';
+        fclose(format_file);
+    }
+    unsigned long long durable = shared_data->wal.durable_lsn;
+    unsigned long long next_seq = durable + 1;
+    if (count > 0 && strcmp(format, AUDIT_FORMAT_MAGIC) != 0)
+    {
+        move_audit_aside("was written by an older server");
+        count = 0;
+    }
+    if (count > 0)
     {
-        if (strcmp(account_id, "N") == 0)
+        char path[64];
+        snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, segments[count - 1]);
+        int fd = open(path, O_RDWR);
+        if (fd == -1)
         {
-            char new_id[20];
-            int id_counter = shared_data->next_id;
-            while (1)
-            {
-                snprintf(new_id, sizeof(new_id), "BankID_%02d", id_counter);
-
-                int exists = 0;
-                for (int i = 0; i < shared_data->db_size; i++)
-                {
-                    if (strcmp(shared_data->accounts[i].account_id, new_id) == 0)
-                    {
-                        exists = 1;
-                        break;
-                    }
-                }
-
-                if (!exists)
-                    break; // Found a unique BankID
-
-                id_counter++; // Try next ID
-            }
-
-            strcpy(shared_data->accounts[shared_data->db_size].account_id, new_id);
-            shared_data->accounts[shared_data->db_size].balance = amount;
-            log_transaction(new_id, operation, amount);
-            snprintf(response, 100, "New account %s created with balance %d", new_id, amount);
-            printf("%s\n", response);
-            shared_data->db_size++;
-            shared_data->next_id = id_counter + 1;
-            return 1;
+            perror("Could not open audit segment");
+            exit(1);
         }
-
-        for (int i = 0; i < shared_data->db_size; i++)
+        next_seq = segments[count - 1];
+        Audit_Entry entry;
+        while (pread(fd, &entry, sizeof(entry), (next_seq - segments[count - 1]) * sizeof(entry)) == sizeof(entry) &&
+               entry.seq == next_seq)
+            next_seq++;
+        if (ftruncate(fd, (next_seq - segments[count - 1]) * sizeof(entry)) == -1)
+            perror("Could not cut the audit segment");
+        close(fd);
+        // Empty segment is removed, the new records go to a new segment.
+        if (next_seq == segments[count - 1])
+            unlink(path);
+        if (next_seq - 1 > durable)
         {
-            if (strcmp(shared_data->accounts[i].account_id, account_id) == 0)
-            {
-                if (strcmp(operation, "withdraw") == 0)
-                {
-                    if (shared_data->accounts[i].balance >= amount)
-                    {
-                        shared_data->accounts[i].balance -= amount;
-                        log_transaction(account_id, operation, amount);
-                        if (shared_data->accounts[i].balance == 0)
-                        {
-                            for (int j = i; j < shared_data->db_size - 1; j++)
-                            {
-                                shared_data->accounts[j] = shared_data->accounts[j + 1];
-                            }
-                            shared_data->db_size--;
-                            snprintf(response, 100, "Withdrawal successful. Account %s removed.", account_id);
-                            printf("%s\n", response);
-                        }
-                        else
-                        {
-                            snprintf(response, 100, "%s Withdrawal successful. Remaining balance: %d", account_id, shared_data->accounts[i].balance);
-                            printf("%s\n", response);
-                        }
-                        return 1;
-                    }
-                    else
-                    {
-                        snprintf(response, 100, "%s Insufficient balance.", account_id);
-                        printf("%s\n", response);
-                        return 0;
-                    }
-                }
-                else if (strcmp(operation, "deposit") == 0)
-                {
-                    shared_data->accounts[i].balance += amount;
-                    log_transaction(account_id, operation, amount);
-                    snprintf(response, 100, "%s Deposit successful. New balance: %d", account_id, shared_data->accounts[i].balance);
-                    printf("%s\n", response);
-                    return 1;
-                }
-            }
+            move_audit_aside("goes past the end of the log");
+            next_seq = durable + 1;
         }
-        snprintf(response, 100, "Account not found.");
-        printf("%s\n", response);
-        return 0;
     }
-    snprintf(response, 100, "Invalid request for %s", account_id);
-    printf("%s\n", response);
-    return 0;
+    free(segments);
+    if (strcmp(format, AUDIT_FORMAT_MAGIC) != 0)
+    {
+        format_file = fopen(AUDIT_DIR "/" AUDIT_FORMAT_FILE, "w");
+        if (!format_file || fputs(AUDIT_FORMAT_MAGIC, format_file) == EOF || fclose(format_file) == EOF)
+        {
+            perror("Could not write audit format");
+            exit(1);
+        }
+    }
+    audit_segment_seq = next_seq;
+    audit_next_seq = next_seq;
+    shared_data->wal.audited_lsn = next_seq - 1;
 }
 
-// This is the function that teller forks which handels withdrawig and depositing operations.
-// Reading operations regarding the shared memory are again protected with semaphores!
-void *func(void *arg)
+// Renames the audit directory to audit.<time> and starts an empty one. A new audit starts at the end of the log.
+void move_audit_aside(const char *reason)
 {
-    // Read actual request from the client.
-    Server_Connection_Request *sc_request = (Server_Connection_Request *)arg;
-    Request request;
+    char aside[64];
+    snprintf(aside, sizeof(aside), AUDIT_DIR ".%ld", (long)time(NULL));
+    if (rename(AUDIT_DIR, aside) == -1 || mkdir(AUDIT_DIR, 0777) == -1)
+    {
+        perror("Could not move the audit directory");
+        exit(1);
+    }
+    printf("Audit directory %s, it is moved to %s and a new audit is started.\n", reason, aside);
+}
 
-    int fd = open(sc_request->client_fifo, O_RDONLY);
-    if (fd == -1)
+// Syncs the last audit segment and the audit directory. Audit writer syncs the segments it closes but not the one it
+// writes, this is done before log records that could be needed to write it again are removed.
+void sync_audit_segment()
+{
+    unsigned long long *segments;
+    int count = list_lsn_files(AUDIT_DIR, "seg", &segments);
+    if (count > 0)
     {
-        perror("Teller open read");
-        unlink(sc_request->client_fifo);
-        exit(EXIT_FAILURE);
+        char path[64];
+        snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, segments[count - 1]);
+        int fd = open(path, O_RDONLY);
+        if (fd != -1)
+        {
+            fdatasync(fd);
+            close(fd);
+        }
     }
-    if (read(fd, &request, sizeof(Request)) <= 0)
+    free(segments);
+    int dir_fd = open(AUDIT_DIR, O_RDONLY);
+    if (dir_fd != -1)
     {
-        perror("Teller read request");
-        unlink(sc_request->client_fifo);
-        close(fd);
-        exit(EXIT_FAILURE);
+        fsync(dir_fd);
+        close(dir_fd);
     }
-    close(fd);
+}
 
-    request.possible_request = 0;
+// Index of a segment is built by a child of the audit writer so that writing the records does not stop meanwhile.
+// Audit writer reaps it when it is idle.
+void start_audit_index(unsigned long long first_seq)
+{
+    fflush(stdout);
+    pid_t pid = timed_fork();
+    if (pid == 0)
+    {
+        build_audit_index(first_seq);
+        exit(0);
+    }
+    if (pid == -1)
+        build_audit_index(first_seq);
+}
 
-    // Critical section starts, while reading data integrity should be ensured.
-    sem_wait(db_semaphore);
+static int compare_audit_entries(const void *a, const void *b)
+{
+    const Audit_Entry *x = *(const Audit_Entry *const *)a, *y = *(const Audit_Entry *const *)b;
+    int by_id = strcmp(x->account_id, y->account_id);
+    if (by_id != 0)
+        return by_id;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
 
-    // Make integrity checks regarding if the request can be implemented or not and set variable possible_request accordingly.
-    if (strcmp(request.account_id, "N") == 0 && strcmp(request.operation, "deposit") == 0)
+// Writes the index of a closed segment: the time range of every block of records, and for every account its
+// totals and the numbers of its records. It is written to a temporary file and renamed so that banklog never
+// reads half of an index.
+void build_audit_index(unsigned long long first_seq)
+{
+    char path[64], temp_path[64];
+    snprintf(path, sizeof(path), AUDIT_SEGMENT_TEMPLATE, first_seq);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
     {
-        request.possible_request = 1;
+        perror("Could not open audit segment");
+        return;
     }
-    else
+    struct stat st;
+    fstat(fd, &st);
+    unsigned int count = st.st_size / sizeof(Audit_Entry);
+    if (count == 0)
     {
-        for (int i = 0; i < shared_data->db_size; i++)
-        {
-            if (strcmp(shared_data->accounts[i].account_id, request.account_id) == 0)
-            {
-                if ((strcmp(request.operation, "withdraw") == 0 && shared_data->accounts[i].balance >= request.amount) ||
-                    strcmp(request.operation, "deposit") == 0)
-                {
-                    request.possible_request = 1;
-                }
-                break;
-            }
-        }
+        close(fd);
+        return;
     }
-
-    sem_post(db_semaphore);
-    // Critical section for reading ends.
-
-    // Send the possible request to server for database update.
-    int pipe_fd = open(REQUEST_PIPE, O_WRONLY);
-    if (pipe_fd == -1)
+    Audit_Entry *entries = mmap(NULL, count * sizeof(Audit_Entry), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (entries == MAP_FAILED)
     {
-        perror("Teller pipe open failed");
-        exit(EXIT_FAILURE);
+        perror("Could not map audit segment");
+        return;
     }
-    write(pipe_fd, &request, sizeof(Request));
-    close(pipe_fd);
 
-    // Send the response regarding the result of the operation to the client back.
-    Response response;
-    if (request.possible_request == 0)
+    Audit_Index_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AUDIT_INDEX_MAGIC, sizeof(header.magic));
+    header.first_seq = first_seq;
+    header.record_count = count;
+    header.block_count = (count + AUDIT_TIME_BLOCK - 1) / AUDIT_TIME_BLOCK;
+    header.min_time_us = entries[0].time_us;
+    header.max_time_us = entries[0].time_us;
+    Audit_Time_Block *blocks = calloc(header.block_count, sizeof(Audit_Time_Block));
+    const Audit_Entry **order = malloc(count * sizeof(Audit_Entry *));
+    for (unsigned int i = 0; i < count; i++)
     {
-        if (strcmp(request.operation, "withdraw") == 0)
-            strcpy(response.message, "Insufficient balance or invalid account.");
-        else if (strcmp(request.operation, "deposit") == 0)
-            strcpy(response.message, "Invalid account.");
+        Audit_Time_Block *block = &blocks[i / AUDIT_TIME_BLOCK];
+        if (i % AUDIT_TIME_BLOCK == 0 || entries[i].time_us < block->min_time_us)
+            block->min_time_us = entries[i].time_us;
+        if (i % AUDIT_TIME_BLOCK == 0 || entries[i].time_us > block->max_time_us)
+            block->max_time_us = entries[i].time_us;
+        if (entries[i].time_us < header.min_time_us)
+            header.min_time_us = entries[i].time_us;
+        if (entries[i].time_us > header.max_time_us)
+            header.max_time_us = entries[i].time_us;
+        if (entries[i].type == 'D')
+        {
+            header.deposit_count++;
+            header.deposit_sum += entries[i].amount;
+        }
         else
-            strcpy(response.message, "Invalid operation.");
+        {
+            header.withdraw_count++;
+            header.withdraw_sum += entries[i].amount;
+        }
+        order[i] = &entries[i];
     }
-    else
+
+    // Records of an account come together after sorting, in the order they were written.
+    qsort(order, count, sizeof(Audit_Entry *), compare_audit_entries);
+    Audit_Account_Entry *accounts = malloc(count * sizeof(Audit_Account_Entry));
+    unsigned int *postings = malloc(count * sizeof(unsigned int));
+    for (unsigned int i = 0; i < count; i++)
     {
-        strcpy(response.message, "Request accepted and being processed.");
+        const Audit_Entry *entry = order[i];
+        if (i == 0 || strcmp(entry->account_id, order[i - 1]->account_id) != 0)
+        {
+            Audit_Account_Entry *first = &accounts[header.account_count++];
+            memset(first, 0, sizeof(*first));
+            memcpy(first->account_id, entry->account_id, sizeof(first->account_id));
+            first->first_posting = i;
+        }
+        Audit_Account_Entry *account = &accounts[header.account_count - 1];
+        account->posting_count++;
+        if (entry->type == 'D')
+        {
+            account->deposit_count++;
+            account->deposit_sum += entry->amount;
+        }
+        else
+        {
+            account->withdraw_count++;
+            account->withdraw_sum += entry->amount;
+        }
+        postings[i] = entry - entries;
     }
 
-    int client_fd = open(sc_request->client_fifo, O_WRONLY);
-    if (client_fd != -1)
+    snprintf(temp_path, sizeof(temp_path), AUDIT_INDEX_TEMP_TEMPLATE, first_seq);
+    snprintf(path, sizeof(path), AUDIT_INDEX_TEMPLATE, first_seq);
+    FILE *index = fopen(temp_path, "w");
+    if (!index)
+        perror("Could not create audit index");
+    else
     {
-        write(client_fd, &response, sizeof(Response));
-        close(client_fd);
+        fwrite(&header, sizeof(header), 1, index);
+        fwrite(blocks, sizeof(Audit_Time_Block), header.block_count, index);
+        fwrite(accounts, sizeof(Audit_Account_Entry), header.account_count, index);
+        fwrite(postings, sizeof(unsigned int), count, index);
+        if (fclose(index) != 0 || rename(temp_path, path) != 0)
+            perror("Could not write audit index");
     }
-
-    exit(EXIT_SUCCESS);
-    return NULL;
+    free(blocks);
+    free(order);
+    free(accounts);
+    free(postings);
+    munmap(entries, count * sizeof(Audit_Entry));
 }
 
-// This function is requried in the homework document, this forks a child teller that will execute the code specified in its argument.
+// Moves the full log file to AdaBank.bankLog.1 (older ones one number up, the oldest is dropped) and starts a new one.
+FILE *rotate_log_file(FILE *log)
+{
+    fclose(log);
+    char older[64], newer[64];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--)
+    {
+        snprintf(older, sizeof(older), LOG_ROTATED_TEMPLATE, i + 1);
+        snprintf(newer, sizeof(newer), LOG_ROTATED_TEMPLATE, i);
+        rename(newer, older);
+    }
+    rename(LOG_FILE, newer);
+    log = fopen(LOG_FILE, "a");
+    if (!log)
+    {
+        perror("Could not open log file");
+        exit(1);
+    }
+    setvbuf(log, NULL, _IOFBF, AUDIT_BUFFER_SIZE);
+    time_t now = time(NULL);
+    char time_str[64];
+    strftime(time_str, sizeof(time_str), "%H:%M %B %d %Y", localtime(&now));
+    fprintf(log, "# Adabank Log file continued @%s\n", time_str);
+    return log;
+}
+
+// Tells the audit writer to write the records that are left and waits for it. Handlers should be stopped and the
+// log written already.
+void stop_audit_writer()
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    lock_wal(wal);
+    wal->audit_closing = 1;
+    pthread_cond_broadcast(&wal->flushed);
+    pthread_mutex_unlock(&wal->lock);
+    waitpid(audit_writer_pid, NULL, 0);
+}
+
+// It prints the end statmenet for the log file and closes it.
+void finalize_log_file()
+{
+    FILE *log = fopen(LOG_FILE, "a");
+    if (log)
+    {
+        fprintf(log, "## end of log.\n");
+        fclose(log);
+    }
+}
+
+// Returns the size of the store file that has place for the given number of accounts.
+size_t store_file_size(int capacity)
+{
+    return STORE_HEADER_SIZE + (size_t)capacity * sizeof(Account) + (size_t)capacity * 2 * sizeof(int);
+}
+
+// Maps the whole store file and sets the pointers to the accounts and the index in it.
+void map_store()
+{
+    struct stat st;
+    if (fstat(store_fd, &st) == -1)
+    {
+        perror("Could not stat store file");
+        exit(1);
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("Could not map store file");
+        exit(1);
+    }
+    store = (Store_Header *)addr;
+    store_mapped_size = st.st_size;
+    store_mapped_generation = store->generation;
+    // A teller reading balances maps the store without locks, so the file may be growing meanwhile. Capacity that
+    // does not match the size of the mapping means the header was changed after fstat, the file is mapped again.
+    if ((size_t)st.st_size >= STORE_HEADER_SIZE && store->capacity > 0 && store_file_size(store->capacity) != (size_t)st.st_size)
+    {
+        munmap(addr, st.st_size);
+        map_store();
+        return;
+    }
+    store_mapped_capacity = store->capacity;
+    accounts = (Account *)((char *)addr + STORE_HEADER_SIZE);
+    account_index = (int *)(accounts + store->capacity);
+}
+
+// Maps the store again if another process has grown it since this process mapped it.
+// Caller should hold the database semaphore so that the store does not grow meanwhile.
+void remap_store()
+{
+    if (store->generation == store_mapped_generation)
+        return;
+    munmap(store, store_mapped_size);
+    map_store();
+}
+
+// Opens the store file. If it is valid it is used as it is and pages are read as they are accessed,
+// otherwise a new store is created and filled from the database file.
+void open_store()
+{
+    store_fd = open(STORE_FILE, O_RDWR | O_CREAT, 0666);
+    if (store_fd == -1)
+    {
+        perror("Could not open store file");
+        exit(1);
+    }
+    struct stat st;
+    fstat(store_fd, &st);
+    if (!import_database && (size_t)st.st_size >= STORE_HEADER_SIZE)
+    {
+        map_store();
+        // A store of version 2 only lacks the lsn, which is set when the server stops.
+        if (memcmp(store->magic, STORE_MAGIC, sizeof(store->magic)) == 0 &&
+            (store->version == STORE_VERSION || store->version == 2) && store_mapped_size == store_file_size(store->capacity))
+        {
+            store->version = STORE_VERSION;
+            if (store->clean)
+            {
+                printf("Using %d accounts in %s.\n", store->db_size, STORE_FILE);
+                store->clean = 0;
+                last_checkpoint_lsn = shared_data->wal.next_lsn - 1;
+                return;
+            }
+            printf("%s was not closed cleanly, recovering it.\n", STORE_FILE);
+        }
+        else
+        {
+            printf("%s is not valid, creating it again.\n", STORE_FILE);
+        }
+        munmap(store, store_mapped_size);
+    }
+
+    create_empty_store();
+    unsigned long long checkpoint_lsn;
+    if (!import_database && load_checkpoint(&checkpoint_lsn) == 0)
+    {
+        load_delta_checkpoints(&checkpoint_lsn);
+        recover_from_wal(checkpoint_lsn);
+    }
+    else
+    {
+        // Load the existing database, the binary one when there is one.
+        if (load_database_binary() == -1)
+            load_database_from_file();
+    }
+    // A new checkpoint is written right away so that the next recovery starts from here.
+    write_checkpoint();
+    clear_dirty();
+}
+
+// Creates an empty store with the initial capacity.
+void create_empty_store()
+{
+    // Truncating to zero first makes sure no old data is left in the file.
+    if (ftruncate(store_fd, 0) == -1 || ftruncate(store_fd, store_file_size(INITIAL_CAPACITY)) == -1)
+    {
+        perror("Could not resize store file");
+        exit(1);
+    }
+    Store_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.version = STORE_VERSION;
+    header.capacity = INITIAL_CAPACITY;
+    header.index_size = INITIAL_CAPACITY * 2;
+    header.next_id = 1;
+    pwrite(store_fd, &header, sizeof(header), 0);
+    map_store();
+    rebuild_index();
+}
+
+// Initializes the checkpoint lock. It is robust since a checkpoint writer may be killed while holding it.
+void init_checkpoint_lock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared_data->checkpoint_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Takes the checkpoint lock, a lock left by a dead process is taken over.
+void lock_checkpoint()
+{
+    if (pthread_mutex_lock(&shared_data->checkpoint_lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shared_data->checkpoint_lock);
+}
+
+// Writes a checkpoint header and its accounts under a temporary name and renames it, so a crash while writing
+// leaves the old file. Returns -1 on failure.
+int write_checkpoint_file(const char *temp_path, const char *path, Checkpoint_Header *header, const Account *entries)
+{
+    size_t bytes = (size_t)header->count * sizeof(Account);
+    header->checksum = crc32(entries, bytes);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+    {
+        perror("Could not create checkpoint");
+        return -1;
+    }
+    // Accounts are contiguous, so they are written in one piece.
+    if (write(fd, header, sizeof(Checkpoint_Header)) != sizeof(Checkpoint_Header) ||
+        write(fd, entries, bytes) != (ssize_t)bytes || fsync(fd) == -1)
+    {
+        perror("Could not write checkpoint");
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    close(fd);
+    rename(temp_path, path);
+    const char *slash = strrchr(path, '/');
+    char directory[64] = ".";
+    if (slash)
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+    int dir_fd = open(directory, O_RDONLY);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// Removes the incremental checkpoints up to and including the given LSN, they are in a full checkpoint now.
+void remove_delta_checkpoints(unsigned long long lsn)
+{
+    unsigned long long *deltas;
+    int count = list_lsn_files(CHECKPOINT_DIR, "delta", &deltas);
+    for (int i = 0; i < count && deltas[i] <= lsn; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), DELTA_TEMPLATE, deltas[i]);
+        unlink(path);
+    }
+    free(deltas);
+}
+
+// Writes all the accounts to the checkpoint file together with the LSN of the last log record.
+// Log segments and incremental checkpoints before it are not needed anymore and removed.
+// Caller makes sure that the store does not change meanwhile.
+void write_checkpoint()
+{
+    Checkpoint_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.lsn = shared_data->wal.next_lsn - 1;
+    header.count = store->db_size;
+    header.next_id = store->next_id;
+
+    // A background checkpoint writer may still be working, it is waited for.
+    lock_checkpoint();
+    if (write_checkpoint_file(CHECKPOINT_TEMP_FILE, CHECKPOINT_FILE, &header, accounts) == 0)
+    {
+        remove_delta_checkpoints(header.lsn);
+        wal_remove_segments(header.lsn);
+        last_checkpoint_lsn = header.lsn;
+        delta_chain = 0;
+        printf("Checkpoint of %d accounts written at LSN %llu.\n", header.count, header.lsn);
+    }
+    pthread_mutex_unlock(&shared_data->checkpoint_lock);
+}
+
+// Loads the checkpoint file into the empty store. Returns -1 if there is no valid checkpoint.
+int load_checkpoint(unsigned long long *lsn)
+{
+    int fd = open(CHECKPOINT_FILE, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    Checkpoint_Header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    while (store->capacity < header.count)
+    {
+        if (grow_store() == -1)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    size_t bytes = (size_t)header.count * sizeof(Account);
+    if (read(fd, accounts, bytes) != (ssize_t)bytes || crc32(accounts, bytes) != header.checksum)
+    {
+        fprintf(stderr, "%s is damaged.\n", CHECKPOINT_FILE);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    store->db_size = header.count;
+    store->next_id = header.next_id;
+    rebuild_index();
+    *lsn = header.lsn;
+    printf("Loaded %d accounts from checkpoint at LSN %llu.\n", header.count, header.lsn);
+    return 0;
+}
+
+// Applies the incremental checkpoints that follow the loaded checkpoint in order. Stops at the first one that is
+// missing, damaged or does not follow the previous one, the log is replayed from there. lsn is moved to the last applied one.
+int load_delta_checkpoints(unsigned long long *lsn)
+{
+    unsigned long long *deltas;
+    int count = list_lsn_files(CHECKPOINT_DIR, "delta", &deltas);
+    int applied = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (deltas[i] <= *lsn)
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), DELTA_TEMPLATE, deltas[i]);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            break;
+        Checkpoint_Header header;
+        Account *entries = NULL;
+        int valid = read(fd, &header, sizeof(header)) == sizeof(header) && memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) == 0 &&
+                    header.prev_lsn == *lsn && header.count >= 0;
+        if (valid)
+        {
+            size_t bytes = (size_t)header.count * sizeof(Account);
+            entries = malloc(bytes + 1);
+            valid = read(fd, entries, bytes) == (ssize_t)bytes && crc32(entries, bytes) == header.checksum;
+        }
+        close(fd);
+        if (!valid)
+        {
+            fprintf(stderr, "%s is damaged or out of order, log is replayed from LSN %llu.\n", path, *lsn);
+            free(entries);
+            break;
+        }
+        for (int j = 0; j < header.count; j++)
+        {
+            int position = find_account(entries[j].account_id);
+            if (entries[j].balance == 0)
+            {
+                if (position != -1)
+                    remove_account(position);
+            }
+            else if (position != -1)
+                accounts[position].balance = entries[j].balance;
+            else
+                add_account(entries[j].account_id, entries[j].balance);
+        }
+        free(entries);
+        if (header.next_id > store->next_id)
+            store->next_id = header.next_id;
+        *lsn = header.lsn;
+        applied++;
+    }
+    free(deltas);
+    if (applied > 0)
+        printf("Applied %d incremental checkpoints up to LSN %llu.\n", applied, *lsn);
+    return applied;
+}
+
+// Creates the shared mapping that keeps the changes since the last checkpoint.
+void init_dirty_map()
+{
+    dirty_map = mmap(NULL, sizeof(Dirty_Map), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (dirty_map == MAP_FAILED)
+    {
+        perror("Could not map the dirty map");
+        exit(1);
+    }
+}
+
+// Records that the account at the given place has changed since the last checkpoint.
+void mark_dirty(int position)
+{
+    __atomic_fetch_or(&dirty_map->bits[position / 64], 1ULL << (position % 64), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dirty_map->changes, 1, __ATOMIC_RELAXED);
+}
+
+// Records that the account is removed since the last checkpoint. Caller holds all the locks.
+void mark_removed(const char *account_id)
+{
+    dirty_map->changes++;
+    if (dirty_map->removed_count == DIRTY_REMOVED_MAX)
+    {
+        dirty_map->overflow = 1;
+        return;
+    }
+    Account *removed = &dirty_map->removed[dirty_map->removed_count++];
+    memset(removed, 0, sizeof(Account));
+    strcpy(removed->account_id, account_id);
+}
+
+// Forgets all the changes, called after they are written to a checkpoint. Caller holds all the locks.
+void clear_dirty()
+{
+    for (int i = 0; i < (store->capacity + 63) / 64; i++)
+    {
+        if (dirty_map->bits[i])
+            dirty_map->bits[i] = 0;
+    }
+    dirty_map->changes = 0;
+    dirty_map->removed_count = 0;
+    dirty_map->overflow = 0;
+}
+
+static int compare_merge_entries(const void *a, const void *b)
+{
+    const Account *x = *(Account *const *)a, *y = *(Account *const *)b;
+    int by_id = strcmp(x->account_id, y->account_id);
+    if (by_id != 0)
+        return by_id;
+    // Entries of later checkpoints are later in memory, so the address gives their order.
+    return (x > y) - (x < y);
+}
+
+// Merges the full checkpoint and the incremental checkpoints up to the given LSN into a new full checkpoint.
+// This runs in the checkpoint writer process and reads only the checkpoint files, so the live store is not touched.
+int compact_checkpoints(unsigned long long lsn, int next_id)
+{
+    int fd = open(CHECKPOINT_FILE, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    Checkpoint_Header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        close(fd);
+        return -1;
+    }
+    // All entries are read into one array in checkpoint order: full checkpoint first, then the deltas.
+    size_t total = header.count, size = header.count + 1024;
+    Account *entries = malloc(size * sizeof(Account));
+    if (read(fd, entries, (size_t)header.count * sizeof(Account)) != (ssize_t)((size_t)header.count * sizeof(Account)))
+    {
+        close(fd);
+        free(entries);
+        return -1;
+    }
+    close(fd);
+    unsigned long long *deltas;
+    int count = list_lsn_files(CHECKPOINT_DIR, "delta", &deltas);
+    for (int i = 0; i < count; i++)
+    {
+        if (deltas[i] <= header.lsn || deltas[i] > lsn)
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), DELTA_TEMPLATE, deltas[i]);
+        Checkpoint_Header delta;
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || read(fd, &delta, sizeof(delta)) != sizeof(delta))
+        {
+            if (fd != -1)
+                close(fd);
+            free(entries);
+            free(deltas);
+            return -1;
+        }
+        if (total + delta.count > size)
+        {
+            size = (total + delta.count) * 2;
+            entries = realloc(entries, size * sizeof(Account));
+        }
+        if (read(fd, entries + total, (size_t)delta.count * sizeof(Account)) != (ssize_t)((size_t)delta.count * sizeof(Account)))
+        {
+            close(fd);
+            free(entries);
+            free(deltas);
+            return -1;
+        }
+        close(fd);
+        total += delta.count;
+    }
+    free(deltas);
+
+    // Sort by id keeping the checkpoint order, the last entry of every id is its value. Removed accounts are dropped.
+    Account **sorted = malloc((total + 1) * sizeof(Account *));
+    for (size_t i = 0; i < total; i++)
+        sorted[i] = &entries[i];
+    qsort(sorted, total, sizeof(Account *), compare_merge_entries);
+    Account *merged = malloc((total + 1) * sizeof(Account));
+    int merged_count = 0;
+    for (size_t i = 0; i < total; i++)
+    {
+        if (i + 1 < total && strcmp(sorted[i + 1]->account_id, sorted[i]->account_id) == 0)
+            continue;
+        if (sorted[i]->balance != 0)
+            merged[merged_count++] = *sorted[i];
+    }
+    free(sorted);
+    free(entries);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.lsn = lsn;
+    header.count = merged_count;
+    header.next_id = next_id;
+    int result = write_checkpoint_file(CHECKPOINT_TEMP_FILE, CHECKPOINT_FILE, &header, merged);
+    free(merged);
+    if (result == 0)
+        remove_delta_checkpoints(lsn);
+    return result;
+}
+
+// Starts an incremental checkpoint. The changed accounts are copied while holding all the locks, which is short
+// since only they are copied, then a child process writes them. The child has its own copy-on-write view of the
+// copied accounts, so the handlers continue serving requests while the file is written and synced.
+// When too many accounts were removed to remember them all, every account is copied and a full checkpoint is written.
+void start_background_checkpoint()
+{
+    lock_all_stripes();
+    remap_store();
+    checkpoint_pending_full = dirty_map->overflow;
+    checkpoint_entry_count = 0;
+    if (checkpoint_pending_full)
+    {
+        checkpoint_entries = malloc((size_t)(store->db_size + 1) * sizeof(Account));
+        memcpy(checkpoint_entries, accounts, (size_t)store->db_size * sizeof(Account));
+        checkpoint_entry_count = store->db_size;
+    }
+    else
+    {
+        size_t size = dirty_map->removed_count + 1024;
+        checkpoint_entries = malloc(size * sizeof(Account));
+        // Removed accounts come first so that an id that is removed and then used again ends with its new value.
+        for (int i = 0; i < dirty_map->removed_count; i++)
+            checkpoint_entries[checkpoint_entry_count++] = dirty_map->removed[i];
+        for (int i = 0; i < (store->db_size + 63) / 64; i++)
+        {
+            unsigned long long word = dirty_map->bits[i];
+            while (word)
+            {
+                int position = i * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                if (position >= store->db_size)
+                    break;
+                if ((size_t)checkpoint_entry_count == size)
+                {
+                    size *= 2;
+                    checkpoint_entries = realloc(checkpoint_entries, size * sizeof(Account));
+                }
+                checkpoint_entries[checkpoint_entry_count++] = accounts[position];
+            }
+        }
+    }
+    clear_dirty();
+    checkpoint_pending_lsn = shared_data->wal.next_lsn - 1;
+    int next_id = store->next_id;
+    unlock_all_stripes();
+
+    checkpoint_pending_compact = !checkpoint_pending_full && delta_chain + 1 >= MAX_DELTA_CHAIN;
+    Checkpoint_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_pending_full ? CHECKPOINT_MAGIC : DELTA_MAGIC, sizeof(header.magic));
+    header.lsn = checkpoint_pending_lsn;
+    header.prev_lsn = last_checkpoint_lsn;
+    header.count = checkpoint_entry_count;
+    header.next_id = next_id;
+
+    fflush(stdout);
+    checkpoint_writer_pid = timed_fork();
+    if (checkpoint_writer_pid == 0)
+    {
+        lock_checkpoint();
+        // Checkpoint should not be ahead of the log on disk, otherwise a crash could make the log reuse its LSNs.
+        wal_wait_durable(header.lsn);
+        int result;
+        if (checkpoint_pending_full)
+        {
+            result = write_checkpoint_file(CHECKPOINT_TEMP_FILE, CHECKPOINT_FILE, &header, checkpoint_entries);
+            if (result == 0)
+                remove_delta_checkpoints(header.lsn);
+        }
+        else
+        {
+            char path[64];
+            snprintf(path, sizeof(path), DELTA_TEMPLATE, header.lsn);
+            result = write_checkpoint_file(DELTA_TEMP_FILE, path, &header, checkpoint_entries);
+            if (result == 0 && checkpoint_pending_compact)
+                result = compact_checkpoints(header.lsn, next_id);
+        }
+        if (result == 0)
+            wal_remove_segments(header.lsn);
+        pthread_mutex_unlock(&shared_data->checkpoint_lock);
+        _exit(result == 0 ? 0 : 1);
+    }
+    if (checkpoint_writer_pid == -1)
+    {
+        perror("Checkpoint fork failed");
+        checkpoint_writer_pid = 0;
+        reap_checkpoint_writer();
+    }
+    last_checkpoint_time = time(NULL);
+}
+
+// Collects the checkpoint writer if it has finished. If it failed, the accounts it had are marked dirty again
+// so that they are written by the next checkpoint.
+void reap_checkpoint_writer()
+{
+    int status = 1;
+    if (checkpoint_writer_pid > 0)
+    {
+        if (waitpid(checkpoint_writer_pid, &status, WNOHANG) == 0)
+            return;
+    }
+    else if (checkpoint_writer_pid == -1)
+        return;
+    checkpoint_writer_pid = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        last_checkpoint_lsn = checkpoint_pending_lsn;
+        delta_chain = (checkpoint_pending_full || checkpoint_pending_compact) ? 0 : delta_chain + 1;
+    }
+    else
+    {
+        fprintf(stderr, "Checkpoint at LSN %llu failed.\n", checkpoint_pending_lsn);
+        lock_all_stripes();
+        remap_store();
+        if (checkpoint_pending_full)
+            dirty_map->overflow = 1;
+        for (int i = 0; i < checkpoint_entry_count && !checkpoint_pending_full; i++)
+        {
+            int position = find_account(checkpoint_entries[i].account_id);
+            if (position != -1)
+                mark_dirty(position);
+            else
+                mark_removed(checkpoint_entries[i].account_id);
+        }
+        unlock_all_stripes();
+    }
+    free(checkpoint_entries);
+    checkpoint_entries = NULL;
+}
+
+// Returns the shard of the account.
+int shard_of(const char *account_id)
+{
+    return hash_account_id(account_id) % shard_count;
+}
+
+// Initializes the stripe locks, they are process shared since they live in shared memory. They are robust like the
+// log lock, a handler may be killed while it holds one (see lock_stripe).
+void init_stripe_locks()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_init(&shared_data->stripe_locks[i], &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Returns the lock stripe of the account. Higher bits of the hash are used since the shard is chosen by the lower ones.
+int stripe_of(const char *account_id)
+{
+    return (hash_account_id(account_id) >> 16) & (LOCK_STRIPES - 1);
+}
+
+// Takes the lock of a stripe. A lock left by a dead process is taken over, see recover_stripe.
+void lock_stripe(int stripe)
+{
+    // Waiting is only timed when the lock is not free, so the common case does not read the clock.
+    int result = pthread_mutex_trylock(&shared_data->stripe_locks[stripe]);
+    if (result == EBUSY)
+    {
+        long long start = now_us();
+        result = pthread_mutex_lock(&shared_data->stripe_locks[stripe]);
+        long long waited = now_us() - start;
+        metric_add(&metrics->lock_waits, 1);
+        metric_add(&metrics->lock_wait_us, waited);
+        metric_record(&metrics->lock_wait_latency, waited);
+    }
+    if (result == EOWNERDEAD)
+        recover_stripe(stripe);
+    // Readers see an odd sequence before any change of the stripe.
+    __atomic_add_fetch(&shared_data->stripe_seqs[stripe], 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Makes the lock of a stripe usable again after its owner died holding it. The owner may have died between the two
+// increments of the sequence, it is made even again first, otherwise readers would wait for it for ever.
+void recover_stripe(int stripe)
+{
+    unsigned int *seq_word = &shared_data->stripe_seqs[stripe];
+    if (__atomic_load_n(seq_word, __ATOMIC_RELAXED) & 1)
+        __atomic_add_fetch(seq_word, 1, __ATOMIC_RELEASE);
+    pthread_mutex_consistent(&shared_data->stripe_locks[stripe]);
+}
+
+void unlock_stripe(int stripe)
+{
+    __atomic_add_fetch(&shared_data->stripe_seqs[stripe], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shared_data->stripe_locks[stripe]);
+}
+
+// Reads the balance of an account without taking a lock, for the balance queries of the tellers. Balance is read
+// between two reads of the stripe's sequence and read again if a handler changed the stripe meanwhile. Store may be
+// changed while it is read, so places that are outside of this process's mapping are not followed.
+// Returns 1 and sets balance if the account exists, 0 if it does not.
+int read_balance(const char *account_id, int *balance)
+{
+    unsigned int *seq_word = &shared_data->stripe_seqs[stripe_of(account_id)];
+    while (1)
+    {
+        unsigned int seq = __atomic_load_n(seq_word, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        if (__atomic_load_n(&store->generation, __ATOMIC_RELAXED) != store_mapped_generation)
+            remap_store();
+
+        int value = 0;
+        int found = probe_balance(account_id, &value);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq_word, __ATOMIC_RELAXED) == seq)
+        {
+            *balance = value;
+            return found;
+        }
+    }
+}
+
+// Reads the balances of several accounts as they were at one moment, for the bulk balance queries. Sequences of all
+// their stripes are read before and after the accounts and everything is read again if any of them changed, so a
+// transfer between two of the accounts is seen in both of them or in none. Sets balances and found for every account
+// and returns the number of accounts that exist.
+int read_balances(const Transfer_Leg *legs, int count, int *balances, int *found)
+{
+    unsigned int *seq_words[MAX_TRANSFER_LEGS];
+    unsigned int seqs[MAX_TRANSFER_LEGS];
+    for (int i = 0; i < count; i++)
+        seq_words[i] = &shared_data->stripe_seqs[stripe_of(legs[i].account_id)];
+    while (1)
+    {
+        int held = 0;
+        for (int i = 0; i < count; i++)
+        {
+            seqs[i] = __atomic_load_n(seq_words[i], __ATOMIC_ACQUIRE);
+            held |= seqs[i] & 1;
+        }
+        if (held)
+        {
+            sched_yield();
+            continue;
+        }
+        if (__atomic_load_n(&store->generation, __ATOMIC_RELAXED) != store_mapped_generation)
+            remap_store();
+
+        int existing = 0;
+        for (int i = 0; i < count; i++)
+        {
+            balances[i] = 0;
+            found[i] = probe_balance(legs[i].account_id, &balances[i]);
+            existing += found[i];
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        int changed = 0;
+        for (int i = 0; i < count; i++)
+            changed |= __atomic_load_n(seq_words[i], __ATOMIC_RELAXED) != seqs[i];
+        if (!changed)
+            return existing;
+    }
+}
+
+// Looks the account up in the index for the lock-free readers above. Values are only good if the sequence of the
+// account's stripe did not change while they were read. Returns 1 and sets balance if the account was found.
+int probe_balance(const char *account_id, int *balance)
+{
+    unsigned int index_size = store_mapped_capacity * 2;
+    unsigned int pos = hash_account_id(account_id) & (index_size - 1);
+    for (unsigned int probes = 0; probes < index_size; probes++)
+    {
+        int entry = __atomic_load_n(&account_index[pos], __ATOMIC_RELAXED);
+        if (entry == INDEX_EMPTY)
+            return 0;
+        if (entry >= 0 && entry < store_mapped_capacity &&
+            strncmp(accounts[entry].account_id, account_id, sizeof(accounts[entry].account_id)) == 0)
+        {
+            *balance = __atomic_load_n(&accounts[entry].balance, __ATOMIC_RELAXED);
+            return 1;
+        }
+        pos = (pos + 1) & (index_size - 1);
+    }
+    return 0;
+}
+
+// Takes the database semaphore and then all the stripe locks in order, so nothing else is using the store.
+void lock_all_stripes()
+{
+    if (sem_trywait(db_semaphore) == -1)
+    {
+        long long start = now_us();
+        while (sem_wait(db_semaphore) == -1 && errno == EINTR)
+            ;
+        long long waited = now_us() - start;
+        metric_add(&metrics->lock_waits, 1);
+        metric_add(&metrics->lock_wait_us, waited);
+        metric_record(&metrics->lock_wait_latency, waited);
+    }
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        lock_stripe(i);
+}
+
+void unlock_all_stripes()
+{
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--)
+        unlock_stripe(i);
+    sem_post(db_semaphore);
+}
+
+// Tells if applying the request creates or removes an account. Caller holds the lock of the account's stripe.
+int needs_structure_lock(const Request *req)
+{
+    if (strcmp(req->operation, "withdraw") != 0)
+        return 0;
+    int i = find_account(req->account_id);
+    return i != -1 && accounts[i].balance == req->amount;
+}
+
+static int compare_stripes(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Applies a transfer with the locks of all its accounts. Stripes are always locked in increasing order (as
+// lock_all_stripes does), so two transfers, or a transfer and a request that takes all the locks, can not wait
+// for each other. A transfer that empties an account removes it, then all the locks are taken instead.
+int apply_transfer(const Request *req, char *response, unsigned long long *lsn)
+{
+    int stripes[MAX_TRANSFER_LEGS], count = 0;
+    int legs = req->leg_count < 0 ? 0 : (req->leg_count > MAX_TRANSFER_LEGS ? MAX_TRANSFER_LEGS : req->leg_count);
+    for (int i = 0; i < legs; i++)
+        stripes[i] = stripe_of(req->legs[i].account_id);
+    qsort(stripes, legs, sizeof(int), compare_stripes);
+    for (int i = 0; i < legs; i++)
+        if (count == 0 || stripes[i] != stripes[count - 1])
+            stripes[count++] = stripes[i];
+
+    for (int i = 0; i < count; i++)
+        lock_stripe(stripes[i]);
+    remap_store();
+    int structural = transfer_removes_account(req);
+    int result = 0;
+    if (!structural)
+        result = update_transfer(req, response, lsn);
+    for (int i = count - 1; i >= 0; i--)
+        unlock_stripe(stripes[i]);
+    if (structural)
+    {
+        lock_all_stripes();
+        remap_store();
+        result = update_transfer(req, response, lsn);
+        unlock_all_stripes();
+    }
+    return result;
+}
+
+// Tells if a leg of the transfer takes all the balance of its account. Caller holds the locks of the legs.
+int transfer_removes_account(const Request *req)
+{
+    for (int i = 0; i < req->leg_count && i < MAX_TRANSFER_LEGS; i++)
+    {
+        int position = find_account(req->legs[i].account_id);
+        if (req->legs[i].amount < 0 && position != -1 && accounts[position].balance == -req->legs[i].amount)
+            return 1;
+    }
+    return 0;
+}
+
+// Main loop of the handler of a shard. Takes the requests of the tellers from the ring of the shard in batches and
+// updates the database. Handler of the first shard also writes the accounts changed since the last checkpoint in
+// the background every checkpoint interval.
+void handler_loop(int shard)
+{
+    Request_Ring *ring = &shared_data->shards[shard].ring;
+    Teller_Request batch[REQUEST_BATCH];
+    last_checkpoint_time = time(NULL);
+    while (1)
+    {
+        int count = ring_pop_batch(ring, batch, REQUEST_BATCH);
+        if (count > 0)
+        {
+            metric_add(&metrics->handler_batches, 1);
+            metric_add(&metrics->handler_batch_requests, count);
+            __atomic_store_n(&metrics->queue_depth[shard], __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - ring->head, __ATOMIC_RELAXED);
+        }
+        if (count == 0)
+        {
+            // Handler wakes up at least once a second to check the checkpoint time even when there are no requests.
+            ring_wait(ring, shard == 0 && checkpoint_interval > 0 ? 1000 : -1);
+        }
+        else
+        {
+            // Protect the database operation using a lock. (Detailed discussion is in the report)
+            // A balance change only locks the stripe of its account, requests that create or remove an account take all the locks.
+            for (int i = 0; i < count; i++)
+            {
+                Request *req = &batch[i].request;
+                Teller_Result *slot = &shared_data->teller_slots[batch[i].teller_id].results[batch[i].entry];
+                slot->lsn = 0;
+                int structural = strcmp(req->account_id, "N") == 0 && strcmp(req->operation, "deposit") == 0;
+                int stripe = stripe_of(req->account_id);
+                if (strcmp(req->operation, "transfer") == 0)
+                    slot->result = apply_transfer(req, slot->message, &slot->lsn);
+                else if (!structural)
+                {
+                    lock_stripe(stripe);
+                    remap_store();
+                    structural = needs_structure_lock(req);
+                    if (!structural)
+                        slot->result = update_database(req->account_id, req->operation, req->amount, slot->message, &slot->lsn);
+                    unlock_stripe(stripe);
+                }
+                if (structural)
+                {
+                    lock_all_stripes();
+                    remap_store();
+                    slot->result = update_database(req->account_id, req->operation, req->amount, slot->message, &slot->lsn);
+                    unlock_all_stripes();
+                }
+                int op = metric_op(req);
+                metric_add(&metrics->requests[op], 1);
+                if (slot->result == 0)
+                    metric_add(&metrics->rejects[op], 1);
+            }
+            // Teller waits for the record to reach the disk itself, so handler can continue with the next requests.
+            // An event teller is woken once for the whole batch, it checks all of its entries anyway.
+            unsigned long long woken = 0;
+            for (int i = 0; i < count; i++)
+            {
+                int teller_id = batch[i].teller_id;
+                Teller_Slot *slot = &shared_data->teller_slots[teller_id];
+                __atomic_store_n(&slot->results[batch[i].entry].done_seq, batch[i].seq, __ATOMIC_RELEASE);
+                if (teller_event_fds[teller_id] == -1)
+                    sem_post(&slot->done);
+                else if (!(woken & (1ULL << teller_id)))
+                {
+                    eventfd_write(teller_event_fds[teller_id], 1);
+                    woken |= 1ULL << teller_id;
+                }
+            }
+        }
+        if (shard == 0 && checkpoint_interval > 0)
+        {
+            reap_checkpoint_writer();
+            if (checkpoint_writer_pid == -1 && __atomic_load_n(&dirty_map->changes, __ATOMIC_RELAXED) > 0 &&
+                time(NULL) - last_checkpoint_time >= checkpoint_interval)
+                start_background_checkpoint();
+        }
+    }
+}
+
+// Reads the log records after from_lsn. Segments that end before from_lsn are not read at all.
+// Reading stops at the first record that is missing or damaged. Returns the number of records.
+long long wal_read_records(unsigned long long from_lsn, Wal_Record **records)
+{
+    unsigned long long *segments;
+    int segment_count = wal_list_segments(&segments);
+    long long count = 0, size = 1024;
+    *records = malloc(size * sizeof(Wal_Record));
+    unsigned long long expected = from_lsn + 1;
+    for (int i = 0; i < segment_count; i++)
+    {
+        // Next segment starts at or before the first needed record, so this one has nothing needed.
+        if (i + 1 < segment_count && segments[i + 1] <= expected)
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), WAL_SEGMENT_TEMPLATE, segments[i]);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            break;
+        Wal_Record record;
+        int damaged = 0;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+        {
+            if (record.checksum != crc32(&record, offsetof(Wal_Record, checksum)))
+            {
+                damaged = 1;
+                break;
+            }
+            if (record.lsn < expected)
+                continue;
+            if (record.lsn != expected)
+            {
+                damaged = 1;
+                break;
+            }
+            if (count == size)
+            {
+                size *= 2;
+                *records = realloc(*records, size * sizeof(Wal_Record));
+            }
+            (*records)[count++] = record;
+            expected++;
+        }
+        fclose(file);
+        if (damaged)
+            break;
+    }
+    free(segments);
+    // Legs of a transfer that was not logged completely are not replayed.
+    while (count > 0 && (*records)[count - 1].type == WAL_TRANSFER)
+        count--;
+    return count;
+}
+
+static int compare_replay_records(const void *a, const void *b)
+{
+    const Wal_Record *x = *(Wal_Record *const *)a, *y = *(Wal_Record *const *)b;
+    int by_id = strcmp(x->account_id, y->account_id);
+    if (by_id != 0)
+        return by_id;
+    return (x->lsn > y->lsn) - (x->lsn < y->lsn);
+}
+
+// Replays the records of one partition. Every record holds the balance after the operation, so only the last
+// record of an account matters. Balances of existing accounts are set directly since partitions do not share
+// accounts and the index is not changed meanwhile. Accounts to be created or removed are left to recover_from_wal.
+void *replay_partition(void *arg)
+{
+    Replay_Partition *partition = arg;
+    qsort(partition->records, partition->count, sizeof(Wal_Record *), compare_replay_records);
+    partition->changes = malloc((partition->count + 1) * sizeof(Wal_Record *));
+    partition->change_count = 0;
+    partition->max_created_id = 0;
+    for (int i = 0; i < partition->count; i++)
+    {
+        Wal_Record *record = partition->records[i];
+        int number;
+        if (record->type == WAL_CREATE && sscanf(record->account_id, "BankID_%d", &number) == 1 && number > partition->max_created_id)
+            partition->max_created_id = number;
+        if (i + 1 < partition->count && strcmp(partition->records[i + 1]->account_id, record->account_id) == 0)
+            continue;
+        int position = find_account(record->account_id);
+        if (position != -1 && record->balance > 0)
+            accounts[position].balance = record->balance;
+        else
+            partition->changes[partition->change_count++] = record;
+    }
+    return NULL;
+}
+
+// Replays the log records after the checkpoint. Records are split into partitions by the hash of their account
+// and the partitions are replayed by threads in parallel. Time taken depends on the log written after the checkpoint only.
+void recover_from_wal(unsigned long long from_lsn)
+{
+    Wal_Record *records;
+    long long count = wal_read_records(from_lsn, &records);
+    if (count > 0 && records[count - 1].lsn != shared_data->wal.next_lsn - 1)
+    {
+        // Log ends earlier than expected, new records should follow the last record that could be replayed.
+        shared_data->wal.next_lsn = records[count - 1].lsn + 1;
+        shared_data->wal.durable_lsn = records[count - 1].lsn;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int partition_count = count < 10000 ? 1 : (cpus < 1 ? 1 : (cpus > MAX_REPLAY_THREADS ? MAX_REPLAY_THREADS : cpus));
+    Replay_Partition partitions[MAX_REPLAY_THREADS];
+    pthread_t threads[MAX_REPLAY_THREADS];
+    for (int p = 0; p < partition_count; p++)
+    {
+        partitions[p].records = malloc((count + 1) * sizeof(Wal_Record *));
+        partitions[p].count = 0;
+    }
+    for (long long i = 0; i < count; i++)
+    {
+        Replay_Partition *partition = &partitions[hash_account_id(records[i].account_id) % partition_count];
+        partition->records[partition->count++] = &records[i];
+    }
+    for (int p = 0; p < partition_count; p++)
+    {
+        pthread_create(&threads[p], NULL, replay_partition, &partitions[p]);
+    }
+
+    // Creating and removing accounts changes the index and may move or map the accounts again (grow_store),
+    // so these are done one by one after all threads finish.
+    for (int p = 0; p < partition_count; p++)
+    {
+        pthread_join(threads[p], NULL);
+    }
+    int changes = 0;
+    for (int p = 0; p < partition_count; p++)
+    {
+        for (int i = 0; i < partitions[p].change_count; i++)
+        {
+            Wal_Record *record = partitions[p].changes[i];
+            int position = find_account(record->account_id);
+            if (record->balance == 0 && position != -1)
+                remove_account(position);
+            else if (record->balance > 0 && position == -1)
+                add_account(record->account_id, record->balance);
+            changes++;
+        }
+        if (partitions[p].max_created_id >= store->next_id)
+            store->next_id = partitions[p].max_created_id + 1;
+        free(partitions[p].changes);
+        free(partitions[p].records);
+    }
+    free(records);
+    printf("Replayed %lld log records with %d threads (%d accounts created or removed).\n", count, partition_count, changes);
+}
+
+// Doubles the capacity of the store. The file is extended, mapped again and the index is built in its new place.
+// Caller should hold the database semaphore. Returns -1 if the store can not grow.
+int grow_store()
+{
+    int new_capacity = store->capacity * 2;
+    if (new_capacity > MAX_CAPACITY || ftruncate(store_fd, store_file_size(new_capacity)) == -1)
+        return -1;
+    store->capacity = new_capacity;
+    store->index_size = new_capacity * 2;
+    store->generation++;
+    munmap(store, store_mapped_size);
+    map_store();
+    rebuild_index();
+    return 0;
+}
+
+#ifdef __SSE2__
+// Bit i of the result is set if byte i of the 16 bytes at c is a newline, or a space or tab when spaces is set.
+static inline int separator_mask(const char *c, int spaces)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)c);
+    __m128i found = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+    if (spaces)
+        found = _mm_or_si128(found, _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))));
+    return _mm_movemask_epi8(found);
+}
+#endif
+
+// Returns the first newline in [c, end), or the first space, tab or newline when spaces is set. Returns end if there
+// is none. 16 bytes are compared at once with SSE2, the rest byte by byte.
+static const char *find_separator(const char *c, const char *end, int spaces)
+{
+#ifdef __SSE2__
+    for (; end - c >= 16; c += 16)
+    {
+        int mask = separator_mask(c, spaces);
+        if (mask != 0)
+            return c + __builtin_ctz(mask);
+    }
+#endif
+    for (; c < end; c++)
+    {
+        if (*c == '\n' || (spaces && (*c == ' ' || *c == '\t')))
+            return c;
+    }
+    return end;
+}
+
+// Counts the lines in [c, end), a last line without a newline counts too.
+static long count_lines(const char *c, const char *end)
+{
+    const char *start = c;
+    long lines = 0;
+#ifdef __SSE2__
+    for (; end - c >= 16; c += 16)
+        lines += __builtin_popcount(separator_mask(c, 0));
+#endif
+    for (; c < end; c++)
+        lines += *c == '\n';
+    return lines + (end > start && end[-1] != '\n');
+}
+
+static const char *skip_blanks(const char *c, const char *end)
+{
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r'))
+        c++;
+    return c;
+}
+
+// Parses one "<id> <balance>" line into the account. Returns 0 if the line is not valid.
+static int parse_account_line(const char *c, const char *end, Account *account)
+{
+    c = skip_blanks(c, end);
+    const char *id_end = find_separator(c, end, 1);
+    if (id_end == c || id_end - c >= (long)sizeof(account->account_id))
+        return 0;
+    memset(account, 0, sizeof(Account));
+    memcpy(account->account_id, c, id_end - c);
+    c = skip_blanks(id_end, end);
+    int negative = c < end && *c == '-';
+    c += negative;
+    const char *digits = c;
+    long long balance = 0;
+    while (c < end && *c >= '0' && *c <= '9' && balance <= INT_MAX)
+        balance = balance * 10 + (*c++ - '0');
+    if (c == digits || balance > INT_MAX || skip_blanks(c, end) != end)
+        return 0;
+    account->balance = negative ? -balance : balance;
+    return 1;
+}
+
+// Counts the lines of a chunk, so every chunk knows where its accounts go before any of them is parsed.
+void *count_load_chunk(void *arg)
+{
+    Load_Chunk *chunk = arg;
+    chunk->lines = count_lines(chunk->start, chunk->end);
+    return NULL;
+}
+
+// Parses the lines of a chunk into its places in the accounts array. Chunks write to different places, so no lock is needed.
+void *parse_load_chunk(void *arg)
+{
+    Load_Chunk *chunk = arg;
+    Account *account = accounts + chunk->first;
+    chunk->count = chunk->skipped = 0;
+    chunk->max_id = 0;
+    for (const char *c = chunk->start; c < chunk->end;)
+    {
+        const char *line_end = find_separator(c, chunk->end, 0);
+        if (parse_account_line(c, line_end, account))
+        {
+            if (strncmp(account->account_id, "BankID_", 7) == 0 && atoi(account->account_id + 7) > chunk->max_id)
+                chunk->max_id = atoi(account->account_id + 7);
+            account++;
+        }
+        else if (skip_blanks(c, line_end) != line_end)
+        {
+            chunk->skipped++;
+        }
+        c = line_end + 1;
+    }
+    chunk->count = account - (accounts + chunk->first);
+    return NULL;
+}
+
+// Indexes the accounts of a chunk. Index entries only go from empty to used while loading, so threads take them with
+// compare and swap. An id that is found on the way is a duplicate, they are dealt with after the threads finish.
+void *index_load_chunk(void *arg)
+{
+    Load_Chunk *chunk = arg;
+    unsigned int mask = store->index_size - 1;
+    chunk->duplicates = 0;
+    for (long i = chunk->first; i < chunk->first + chunk->count; i++)
+    {
+        unsigned int pos = hash_account_id(accounts[i].account_id) & mask;
+        while (1)
+        {
+            int entry = __atomic_load_n(&account_index[pos], __ATOMIC_ACQUIRE);
+            if (entry == INDEX_EMPTY &&
+                __atomic_compare_exchange_n(&account_index[pos], &entry, (int)i, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+            // Failed compare and swap leaves the entry that another thread put there in entry.
+            if (strcmp(accounts[entry].account_id, accounts[i].account_id) == 0)
+            {
+                chunk->duplicates++;
+                break;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+    return NULL;
+}
+
+// Runs the work on every chunk with a thread each and waits for them.
+void run_load_threads(void *(*work)(void *), Load_Chunk *chunks, int count)
+{
+    pthread_t threads[MAX_LOAD_THREADS];
+    for (int i = 0; i < count; i++)
+        pthread_create(&threads[i], NULL, work, &chunks[i]);
+    for (int i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// This function reads a pre-existing database file to fill up a datastructure referring to db in the server.
+// File is memory mapped and split into chunks at line ends, the chunks are parsed by threads straight into the
+// store and indexed in parallel, so a database of millions of accounts loads in seconds.
+void load_database_from_file()
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int fd = open(DB_FILE, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Could not open database.txt");
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    store->next_id = 1;
+    if (size == 0)
+    {
+        close(fd);
+        return;
+    }
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("Could not map database.txt");
+        return;
+    }
+    madvise((void *)data, size, MADV_WILLNEED);
+
+    int chunk_count = load_thread_count(size);
+    Load_Chunk chunks[MAX_LOAD_THREADS];
+    const char *c = data, *end = data + size;
+    for (int i = 0; i < chunk_count; i++)
+    {
+        // A chunk ends after the first newline past its share of the file, so no line is split.
+        const char *split = data + size / chunk_count * (i + 1);
+        chunks[i].start = c;
+        if (i == chunk_count - 1)
+            c = end;
+        else if (split > c && (c = find_separator(split, end, 0)) < end)
+            c++;
+        chunks[i].end = c;
+    }
+
+    // Every chunk gets as many places as it has lines, the store is grown once for all of them.
+    run_load_threads(count_load_chunk, chunks, chunk_count);
+    long lines = 0;
+    for (int i = 0; i < chunk_count; i++)
+    {
+        chunks[i].first = lines;
+        lines += chunks[i].lines;
+    }
+    while (store->capacity < lines)
+    {
+        if (grow_store() == -1)
+        {
+            fprintf(stderr, "Store can not hold the %ld lines of %s, it is not loaded.\n", lines, DB_FILE);
+            munmap((void *)data, size);
+            return;
+        }
+    }
+    run_load_threads(parse_load_chunk, chunks, chunk_count);
+    munmap((void *)data, size);
+
+    // Lines that were not valid left places empty at the end of their chunks, the accounts are moved together.
+    long count = 0, skipped = 0;
+    int max_id = 0;
+    for (int i = 0; i < chunk_count; i++)
+    {
+        if (chunks[i].first != count)
+            memmove(&accounts[count], &accounts[chunks[i].first], chunks[i].count * sizeof(Account));
+        chunks[i].first = count;
+        count += chunks[i].count;
+        skipped += chunks[i].skipped;
+        if (chunks[i].max_id > max_id)
+            max_id = chunks[i].max_id;
+    }
+    if (count < lines)
+        memset(&accounts[count], 0, (lines - count) * sizeof(Account));
+    store->db_size = count;
+    index_loaded_accounts(chunks, chunk_count, DB_FILE);
+    if (skipped > 0)
+        fprintf(stderr, "%ld lines of %s are not valid and are skipped.\n", skipped, DB_FILE);
+    // New ids start after the largest one in the file, so the id allocator never meets an id that is in use.
+    store->next_id = max_id + 1;
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("Loaded %d accounts from %s in %.2f s with %d threads.\n", store->db_size, DB_FILE,
+           (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9, chunk_count);
+}
+
+// Number of threads that load a file of the given size, one for every core but not for less than LOAD_CHUNK_MIN bytes.
+int load_thread_count(size_t bytes)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long wanted = bytes / LOAD_CHUNK_MIN + 1;
+    int count = cpus < 1 ? 1 : (cpus > MAX_LOAD_THREADS ? MAX_LOAD_THREADS : cpus);
+    return wanted < count ? wanted : count;
+}
+
+// Indexes the accounts of the chunks, which are together at the start of the accounts array, with a thread for
+// every chunk. Index should be empty.
+void index_loaded_accounts(Load_Chunk *chunks, int chunk_count, const char *source)
+{
+    long duplicates = 0;
+    run_load_threads(index_load_chunk, chunks, chunk_count);
+    for (int i = 0; i < chunk_count; i++)
+        duplicates += chunks[i].duplicates;
+    if (duplicates == 0)
+        return;
+
+    // A duplicate may have been indexed before the first one, so the accounts are indexed again in file order and
+    // the later ones are dropped like before. This only happens with a broken file.
+    for (int i = 0; i < store->index_size; i++)
+        account_index[i] = INDEX_EMPTY;
+    int kept = 0;
+    for (int i = 0; i < store->db_size; i++)
+    {
+        if (find_account(accounts[i].account_id) != -1)
+        {
+            fprintf(stderr, "Duplicate account %s in %s is skipped.\n", accounts[i].account_id, source);
+            continue;
+        }
+        accounts[kept] = accounts[i];
+        index_insert(accounts[kept].account_id, kept);
+        kept++;
+    }
+    memset(&accounts[kept], 0, (store->db_size - kept) * sizeof(Account));
+    store->db_size = kept;
+}
+
+// Writes "BankID_" and the number with at least two digits, the same as the ids given to new accounts.
+static void format_bank_id(char *id, int number)
+{
+    char digits[12];
+    int length = 0;
+    do
+    {
+        digits[length++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0 || length < 2);
+    memcpy(id, "BankID_", 7);
+    for (int i = 0; i < length; i++)
+        id[7 + i] = digits[length - 1 - i];
+    id[7 + length] = '\0';
+}
+
+// Loads database.bin into the empty store. The file is mapped, checked against its header and its records are
+// copied into the store in one piece. Returns -1 if there is no valid file, database.txt is loaded then.
+int load_database_binary()
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int fd = open(DB_BINARY_FILE, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    const char *data = size >= database_header_size(1) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "%s is not valid, %s is loaded instead.\n", DB_BINARY_FILE, DB_FILE);
+        return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    const Database_Header *header = (const Database_Header *)data;
+    size_t header_size = database_header_size(header->version);
+    const void *records = data + header_size;
+    int delta = header->flags & DB_DELTA_IDS;
+    size_t record_size = delta ? sizeof(Delta_Account) : sizeof(Account);
+    size_t bytes = (size_t)header->count * record_size;
+    if (memcmp(header->magic, DB_BINARY_MAGIC, sizeof(header->magic)) != 0 || header_size == 0 ||
+        header->record_size != record_size || header->count < 0 || size != header_size + bytes ||
+        crc32(records, bytes) != header->checksum || (delta && !database_deltas_valid(records, header->count)))
+    {
+        fprintf(stderr, "%s is not valid, %s is loaded instead.\n", DB_BINARY_FILE, DB_FILE);
+        munmap((void *)data, size);
+        return -1;
+    }
+    while (store->capacity < header->count)
+    {
+        if (grow_store() == -1)
+        {
+            fprintf(stderr, "Store can not hold the %d accounts of %s.\n", header->count, DB_BINARY_FILE);
+            munmap((void *)data, size);
+            return -1;
+        }
+    }
+    if (delta)
+    {
+        const Delta_Account *record = records;
+        int number = 0;
+        for (int i = 0; i < header->count; i++)
+        {
+            number += record[i].id_delta;
+            format_bank_id(accounts[i].account_id, number);
+            accounts[i].balance = record[i].balance;
+        }
+    }
+    else
+    {
+        memcpy(accounts, records, bytes);
+    }
+    store->db_size = header->count;
+    store->next_id = header->next_id;
+    munmap((void *)data, size);
+
+    // Index is built by threads over equal parts of the accounts.
+    int chunk_count = load_thread_count(bytes);
+    Load_Chunk chunks[MAX_LOAD_THREADS];
+    for (int i = 0; i < chunk_count; i++)
+    {
+        chunks[i].first = (long)store->db_size * i / chunk_count;
+        chunks[i].count = (long)store->db_size * (i + 1) / chunk_count - chunks[i].first;
+    }
+    index_loaded_accounts(chunks, chunk_count, DB_BINARY_FILE);
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("Loaded %d accounts from %s in %.2f s.\n", store->db_size, DB_BINARY_FILE,
+           (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    return 0;
+}
+
+// Writes all the accounts to database.bin. Accounts are contiguous in the store, so after the header they are
+// written with one write (a few for a very large store). File is written under a temporary name and renamed.
+// It is written when the server stops, so it holds every change in the log and bankeod can reconcile it exactly.
+void write_database_binary()
+{
+    Database_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DB_BINARY_MAGIC, sizeof(header.magic));
+    header.version = DB_BINARY_VERSION;
+    header.flags = DB_HAS_LSN;
+    header.lsn = shared_data->wal.next_lsn - 1;
+    header.count = store->db_size;
+    header.next_id = store->next_id;
+    header.record_size = sizeof(Account);
+    size_t bytes = (size_t)store->db_size * sizeof(Account);
+    header.checksum = crc32(accounts, bytes);
+    int fd = open(DB_BINARY_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+    {
+        perror("Could not write to database.bin");
+        return;
+    }
+    int failed = write(fd, &header, sizeof(header)) != sizeof(header);
+    for (size_t done = 0; !failed && done < bytes;)
+    {
+        ssize_t written = write(fd, (const char *)accounts + done, bytes - done);
+        if (written <= 0)
+            failed = 1;
+        else
+            done += written;
+    }
+    if (failed || fsync(fd) == -1)
+    {
+        perror("Could not write to database.bin");
+        close(fd);
+        unlink(DB_BINARY_TEMP_FILE);
+        return;
+    }
+    close(fd);
+    rename(DB_BINARY_TEMP_FILE, DB_BINARY_FILE);
+}
+
+// This function writes the current database stored in the datastructures in the server to database file.
+// It is also the signal handler for sigterm, so all the cleanup's are done here.
+void save_database_to_file(int sig)
+{
+    printf("\nSignal received, cleaning up and closing active tellers.\n");
+    printf("Adabank says “Bye”...\n");
+    // Stop the handler and tellers, let the log writer finish and mark the store clean so the next start does not recover.
+    stop_server_processes();
+    remap_store();
+    write_checkpoint();
+    store->lsn = shared_data->wal.next_lsn - 1;
+    store->clean = 1;
+    msync(store, store_mapped_size, MS_SYNC);
+
+    // Database is saved in the binary format, bankdb turns it into text.
+    write_database_binary();
+    // Clean up all the resources.
+
+    // Kill the remaining child processes (log writer)
+    signal(SIGTERM, SIG_IGN);   // Ignore SIGTERM for ourselves because we already received one.
+    killpg(getpgrp(), SIGTERM); // Kill all tellers
+    finalize_log_file();
+    release_server_resources();
+    exit(0);
+}
+
+// Stops the server after a process that it can not run without has died: a handler (the requests of its shard
+// would wait in the ring for ever), the log writer (nothing would become durable) or the audit writer (the log
+// buffer would not be reused). Store is not marked clean, so the next start recovers from the checkpoint and the
+// log as after a crash, every change that a client was told about is in the log.
+void stop_after_death(const char *name, pid_t pid, int status)
+{
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "%s (PID%d) was killed by signal %d, stopping the server.\n", name, pid, WTERMSIG(status));
+    else
+        fprintf(stderr, "%s (PID%d) exited with status %d, stopping the server.\n", name, pid, WEXITSTATUS(status));
+    signal(SIGTERM, SIG_IGN);
+    killpg(getpgrp(), SIGTERM);
+    release_server_resources();
+    exit(1);
+}
+
+// Removes the semaphore, the shared memory and the fifos of the server.
+void release_server_resources()
+{
+    sem_close(db_semaphore);
+    sem_unlink(SEM_NAME);
+    munmap(store, store_mapped_size);
+    close(store_fd);
+    shmdt(shared_data);
+    shmctl(shm_id, IPC_RMID, NULL);
+    shmdt(metrics);
+    shmctl(metrics_shm_id, IPC_RMID, NULL);
+    unlink(SERVER_FIFO);
+    unlink(SOCKET_PATH);
+}
+
+// Stops the handlers and the tellers while holding all the locks, so none of them is in the middle of
+// an update, and waits until the log writer has written every record that was added.
+void stop_server_processes()
+{
+    lock_all_stripes();
+    // handler_pids is used here to kill the handlers when server dies in order to avoid orphaned process.
+    for (int i = 0; i < shard_count; i++)
+    {
+        kill(handler_pids[i], SIGTERM);
+        waitpid(handler_pids[i], NULL, 0);
+    }
+    for (int i = 0; i < teller_count + socket_teller_count; i++)
+    {
+        kill(teller_pids[i], SIGTERM);
+        waitpid(teller_pids[i], NULL, 0);
+    }
+    wal_wait_durable(shared_data->wal.next_lsn - 1);
+    stop_audit_writer();
+    unlock_all_stripes();
+}
+
+// This function updates the database according to request arrived. Response is printed as well with -v.
+// It is only called from server-handlers, so database is updated only by server, as required in the homework document.
+// Caller holds the lock of the account's stripe, or all the locks when an account is created or removed.
+// Request is validated and applied in one step and response tells the final result, it is sent to the client as it is.
+// Every change is also added to the write ahead log, lsn is set to the LSN of its record.
+int update_database(const char *account_id, const char *operation, int amount, char *response, unsigned long long *lsn)
+{
+    // Only deposits and withdrawals are known, a new account ("N") can only be opened with a deposit.
+    if ((strcmp(operation, "deposit") != 0 && strcmp(operation, "withdraw") != 0) ||
+        (strcmp(account_id, "N") == 0 && strcmp(operation, "deposit") != 0))
+    {
+        snprintf(response, 100, "Invalid request for %s", account_id);
+        if (verbose)
+            printf("%s\n", response);
+        return 0;
+    }
+    // Amounts should be positive. A balance of 0 means a removed account in the log and in the checkpoints, so an
+    // account that reached 0 or less in any other way would not come back the same after a restart.
+    if (amount <= 0)
+    {
+        snprintf(response, 100, "Invalid amount %d for %s, it should be positive.", amount, account_id);
+        if (verbose)
+            printf("%s\n", response);
+        return 0;
+    }
+
+    if (strcmp(account_id, "N") == 0)
+    {
+        // Ids are given in increasing order and next_id is always past the largest id in the store (it is set when
+        // the database is loaded and moved past the created ids during recovery), so the first id tried is free.
+        // Checking it is one lookup in the hash index, the loop only continues for an id that is in use anyway.
+        char new_id[20];
+        int id_counter = store->next_id;
+        snprintf(new_id, sizeof(new_id), "BankID_%02d", id_counter);
+        while (find_account(new_id) != -1)
+        {
+            snprintf(new_id, sizeof(new_id), "BankID_%02d", ++id_counter);
+        }
+
+        if (add_account(new_id, amount) == -1)
+        {
+            snprintf(response, 100, "Bank is full, account could not be created.");
+            if (verbose)
+                printf("%s\n", response);
+            return 0;
+        }
+        *lsn = wal_append(WAL_CREATE, new_id, amount, amount);
+        snprintf(response, 100, "New account %s created with balance %d", new_id, amount);
+        if (verbose)
+            printf("%s\n", response);
+        store->next_id = id_counter + 1;
+        return 1;
+    }
+
+    int i = find_account(account_id);
+    if (i != -1)
+    {
+        if (strcmp(operation, "withdraw") == 0)
+        {
+            if (accounts[i].balance >= amount)
+            {
+                accounts[i].balance -= amount;
+                mark_dirty(i);
+                *lsn = wal_append(WAL_WITHDRAW, account_id, amount, accounts[i].balance);
+                if (accounts[i].balance == 0)
+                {
+                    remove_account(i);
+                    snprintf(response, 100, "Withdrawal successful. Account %s removed.", account_id);
+                    if (verbose)
+                        printf("%s\n", response);
+                }
+                else
+                {
+                    snprintf(response, 100, "%s Withdrawal successful. Remaining balance: %d", account_id, accounts[i].balance);
+                    if (verbose)
+                        printf("%s\n", response);
+                }
+                return 1;
+            }
+            else
+            {
+                snprintf(response, 100, "%s Insufficient balance.", account_id);
+                if (verbose)
+                    printf("%s\n", response);
+                return 0;
+            }
+        }
+        else if (strcmp(operation, "deposit") == 0)
+        {
+            if (accounts[i].balance > INT_MAX - amount)
+            {
+                snprintf(response, 100, "%s Deposit would exceed the largest balance.", account_id);
+                if (verbose)
+                    printf("%s\n", response);
+                return 0;
+            }
+            accounts[i].balance += amount;
+            mark_dirty(i);
+            *lsn = wal_append(WAL_DEPOSIT, account_id, amount, accounts[i].balance);
+            snprintf(response, 100, "%s Deposit successful. New balance: %d", account_id, accounts[i].balance);
+            if (verbose)
+                printf("%s\n", response);
+            return 1;
+        }
+    }
+    snprintf(response, 100, "Account not found.");
+    if (verbose)
+        printf("%s\n", response);
+    return 0;
+}
+
+// Applies a transfer: every leg is a debit (negative amount) or a credit of an existing account and the legs add up to
+// zero. Either all the legs are applied or none of them. Caller holds the locks of the legs' stripes, or all the locks
+// when an account is emptied and removed. Legs are added to the write ahead log together so that a crash can not
+// leave half of a transfer, lsn is set to the LSN of the last leg.
+int update_transfer(const Request *req, char *response, unsigned long long *lsn)
+{
+    int positions[MAX_TRANSFER_LEGS];
+    long long total = 0;
+    int legs = req->leg_count;
+    if (legs < 2 || legs > MAX_TRANSFER_LEGS)
+    {
+        snprintf(response, 100, "Invalid transfer, it should have 2 to %d accounts.", MAX_TRANSFER_LEGS);
+        if (verbose)
+            printf("%s\n", response);
+        return 0;
+    }
+    for (int i = 0; i < legs; i++)
+    {
+        const Transfer_Leg *leg = &req->legs[i];
+        total += leg->amount;
+        int repeated = 0;
+        for (int k = 0; k < i; k++)
+            repeated |= strncmp(req->legs[k].account_id, leg->account_id, sizeof(leg->account_id)) == 0;
+        if (leg->amount == 0 || repeated)
+        {
+            snprintf(response, 100, "Invalid transfer, %.20s is given twice or with no amount.", leg->account_id);
+            if (verbose)
+                printf("%s\n", response);
+            return 0;
+        }
+        positions[i] = find_account(leg->account_id);
+        if (positions[i] == -1)
+        {
+            snprintf(response, 100, "Transfer failed, account %.20s not found.", leg->account_id);
+            if (verbose)
+                printf("%s\n", response);
+            return 0;
+        }
+        if (leg->amount < 0 && accounts[positions[i]].balance < -(long long)leg->amount)
+        {
+            snprintf(response, 100, "Transfer failed, %.20s Insufficient balance.", leg->account_id);
+            if (verbose)
+                printf("%s\n", response);
+            return 0;
+        }
+        if (leg->amount > 0 && accounts[positions[i]].balance > INT_MAX - leg->amount)
+        {
+            snprintf(response, 100, "Transfer failed, %.20s would exceed the largest balance.", leg->account_id);
+            if (verbose)
+                printf("%s\n", response);
+            return 0;
+        }
+    }
+    if (total != 0)
+    {
+        snprintf(response, 100, "Invalid transfer, debits and credits differ by %lld.", total);
+        if (verbose)
+            printf("%s\n", response);
+        return 0;
+    }
+
+    // Everything is checked, nothing can fail from here on.
+    Wal_Record group[MAX_TRANSFER_LEGS];
+    memset(group, 0, sizeof(group));
+    long long moved = 0;
+    for (int i = 0; i < legs; i++)
+    {
+        const Transfer_Leg *leg = &req->legs[i];
+        accounts[positions[i]].balance += leg->amount;
+        mark_dirty(positions[i]);
+        if (leg->amount < 0)
+            moved -= leg->amount;
+        strncpy(group[i].account_id, leg->account_id, sizeof(group[i].account_id) - 1);
+        group[i].type = i + 1 < legs ? WAL_TRANSFER : WAL_TRANSFER_END;
+        group[i].amount = leg->amount;
+        group[i].balance = accounts[positions[i]].balance;
+    }
+    *lsn = wal_append_group(group, legs);
+    // Emptied accounts are removed after all the legs are applied, removing one moves another account in the store.
+    for (int i = 0; i < legs; i++)
+    {
+        int position = find_account(req->legs[i].account_id);
+        if (position != -1 && accounts[position].balance == 0)
+            remove_account(position);
+    }
+    if (legs == 2 && req->legs[0].amount < 0)
+        snprintf(response, 100, "%.20s Transfer of %d to %.20s successful. Remaining balance: %d", req->legs[0].account_id,
+                 req->legs[1].amount, req->legs[1].account_id, group[0].balance);
+    else
+        snprintf(response, 100, "Transfer of %lld credits between %d accounts successful.", moved, legs);
+    if (verbose)
+        printf("%s\n", response);
+    return 1;
+}
+
+static int compare_lsn(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Fills lsns with the LSNs in the names of the files (<lsn>.<extension>) in the directory in increasing order.
+// Returns the number of files, caller frees the array.
+int list_lsn_files(const char *directory, const char *extension, unsigned long long **lsns)
+{
+    int count = 0, size = 16;
+    *lsns = malloc(size * sizeof(unsigned long long));
+    DIR *dir = opendir(directory);
+    if (!dir)
+        return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        unsigned long long lsn;
+        char file_extension[8];
+        if (sscanf(entry->d_name, "%llu.%7s", &lsn, file_extension) != 2 || strcmp(file_extension, extension) != 0)
+            continue;
+        if (count == size)
+        {
+            size *= 2;
+            *lsns = realloc(*lsns, size * sizeof(unsigned long long));
+        }
+        (*lsns)[count++] = lsn;
+    }
+    closedir(dir);
+    qsort(*lsns, count, sizeof(unsigned long long), compare_lsn);
+    return count;
+}
+
+// Fills segments with the first LSN of every segment file in the log directory in increasing order.
+int wal_list_segments(unsigned long long **segments)
+{
+    return list_lsn_files(WAL_DIR, "seg", segments);
+}
+
+// Removes the segments whose records are all in a checkpoint up to the given LSN and in the audit segments on disk.
+// The last segment is never removed since the log writer appends to it.
+void wal_remove_segments(unsigned long long lsn)
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    lock_wal(wal);
+    if (lsn > wal->audited_lsn)
+        lsn = wal->audited_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    sync_audit_segment();
+    unsigned long long *segments;
+    int count = wal_list_segments(&segments);
+    for (int i = 0; i + 1 < count && segments[i + 1] <= lsn + 1; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), WAL_SEGMENT_TEMPLATE, segments[i]);
+        unlink(path);
+    }
+    free(segments);
+}
+
+// Creates a new segment that starts with the given LSN and makes it the one that is written.
+void wal_open_segment(unsigned long long first_lsn)
+{
+    char path[64];
+    snprintf(path, sizeof(path), WAL_SEGMENT_TEMPLATE, first_lsn);
+    if (wal_fd != -1)
+        close(wal_fd);
+    wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (wal_fd == -1)
+    {
+        perror("Could not create log segment");
+        exit(1);
+    }
+    wal_segment_bytes = 0;
+    // Directory is synced as well, otherwise a new segment could disappear after a crash.
+    int dir_fd = open(WAL_DIR, O_RDONLY);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Opens the last segment of the log and finds the LSN to continue from. A torn record at the end of the
+// segment (crash while writing) is cut off so that new records follow the last complete one.
+void wal_open()
+{
+    mkdir(WAL_DIR, 0777);
+    mkdir(CHECKPOINT_DIR, 0777);
+    unsigned long long *segments;
+    int count = wal_list_segments(&segments);
+    unsigned long long last_lsn = 0;
+    if (count > 0)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), WAL_SEGMENT_TEMPLATE, segments[count - 1]);
+        wal_fd = open(path, O_RDWR | O_APPEND);
+        if (wal_fd == -1)
+        {
+            perror("Could not open log segment");
+            exit(1);
+        }
+        last_lsn = segments[count - 1] - 1;
+        Wal_Record record;
+        off_t valid_bytes = 0, complete_bytes = 0;
+        unsigned long long complete_lsn = last_lsn;
+        while (pread(wal_fd, &record, sizeof(record), valid_bytes) == sizeof(record) && record.lsn == last_lsn + 1 &&
+               record.checksum == crc32(&record, offsetof(Wal_Record, checksum)))
+        {
+            last_lsn = record.lsn;
+            valid_bytes += sizeof(record);
+            // A transfer whose last leg is missing is cut off as well, the client was not answered for it.
+            if (record.type != WAL_TRANSFER)
+            {
+                complete_lsn = last_lsn;
+                complete_bytes = valid_bytes;
+            }
+        }
+        last_lsn = complete_lsn;
+        valid_bytes = complete_bytes;
+        ftruncate(wal_fd, valid_bytes);
+        wal_segment_bytes = valid_bytes;
+    }
+    else
+    {
+        wal_open_segment(1);
+    }
+    free(segments);
+    shared_data->wal.next_lsn = last_lsn + 1;
+    shared_data->wal.durable_lsn = last_lsn;
+    printf("Write ahead log continues from LSN %llu.\n", last_lsn + 1);
+}
+
+// Initializes the log buffer, its mutex and conditions are shared between processes. The mutex is robust since
+// a teller may be killed while it appends or waits, see lock_wal.
+void init_wal_buffer(Wal_Buffer *wal)
+{
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&wal->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->appended, &cond_attr);
+    pthread_cond_init(&wal->flushed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    // Nothing is removed from the log until audit_open finds how far the audit segments go.
+    wal->audited_lsn = 0;
+    wal->audit_closing = 0;
+}
+
+// Takes the log lock, a lock left by a dead process is taken over. next_lsn is only moved after the records are
+// complete, so a process that died holding the lock leaves nothing half written behind it.
+void lock_wal(Wal_Buffer *wal)
+{
+    if (pthread_mutex_lock(&wal->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&wal->lock);
+}
+
+// Waits on a condition of the log buffer (until the deadline if it is given), the lock is taken over the same way
+// when it comes back from a dead process. Returns the result of the wait, ETIMEDOUT when the deadline passed.
+int wait_wal(pthread_cond_t *cond, Wal_Buffer *wal, const struct timespec *deadline)
+{
+    int result = deadline ? pthread_cond_timedwait(cond, &wal->lock, deadline) : pthread_cond_wait(cond, &wal->lock);
+    if (result == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&wal->lock);
+        result = 0;
+    }
+    return result;
+}
+
+// Adds a record to the log buffer and returns its LSN. Record is not on disk yet, see wal_wait_durable.
+// Waits if the buffer is full of records that are not written to the log or to the audit segments yet, the caller
+// keeps the lock of its stripe meanwhile (see Wal_Buffer).
+unsigned long long wal_append(int type, const char *account_id, int amount, int balance)
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    lock_wal(wal);
+    while (wal->next_lsn - wal->audited_lsn > WAL_BUFFER_RECORDS)
+        wait_wal(&wal->flushed, wal, NULL);
+    unsigned long long lsn = wal->next_lsn;
+    Wal_Record *record = &wal->records[lsn % WAL_BUFFER_RECORDS];
+    memset(record, 0, sizeof(Wal_Record));
+    record->lsn = lsn;
+    record->time_us = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    strncpy(record->account_id, account_id, sizeof(record->account_id) - 1);
+    record->type = type;
+    record->amount = amount;
+    record->balance = balance;
+    record->checksum = crc32(record, offsetof(Wal_Record, checksum));
+    wal->next_lsn++;
+    pthread_cond_signal(&wal->appended);
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// Adds the records of a transfer to the log with consecutive LSNs. They are added with one hold of the lock, so the
+// log writer writes either all or none of them in a group. Returns the LSN of the last record.
+unsigned long long wal_append_group(Wal_Record *group, int count)
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    lock_wal(wal);
+    while (wal->next_lsn + count - 1 - wal->audited_lsn > WAL_BUFFER_RECORDS)
+        wait_wal(&wal->flushed, wal, NULL);
+    unsigned long long last = wal->next_lsn + count - 1;
+    for (int i = 0; i < count; i++)
+    {
+        Wal_Record *record = &wal->records[(wal->next_lsn + i) % WAL_BUFFER_RECORDS];
+        *record = group[i];
+        record->lsn = wal->next_lsn + i;
+        record->time_us = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        record->checksum = crc32(record, offsetof(Wal_Record, checksum));
+    }
+    wal->next_lsn = last + 1;
+    pthread_cond_signal(&wal->appended);
+    pthread_mutex_unlock(&wal->lock);
+    return last;
+}
+
+// Waits until the record with the given LSN is written and synced by the log writer.
+void wal_wait_durable(unsigned long long lsn)
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    lock_wal(wal);
+    while (wal->durable_lsn < lsn)
+        wait_wal(&wal->flushed, wal, NULL);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Writes the records between the given LSNs from the buffer to the segment file, starting a new segment when
+// the current one is full. Records are written in at most two pieces since the buffer is circular.
+void wal_write(unsigned long long first, unsigned long long last)
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    if (wal_segment_bytes >= WAL_SEGMENT_SIZE)
+        wal_open_segment(first);
+    while (first <= last)
+    {
+        size_t start = first % WAL_BUFFER_RECORDS;
+        size_t count = last - first + 1;
+        if (start + count > WAL_BUFFER_RECORDS)
+            count = WAL_BUFFER_RECORDS - start;
+        const char *data = (const char *)&wal->records[start];
+        size_t bytes = count * sizeof(Wal_Record);
+        while (bytes > 0)
+        {
+            ssize_t written = write(wal_fd, data, bytes);
+            if (written == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("Log write failed");
+                exit(1);
+            }
+            data += written;
+            bytes -= written;
+        }
+        wal_segment_bytes += count * sizeof(Wal_Record);
+        first += count;
+    }
+}
+
+// Main loop of the log writer process. It waits for the first record of a group, then gives the other requests
+// the commit window to join the group and writes the whole group with one fsync. Tellers waiting for any record
+// of the group are woken up together.
+void log_writer()
+{
+    Wal_Buffer *wal = &shared_data->wal;
+    while (1)
+    {
+        lock_wal(wal);
+        while (wal->next_lsn - 1 == wal->durable_lsn)
+            wait_wal(&wal->appended, wal, NULL);
+        if (commit_window > 0)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (long)commit_window * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (wal->next_lsn - 1 - wal->durable_lsn < WAL_GROUP_MAX &&
+                   wait_wal(&wal->appended, wal, &deadline) != ETIMEDOUT)
+                ;
+        }
+        unsigned long long first = wal->durable_lsn + 1;
+        unsigned long long last = wal->next_lsn - 1;
+        pthread_mutex_unlock(&wal->lock);
+
+        // Records in the group can not be overwritten while they are written since durable_lsn is not moved yet.
+        long long start = now_us();
+        wal_write(first, last);
+        if (fdatasync(wal_fd) == -1)
+        {
+            perror("Log fsync failed");
+            exit(1);
+        }
+        long long took = now_us() - start;
+        metric_add(&metrics->wal_syncs, 1);
+        metric_add(&metrics->wal_records, last - first + 1);
+        metric_add(&metrics->wal_bytes, (last - first + 1) * sizeof(Wal_Record));
+        metric_add(&metrics->wal_write_us, took);
+        metric_record(&metrics->wal_sync_latency, took);
+
+        lock_wal(wal);
+        wal->durable_lsn = last;
+        pthread_cond_broadcast(&wal->flushed);
+        pthread_mutex_unlock(&wal->lock);
+    }
+}
+
+// This function serves a single client connection: it reads the request, forwards it to the handler and answers
+// the client with the result once the change is on disk.
+void serve_client(Server_Connection_Request *sc_request, int teller_id)
+{
+    // Read actual request from the client.
+    Request request;
+
+    int fd = open(sc_request->client_fifo, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Teller open read");
+        unlink(sc_request->client_fifo);
+        return;
+    }
+    if (read(fd, &request, sizeof(Request)) <= 0)
+    {
+        perror("Teller read request");
+        unlink(sc_request->client_fifo);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    // Balance queries do not change anything, teller answers them itself without going to the handler.
+    if (is_balance_query(&request))
+    {
+        Response response;
+        answer_balance_query(&request, response.message);
+        int client_fd = open(sc_request->client_fifo, O_WRONLY);
+        if (client_fd != -1)
+        {
+            write(client_fd, &response, sizeof(Response));
+            close(client_fd);
+        }
+        return;
+    }
+
+    // Handler that has too many requests waiting does not get more, client is told to try again.
+    if (handler_busy(request_shard(teller_id, 0, &request)))
+    {
+        Response response;
+        answer_busy(response.message);
+        int client_fd = open(sc_request->client_fifo, O_WRONLY);
+        if (client_fd != -1)
+        {
+            write(client_fd, &response, sizeof(Response));
+            close(client_fd);
+        }
+        return;
+    }
+
+    // Other requests are validated by the handler while it applies them, so the teller does not look at the store.
+    Teller_Slot *slot = &shared_data->teller_slots[teller_id];
+    long long submitted = now_us();
+    unsigned int seq = submit_request(teller_id, 0, &request);
+
+    // Wait until the handler applies the request and its log record is on disk, client is answered only after that.
+    while (__atomic_load_n(&slot->results[0].done_seq, __ATOMIC_ACQUIRE) != seq)
+    {
+        while (sem_wait(&slot->done) == -1 && errno == EINTR)
+            ;
+    }
+    metric_record(&metrics->request_latency, now_us() - submitted);
+    if (slot->results[0].lsn != 0)
+        wal_wait_durable(slot->results[0].lsn);
+
+    // Send the final result of the operation (new balance, new account id or why it is rejected) to the client back.
+    Response response;
+    strcpy(response.message, slot->results[0].message);
+
+    int client_fd = open(sc_request->client_fifo, O_WRONLY);
+    if (client_fd != -1)
+    {
+        write(client_fd, &response, sizeof(Response));
+        close(client_fd);
+    }
+}
+
+// Sends a request to the handler of its shard, its result is reported to the given entry of the teller's slot.
+// New accounts go to the shards in turn, other requests go to the shard of their account. Returns the sequence number of the request.
+unsigned int submit_request(int teller_id, int entry, const Request *request)
+{
+    Teller_Slot *slot = &shared_data->teller_slots[teller_id];
+    int shard = request_shard(teller_id, entry, request);
+    Teller_Request treq;
+    treq.request = *request;
+    treq.teller_id = teller_id;
+    treq.entry = entry;
+    // Zero is never used so that a fresh entry is never taken as done.
+    if (++slot->next_seq == 0)
+        slot->next_seq = 1;
+    treq.seq = slot->next_seq;
+    ring_push(&shared_data->shards[shard].ring, &treq);
+    return treq.seq;
+}
+
+// Returns the shard whose handler applies the request. New accounts have no id yet, they are spread over the shards.
+int request_shard(int teller_id, int entry, const Request *request)
+{
+    return strcmp(request->account_id, "N") == 0 ? (teller_id + entry) % shard_count : shard_of(request->account_id);
+}
+
+// Tells if the handler of the shard has as many requests waiting in its ring as it is allowed to. Head is read
+// without the handler's knowledge, a request more or less does not matter here.
+int handler_busy(int shard)
+{
+    Request_Ring *ring = &shared_data->shards[shard].ring;
+    unsigned int waiting = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    return waiting >= (unsigned int)max_pending_requests;
+}
+
+// Fills the answer of a request that is turned away, the client sends it again after the given time.
+int answer_busy(char *response)
+{
+    snprintf(response, 100, "Server busy, retry after %d ms", BUSY_RETRY_MS);
+    metric_add(&metrics->busy_requests, 1);
+    return RESULT_BUSY;
+}
+
+// Tells a client that its session is not accepted now. Client keeps its response fifo open for reading while it
+// waits for a teller, so the answer is written without blocking. Nothing can be sent to an old client that does
+// not do this, its connection request is simply dropped.
+void reject_connection(const Server_Connection_Request *sc_request)
+{
+    metric_add(&metrics->busy_connections, 1);
+    if (!sc_request->session)
+        return;
+    char response_fifo[CLIENT_FIFO_NAME_LEN + 8];
+    snprintf(response_fifo, sizeof(response_fifo), RESPONSE_FIFO_TEMPLATE, sc_request->client_fifo);
+    int fd = open(response_fifo, O_WRONLY | O_NONBLOCK);
+    if (fd == -1)
+        return;
+    Session_Response response;
+    memset(&response, 0, sizeof(response));
+    response.result = RESULT_BUSY;
+    snprintf(response.message, sizeof(response.message), "Server busy, retry after %d ms", BUSY_RETRY_MS);
+    write(fd, &response, sizeof(response));
+    close(fd);
+}
+
+// Tells if the request only reads the balance of an account.
+int is_balance_query(const Request *request)
+{
+    return strcmp(request->operation, "balance") == 0;
+}
+
+// Answers a balance query from the store without going to a handler or taking a lock, so reads never wait behind
+// the updates. Balance is the one of the last applied change, its log record may not be on disk yet.
+int answer_balance_query(const Request *request, char *response)
+{
+    if (request->leg_count > 0)
+        return answer_bulk_balance_query(request, response);
+    int balance;
+    metric_add(&metrics->requests[METRIC_BALANCE], 1);
+    if (!read_balance(request->account_id, &balance))
+    {
+        metric_add(&metrics->rejects[METRIC_BALANCE], 1);
+        snprintf(response, 100, "Account not found.");
+        return 0;
+    }
+    snprintf(response, 100, "%s Balance: %d", request->account_id, balance);
+    return 1;
+}
+
+// Answers a query of the balances of several accounts, the accounts are the legs of the request. They are read
+// together so that the answer is one state of the bank. Message lists the balances in the order of the accounts with
+// "-" for the ones that do not exist. Returns 1 if all of them exist.
+int answer_bulk_balance_query(const Request *request, char *response)
+{
+    Transfer_Leg legs[MAX_TRANSFER_LEGS];
+    int balances[MAX_TRANSFER_LEGS], found[MAX_TRANSFER_LEGS];
+    int count = request->leg_count > MAX_TRANSFER_LEGS ? MAX_TRANSFER_LEGS : request->leg_count;
+    metric_add(&metrics->requests[METRIC_BALANCE], 1);
+    memcpy(legs, request->legs, count * sizeof(Transfer_Leg));
+    for (int i = 0; i < count; i++)
+        legs[i].account_id[sizeof(legs[i].account_id) - 1] = '\0';
+    int existing = read_balances(legs, count, balances, found);
+    int length = snprintf(response, 100, "Balances:");
+    for (int i = 0; i < count && length < 100; i++)
+    {
+        if (found[i])
+            length += snprintf(response + length, 100 - length, " %d", balances[i]);
+        else
+            length += snprintf(response + length, 100 - length, " -");
+    }
+    if (existing < count)
+    {
+        metric_add(&metrics->rejects[METRIC_BALANCE], 1);
+        return 0;
+    }
+    return 1;
+}
+
+// This function serves a client session. Client opens a session with one connection request and sends many requests
+// over its fifo, each with its own request id. Teller keeps up to SESSION_WINDOW of them in the handlers at the same
+// time and answers on the response fifo with all the results that are ready in one write. Session ends when the client
+// closes its side of the request fifo and every request is answered.
+void serve_session(Server_Connection_Request *sc_request, int teller_id)
+{
+    char response_fifo[CLIENT_FIFO_NAME_LEN + 8];
+    snprintf(response_fifo, sizeof(response_fifo), RESPONSE_FIFO_TEMPLATE, sc_request->client_fifo);
+    int request_fd = open(sc_request->client_fifo, O_RDONLY);
+    if (request_fd == -1)
+    {
+        perror("Teller open session");
+        return;
+    }
+    int response_fd = open(response_fifo, O_WRONLY);
+    if (response_fd == -1)
+    {
+        perror("Teller open session responses");
+        close(request_fd);
+        return;
+    }
+    int served = serve_session_fds(request_fd, response_fd, teller_id);
+    close(request_fd);
+    close(response_fd);
+    printf("Teller %d (PID%d) served %d requests of client PID%d.\n", teller_id, getpid(), served, sc_request->client_pid);
+}
+
+// Runs the session protocol on the given descriptors and returns the number of answered requests. Fifo sessions use
+// two fifos, socket sessions use the same socket for both directions.
+int serve_session_fds(int request_fd, int response_fd, int teller_id)
+{
+    Teller_Slot *slot = &shared_data->teller_slots[teller_id];
+    unsigned int seqs[SESSION_WINDOW] = {0}; // Sequence number of the request using the entry, 0 when the entry is free.
+    unsigned int request_ids[SESSION_WINDOW];
+    long long submitted_us[SESSION_WINDOW];
+    int free_entries[SESSION_WINDOW];
+    int free_count = SESSION_WINDOW, in_flight = 0, eof = 0, served = 0;
+    for (int i = 0; i < SESSION_WINDOW; i++)
+        free_entries[i] = SESSION_WINDOW - 1 - i;
+    // Pipe may give a part of a request, rest of it stays in the buffer until the next read.
+    char buffer[SESSION_WINDOW * sizeof(Session_Request)];
+    size_t buffered = 0;
+    Session_Response responses[SESSION_WINDOW];
+
+    while (!eof || in_flight > 0)
+    {
+        int count = 0;
+        // Read more requests when there are free entries. Reading only blocks when no request is waiting for a result.
+        struct pollfd poll_fd = {request_fd, POLLIN, 0};
+        if (!eof && in_flight < SESSION_WINDOW && (in_flight == 0 || poll(&poll_fd, 1, 0) > 0))
+        {
+            size_t room = (SESSION_WINDOW - in_flight) * sizeof(Session_Request) - buffered;
+            ssize_t bytes = read(request_fd, buffer + buffered, room);
+            if (bytes > 0)
+                buffered += bytes;
+            else if (bytes == 0 || errno != EINTR)
+                eof = 1;
+            size_t used = 0;
+            while (buffered - used >= sizeof(Session_Request))
+            {
+                Session_Request session_request;
+                memcpy(&session_request, buffer + used, sizeof(Session_Request));
+                used += sizeof(Session_Request);
+                if (is_balance_query(&session_request.request))
+                {
+                    // Answered right away with the results of this round, it does not use an entry.
+                    responses[count].request_id = session_request.request_id;
+                    responses[count].result = answer_balance_query(&session_request.request, responses[count].message);
+                    count++;
+                    continue;
+                }
+                int entry = free_entries[--free_count];
+                if (handler_busy(request_shard(teller_id, entry, &session_request.request)))
+                {
+                    // Turned away with the results of this round as well, entry stays free.
+                    free_count++;
+                    responses[count].request_id = session_request.request_id;
+                    responses[count].result = answer_busy(responses[count].message);
+                    count++;
+                    continue;
+                }
+                request_ids[entry] = session_request.request_id;
+                submitted_us[entry] = now_us();
+                seqs[entry] = submit_request(teller_id, entry, &session_request.request);
+                in_flight++;
+            }
+            memmove(buffer, buffer + used, buffered - used);
+            buffered -= used;
+        }
+        if (in_flight == 0 && count == 0)
+            continue;
+
+        // Take every result that is ready, wait for a handler if there is none. A post may belong to a result that
+        // is already taken, so the entries are checked instead of counting the posts. Balance answers are not
+        // waited with, so the results are only checked once when there are some.
+        unsigned long long last_lsn = 0;
+        do
+        {
+            long long now = now_us();
+            for (int entry = 0; entry < SESSION_WINDOW; entry++)
+            {
+                Teller_Result *result = &slot->results[entry];
+                if (seqs[entry] == 0 || __atomic_load_n(&result->done_seq, __ATOMIC_ACQUIRE) != seqs[entry])
+                    continue;
+                metric_record(&metrics->request_latency, now - submitted_us[entry]);
+                responses[count].request_id = request_ids[entry];
+                responses[count].result = result->result;
+                strcpy(responses[count].message, result->message);
+                if (result->lsn > last_lsn)
+                    last_lsn = result->lsn;
+                count++;
+                seqs[entry] = 0;
+                free_entries[free_count++] = entry;
+                in_flight--;
+            }
+            if (count == 0)
+            {
+                while (sem_wait(&slot->done) == -1 && errno == EINTR)
+                    ;
+            }
+        } while (count == 0);
+        // Results are sent only after their log records are on disk, one wait covers the whole batch.
+        if (last_lsn != 0)
+            wal_wait_durable(last_lsn);
+        if (write(response_fd, responses, count * sizeof(Session_Response)) == -1)
+        {
+            perror("Teller write session responses");
+            break;
+        }
+        served += count;
+    }
+    return served;
+}
+
+// Creates the unix domain socket that socket clients connect to. A socket left from an earlier run is removed first.
+int open_listening_socket()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("Socket create");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+    unlink(SOCKET_PATH);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOCKET_BACKLOG) == -1)
+    {
+        perror("Socket bind");
+        exit(EXIT_FAILURE);
+    }
+    // Event tellers accept only when epoll says there is a connection, another teller may have taken it already.
+    if (event_tellers)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+// Loop of a socket teller. Every socket teller blocks in accept on the same listening socket and the kernel gives
+// each connection to one of them, so no connection queue is needed. Client pid is taken from the socket credentials.
+void serve_socket_clients(int teller_id)
+{
+    while (1)
+    {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("Socket accept");
+            continue;
+        }
+        struct ucred credentials;
+        socklen_t length = sizeof(credentials);
+        pid_t client_pid = -1;
+        if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+            client_pid = credentials.pid;
+        printf("Teller %d (PID%d) is serving client PID%d over %s.\n", teller_id, getpid(), client_pid, SOCKET_PATH);
+        int served = serve_session_fds(client_fd, client_fd, teller_id);
+        close(client_fd);
+        printf("Teller %d (PID%d) served %d requests of client PID%d.\n", teller_id, getpid(), served, client_pid);
+    }
+}
+
+// Sets the events epoll watches for the connection. A connection with responses waiting is only watched for writing.
+// Otherwise it is read while there are free entries, if there are none it is stalled until some results come back.
+static void watch_connection(int epoll_fd, Event_Connection *connection, int free_count, Event_Connection **stalled)
+{
+    unsigned int events = 0;
+    if (connection->output_end > connection->output_start)
+        events = EPOLLOUT;
+    else if (!connection->eof && free_count > 0)
+        events = EPOLLIN;
+    else if (!connection->eof && !connection->stalled)
+    {
+        connection->stalled = 1;
+        connection->next_stalled = *stalled;
+        *stalled = connection;
+    }
+    if (events != connection->events)
+    {
+        struct epoll_event event = {events, {.ptr = connection}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+}
+
+// Writes as much of the waiting responses as the socket takes. Marks the connection broken if the client is gone.
+static void flush_connection(Event_Connection *connection)
+{
+    while (connection->output_end > connection->output_start)
+    {
+        ssize_t bytes = write(connection->fd, connection->output + connection->output_start,
+                              connection->output_end - connection->output_start);
+        if (bytes > 0)
+            connection->output_start += bytes;
+        else if (bytes == -1 && errno == EINTR)
+            continue;
+        else
+        {
+            if (errno != EAGAIN)
+                connection->broken = 1;
+            break;
+        }
+    }
+    if (connection->output_start == connection->output_end)
+        connection->output_start = connection->output_end = 0;
+}
+
+// Closes the connection when it is broken or the session is over. Memory is kept while its requests are in the
+// handlers or it is on the stalled list, and until the events taken from epoll with it are handled. Returns 1 if
+// the socket is closed.
+static int finish_connection(int epoll_fd, Event_Connection *connection, int teller_id, Event_Connection **released)
+{
+    if (connection->fd != -1 && (connection->broken ||
+        (connection->eof && connection->in_flight == 0 && connection->output_end == connection->output_start)))
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+        close(connection->fd);
+        connection->fd = -1;
+        printf("Teller %d (PID%d) served %d requests of client PID%d.\n", teller_id, getpid(), connection->served, connection->client_pid);
+    }
+    if (connection->fd == -1 && connection->in_flight == 0 && !connection->stalled && !connection->released)
+    {
+        connection->released = 1;
+        connection->next_released = *released;
+        *released = connection;
+    }
+    return connection->fd == -1;
+}
+
+// Loop of a socket teller in event mode. One process serves every connection it accepts: epoll reports new
+// connections, requests that arrived on the sockets and the eventfd the handlers write to when results are ready.
+// Sockets are non-blocking so that a slow client never stops the others.
+void serve_socket_events(int teller_id)
+{
+    Teller_Slot *slot = &shared_data->teller_slots[teller_id];
+    int event_fd = teller_event_fds[teller_id];
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    // Listening socket is registered with a null pointer and the eventfd with the slot, connections with themselves.
+    // With EPOLLEXCLUSIVE only one of the event tellers is woken for a new connection.
+    struct epoll_event event = {EPOLLIN | EPOLLEXCLUSIVE, {.ptr = NULL}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.events = EPOLLIN;
+    event.data.ptr = slot;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
+
+    unsigned int seqs[SESSION_WINDOW] = {0}; // Sequence number of the request using the entry, 0 when the entry is free.
+    unsigned int request_ids[SESSION_WINDOW];
+    long long submitted_us[SESSION_WINDOW];
+    Event_Connection *owners[SESSION_WINDOW];
+    int free_entries[SESSION_WINDOW];
+    int free_count = SESSION_WINDOW;
+    for (int i = 0; i < SESSION_WINDOW; i++)
+        free_entries[i] = SESSION_WINDOW - 1 - i;
+    Event_Connection *stalled = NULL, *released = NULL;
+    struct epoll_event events[EVENT_BATCH];
+
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, EVENT_BATCH, -1);
+        if (ready == -1)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                // Take every waiting connection, others may be taken by another teller first.
+                int client_fd;
+                while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1)
+                {
+                    Event_Connection *connection = calloc(1, sizeof(Event_Connection));
+                    if (connection == NULL)
+                    {
+                        close(client_fd);
+                        continue;
+                    }
+                    connection->fd = client_fd;
+                    connection->client_pid = -1;
+                    struct ucred credentials;
+                    socklen_t length = sizeof(credentials);
+                    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+                        connection->client_pid = credentials.pid;
+                    event.events = EPOLLIN;
+                    event.data.ptr = connection;
+                    connection->events = EPOLLIN;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+                    printf("Teller %d (PID%d) is serving client PID%d over %s.\n", teller_id, getpid(), connection->client_pid, SOCKET_PATH);
+                }
+            }
+            else if (events[i].data.ptr == slot)
+            {
+                // Take every result that is ready. Their log records are waited for once, then responses are
+                // added to their connections and each touched connection gets one write.
+                eventfd_t posts;
+                eventfd_read(event_fd, &posts);
+                int done_entries[SESSION_WINDOW], done_count = 0;
+                unsigned long long last_lsn = 0;
+                long long now = now_us();
+                for (int entry = 0; entry < SESSION_WINDOW; entry++)
+                {
+                    Teller_Result *result = &slot->results[entry];
+                    if (seqs[entry] == 0 || __atomic_load_n(&result->done_seq, __ATOMIC_ACQUIRE) != seqs[entry])
+                        continue;
+                    metric_record(&metrics->request_latency, now - submitted_us[entry]);
+                    done_entries[done_count++] = entry;
+                    if (result->lsn > last_lsn)
+                        last_lsn = result->lsn;
+                }
+                if (last_lsn != 0)
+                    wal_wait_durable(last_lsn);
+                Event_Connection *touched[SESSION_WINDOW];
+                int touched_count = 0;
+                for (int j = 0; j < done_count; j++)
+                {
+                    int entry = done_entries[j];
+                    Event_Connection *connection = owners[entry];
+                    if (connection->fd != -1)
+                    {
+                        // Output has room for a whole window behind the waiting responses, moved to the front first.
+                        if (connection->output_start > 0)
+                        {
+                            memmove(connection->output, connection->output + connection->output_start,
+                                    connection->output_end - connection->output_start);
+                            connection->output_end -= connection->output_start;
+                            connection->output_start = 0;
+                        }
+                        Session_Response response;
+                        response.request_id = request_ids[entry];
+                        response.result = slot->results[entry].result;
+                        strcpy(response.message, slot->results[entry].message);
+                        memcpy(connection->output + connection->output_end, &response, sizeof(response));
+                        connection->output_end += sizeof(response);
+                        connection->served++;
+                        if (!connection->touched)
+                        {
+                            connection->touched = 1;
+                            touched[touched_count++] = connection;
+                        }
+                    }
+                    connection->in_flight--;
+                    seqs[entry] = 0;
+                    free_entries[free_count++] = entry;
+                    if (connection->fd == -1)
+                        finish_connection(epoll_fd, connection, teller_id, &released);
+                }
+                for (int j = 0; j < touched_count; j++)
+                {
+                    touched[j]->touched = 0;
+                    flush_connection(touched[j]);
+                    if (!finish_connection(epoll_fd, touched[j], teller_id, &released))
+                        watch_connection(epoll_fd, touched[j], free_count, &stalled);
+                }
+                // Entries are free again, stalled connections are read again.
+                while (stalled != NULL && free_count > 0)
+                {
+                    Event_Connection *connection = stalled;
+                    stalled = connection->next_stalled;
+                    connection->stalled = 0;
+                    if (!finish_connection(epoll_fd, connection, teller_id, &released))
+                        watch_connection(epoll_fd, connection, free_count, &stalled);
+                }
+            }
+            else
+            {
+                Event_Connection *connection = events[i].data.ptr;
+                if (connection->fd == -1)
+                    continue;
+                // Hang up means the client has closed both sides, its responses can not be sent anymore.
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    connection->broken = 1;
+                else if ((events[i].events & EPOLLOUT) || connection->output_end > connection->output_start)
+                {
+                    // Also when only reading was asked for: results earlier in the same batch of events may have
+                    // left responses waiting. Connection is read again once they are sent, epoll reports it again.
+                    flush_connection(connection);
+                }
+                else if (events[i].events & EPOLLIN)
+                {
+                    // Read only as many requests as there are free entries, rest stays in the socket.
+                    size_t room = free_count * sizeof(Session_Request) - connection->input_length;
+                    ssize_t bytes = free_count == 0 ? 0 : read(connection->fd, connection->input + connection->input_length, room);
+                    if (bytes > 0)
+                        connection->input_length += bytes;
+                    else if (bytes == 0 && free_count > 0)
+                        connection->eof = 1;
+                    else if (bytes == -1 && errno != EAGAIN && errno != EINTR)
+                        connection->broken = 1;
+                    size_t used = 0;
+                    while (connection->input_length - used >= sizeof(Session_Request))
+                    {
+                        Session_Request session_request;
+                        memcpy(&session_request, connection->input + used, sizeof(Session_Request));
+                        used += sizeof(Session_Request);
+                        if (is_balance_query(&session_request.request))
+                        {
+                            // Output is empty while the connection is read (see above) and one read takes at most a
+                            // window of requests, so these answers and the results of the window fit in output.
+                            Session_Response response;
+                            response.request_id = session_request.request_id;
+                            response.result = answer_balance_query(&session_request.request, response.message);
+                            memcpy(connection->output + connection->output_end, &response, sizeof(response));
+                            connection->output_end += sizeof(response);
+                            connection->served++;
+                            continue;
+                        }
+                        int entry = free_entries[--free_count];
+                        if (handler_busy(request_shard(teller_id, entry, &session_request.request)))
+                        {
+                            free_count++;
+                            Session_Response response;
+                            response.request_id = session_request.request_id;
+                            response.result = answer_busy(response.message);
+                            memcpy(connection->output + connection->output_end, &response, sizeof(response));
+                            connection->output_end += sizeof(response);
+                            connection->served++;
+                            continue;
+                        }
+                        request_ids[entry] = session_request.request_id;
+                        owners[entry] = connection;
+                        submitted_us[entry] = now_us();
+                        seqs[entry] = submit_request(teller_id, entry, &session_request.request);
+                        connection->in_flight++;
+                    }
+                    memmove(connection->input, connection->input + used, connection->input_length - used);
+                    connection->input_length -= used;
+                    flush_connection(connection);
+                }
+                if (!finish_connection(epoll_fd, connection, teller_id, &released))
+                    watch_connection(epoll_fd, connection, free_count, &stalled);
+            }
+        }
+        while (released != NULL)
+        {
+            Event_Connection *connection = released;
+            released = connection->next_released;
+            free(connection);
+        }
+    }
+}
+
+// Hash function for account ids (FNV-1a), used to find the place of an id in the account index.
+unsigned int hash_account_id(const char *account_id)
+{
+    unsigned int hash = 2166136261u;
+    for (const char *c = account_id; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the place of the account in the accounts array or -1 if there is no such account.
+// Caller should hold the lock of the account's stripe.
+int find_account(const char *account_id)
+{
+    unsigned int mask = store->index_size - 1;
+    unsigned int pos = hash_account_id(account_id) & mask;
+    // Linear probing, stops at the first empty entry. Deleted entries are skipped since the id may be further.
+    for (int probes = 0; probes < store->index_size; probes++)
+    {
+        int entry = account_index[pos];
+        if (entry == INDEX_EMPTY)
+            return -1;
+        if (entry >= 0 && strcmp(accounts[entry].account_id, account_id) == 0)
+            return entry;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+// Adds an index entry for the account at the given place. Reuses the first deleted entry on the way.
+void index_insert(const char *account_id, int position)
+{
+    unsigned int mask = store->index_size - 1;
+    unsigned int pos = hash_account_id(account_id) & mask;
+    while (account_index[pos] >= 0)
+    {
+        pos = (pos + 1) & mask;
+    }
+    if (account_index[pos] == INDEX_DELETED)
+        store->index_deleted--;
+    account_index[pos] = position;
+}
+
+// Marks the index entry of the account as deleted. Entry can not be emptied since it may be in the middle of a probe sequence.
+void index_remove(const char *account_id)
+{
+    unsigned int mask = store->index_size - 1;
+    unsigned int pos = hash_account_id(account_id) & mask;
+    for (int probes = 0; probes < store->index_size; probes++)
+    {
+        int entry = account_index[pos];
+        if (entry == INDEX_EMPTY)
+            return;
+        if (entry >= 0 && strcmp(accounts[entry].account_id, account_id) == 0)
+        {
+            account_index[pos] = INDEX_DELETED;
+            store->index_deleted++;
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+// Builds the index again from the accounts array, this clears all the deleted entries.
+void rebuild_index()
+{
+    for (int i = 0; i < store->index_size; i++)
+    {
+        account_index[i] = INDEX_EMPTY;
+    }
+    store->index_deleted = 0;
+    for (int i = 0; i < store->db_size; i++)
+    {
+        index_insert(accounts[i].account_id, i);
+    }
+}
+
+// Appends a new account to the accounts array and indexes it. Returns its place or -1 if the store can not grow.
+int add_account(const char *account_id, int balance)
+{
+    if (store->db_size >= store->capacity && grow_store() == -1)
+        return -1;
+    // Too many deleted entries make the probe sequences long, so they are cleaned up before the index fills.
+    if (store->db_size + store->index_deleted >= store->index_size / 2)
+        rebuild_index();
+    int position = store->db_size;
+    strcpy(accounts[position].account_id, account_id);
+    accounts[position].balance = balance;
+    index_insert(account_id, position);
+    store->db_size++;
+    mark_dirty(position);
+    return position;
+}
+
+// Removes the account at the given place. Last account is moved into its place so nothing has to be shifted.
+void remove_account(int position)
+{
+    int last = store->db_size - 1;
+    index_remove(accounts[position].account_id);
+    mark_removed(accounts[position].account_id);
+    if (position != last)
+    {
+        // Index entry of the moved account is updated to point to its new place.
+        index_remove(accounts[last].account_id);
+        accounts[position] = accounts[last];
+        index_insert(accounts[position].account_id, position);
+        mark_dirty(position);
+    }
+    store->db_size--;
+}
+
+// This is the function that teller forks which handels withdrawig and depositing operations.
+// A teller is not created per request anymore, it stays in the pool and serves the connection requests one after another.
+void *func(void *arg)
+{
+    int teller_id = *(int *)arg;
+
+    // Tellers are stopped by the server, ctrl+c should not run the server's signal handler inside them.
+    // A client that goes away in the middle of a session should not kill the teller either.
+    setup_sigaction(SIGINT, SIG_IGN);
+    setup_sigaction(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    if (teller_id >= teller_count)
+    {
+        if (event_tellers)
+            serve_socket_events(teller_id);
+        serve_socket_clients(teller_id);
+    }
+
+    while (1)
+    {
+        Server_Connection_Request sc_request;
+        dequeue_connection(&shared_data->teller_queue, &sc_request);
+        printf("Teller %d (PID%d) is serving client PID%d.\n", teller_id, getpid(), sc_request.client_pid);
+        if (sc_request.session)
+            serve_session(&sc_request, teller_id);
+        else
+            serve_client(&sc_request, teller_id);
+    }
+
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+// This function is requried in the homework document, this forks a child teller that will execute the code specified in its argument.
 pid_t Teller(void *func, void *arg_func)
 {
-    pid_t pid = fork();
+    // Flush pending output so that it is not printed again by the child.
+    fflush(stdout);
+    pid_t pid = timed_fork();
     if (pid == 0)
     {
-        printf("\nTeller PID%d is active serving the client.\n", getpid());
+        printf("\nTeller PID%d is active serving the clients.\n", getpid());
         ((void *(*)(void *))func)(arg_func);
         exit(EXIT_SUCCESS);
     }
@@ -485,6 +4053,329 @@ int waitTeller(pid_t pid, int *status)
     return waitpid(pid, status, 0);
 }
 
+// Forks a teller for the given place in the pool.
+void start_teller(int teller_id)
+{
+    teller_ids[teller_id] = teller_id;
+    // Call the teller function to fork child processes, just as required in the homework document.
+    teller_pids[teller_id] = Teller(func, &teller_ids[teller_id]);
+    if (teller_pids[teller_id] == -1)
+    {
+        perror("Teller fork failed");
+    }
+}
+
+// Collects the tellers that have exited without blocking and forks new ones in their places. Handlers and the
+// writers are only looked at, a dead one stops the server (see stop_after_death).
+void reap_tellers()
+{
+    int status;
+    for (int i = 0; i < teller_count + socket_teller_count; i++)
+    {
+        pid_t pid = teller_pids[i];
+        if (pid > 0 && waitpid(pid, &status, WNOHANG) == pid)
+        {
+            printf("Teller PID%d has exited, restarting teller %d.\n", pid, i);
+            start_teller(i);
+        }
+    }
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (waitpid(handler_pids[i], &status, WNOHANG) == handler_pids[i])
+            stop_after_death("Handler", handler_pids[i], status);
+    }
+    if (waitpid(log_writer_pid, &status, WNOHANG) == log_writer_pid)
+        stop_after_death("Log writer", log_writer_pid, status);
+    if (waitpid(audit_writer_pid, &status, WNOHANG) == audit_writer_pid)
+        stop_after_death("Audit writer", audit_writer_pid, status);
+}
+
+// Initializes the connection queue, semaphores are shared between processes.
+void init_teller_queue(Connection_Queue *queue)
+{
+    queue->head = 0;
+    queue->tail = 0;
+    if (sem_init(&queue->empty_slots, 1, CONNECTION_QUEUE_SIZE) == -1 ||
+        sem_init(&queue->full_slots, 1, 0) == -1 ||
+        sem_init(&queue->queue_lock, 1, 1) == -1)
+    {
+        perror("sem_init");
+        exit(1);
+    }
+}
+
+// Puts a connection request to the end of the queue, waits if the queue is full.
+void enqueue_connection(Connection_Queue *queue, const Server_Connection_Request *sc_request)
+{
+    while (sem_wait(&queue->empty_slots) == -1 && errno == EINTR)
+        ;
+    sem_wait(&queue->queue_lock);
+    queue->requests[queue->tail] = *sc_request;
+    queue->tail = (queue->tail + 1) % CONNECTION_QUEUE_SIZE;
+    sem_post(&queue->queue_lock);
+    sem_post(&queue->full_slots);
+}
+
+// Takes the first connection request from the queue, waits if the queue is empty.
+void dequeue_connection(Connection_Queue *queue, Server_Connection_Request *sc_request)
+{
+    while (sem_wait(&queue->full_slots) == -1 && errno == EINTR)
+        ;
+    sem_wait(&queue->queue_lock);
+    *sc_request = queue->requests[queue->head];
+    queue->head = (queue->head + 1) % CONNECTION_QUEUE_SIZE;
+    sem_post(&queue->queue_lock);
+    sem_post(&queue->empty_slots);
+}
+
+// Initializes the request ring, every cell is free for the position it has in the first round.
+void init_request_ring(Request_Ring *ring)
+{
+    for (unsigned int i = 0; i < REQUEST_RING_SIZE; i++)
+        ring->cells[i].seq = i;
+    ring->tail = 0;
+    ring->head = 0;
+    ring->sleeping = 0;
+    ring->wakeups = 0;
+}
+
+// Puts a request of a teller to the ring and wakes the handler if it is sleeping.
+void ring_push(Request_Ring *ring, const Teller_Request *treq)
+{
+    unsigned int pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    Request_Cell *cell;
+    while (1)
+    {
+        cell = &ring->cells[pos & (REQUEST_RING_SIZE - 1)];
+        int diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            // Cell is free, reserve it. On failure pos is updated to the current tail.
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Ring is full. It is as large as the windows of all the tellers together so this can not happen,
+            // but the teller would wait here for the handler to take a request.
+            sched_yield();
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+        else
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+    cell->request = *treq;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Either the handler sees the new request before it sleeps or the teller sees that it is sleeping.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&ring->wakeups, 1, __ATOMIC_SEQ_CST);
+        futex(&ring->wakeups, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+// Takes at most max requests from the ring without waiting. Returns the number of requests taken.
+int ring_pop_batch(Request_Ring *ring, Teller_Request *batch, int max)
+{
+    int count = 0;
+    unsigned int pos = ring->head;
+    while (count < max)
+    {
+        Request_Cell *cell = &ring->cells[pos & (REQUEST_RING_SIZE - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        batch[count++] = cell->request;
+        // Cell is given back to the tellers for the next round.
+        __atomic_store_n(&cell->seq, pos + REQUEST_RING_SIZE, __ATOMIC_RELEASE);
+        pos++;
+    }
+    ring->head = pos;
+    return count;
+}
+
+// Sleeps until a teller puts a request or the timeout passes, timeout -1 waits forever.
+void ring_wait(Request_Ring *ring, int timeout_ms)
+{
+    unsigned int wakeups = __atomic_load_n(&ring->wakeups, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    Request_Cell *cell = &ring->cells[ring->head & (REQUEST_RING_SIZE - 1)];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST) != ring->head + 1)
+    {
+        struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        futex(&ring->wakeups, FUTEX_WAIT, wakeups, timeout_ms < 0 ? NULL : &timeout);
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// Reads the command line options of the server.
+void parse_arguments(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:eiw:c:s:vl:b:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            teller_count = atoi(optarg);
+            if (teller_count < 1 || teller_count > MAX_TELLERS)
+            {
+                fprintf(stderr, "Teller count should be between 1 and %d\n", MAX_TELLERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            socket_teller_count = atoi(optarg);
+            if (socket_teller_count < 0)
+            {
+                fprintf(stderr, "Socket teller count can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            event_tellers = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'l':
+            log_rotate_mb = atol(optarg);
+            if (log_rotate_mb < 0)
+            {
+                fprintf(stderr, "Log rotation size can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            import_database = 1;
+            break;
+        case 'b':
+            max_waiting_connections = atoi(optarg);
+            if (max_waiting_connections < 1 || max_waiting_connections > CONNECTION_QUEUE_SIZE)
+            {
+                fprintf(stderr, "Waiting connection limit should be between 1 and %d\n", CONNECTION_QUEUE_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            max_pending_requests = atoi(optarg);
+            if (max_pending_requests < 1 || max_pending_requests > REQUEST_RING_SIZE)
+            {
+                fprintf(stderr, "Pending request limit should be between 1 and %d\n", REQUEST_RING_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            commit_window = atoi(optarg);
+            if (commit_window < 0)
+            {
+                fprintf(stderr, "Commit window can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            shard_count = atoi(optarg);
+            if (shard_count < 1 || shard_count > MAX_SHARDS)
+            {
+                fprintf(stderr, "Shard count should be between 1 and %d\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            checkpoint_interval = atoi(optarg);
+            if (checkpoint_interval < 0)
+            {
+                fprintf(stderr, "Checkpoint interval can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t tellers] [-u socket_tellers] [-e] [-i] [-w commit_window_us] [-c checkpoint_interval_s] [-s shards] [-v] [-l log_rotate_mb] [-b max_waiting] [-p max_pending]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Both kinds of tellers have their places in the same arrays.
+    if (teller_count + socket_teller_count > MAX_TELLERS)
+    {
+        fprintf(stderr, "Teller count and socket teller count together should be at most %d\n", MAX_TELLERS);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Creates the shared memory segment of the counters. An old one left by a crashed server is used again, so it is
+// cleared first.
+void init_metrics()
+{
+    metrics_shm_id = shmget(METRICS_SHM_KEY, sizeof(Bank_Metrics), IPC_CREAT | 0666);
+    if (metrics_shm_id < 0)
+    {
+        perror("shmget metrics");
+        exit(1);
+    }
+    metrics = (Bank_Metrics *)shmat(metrics_shm_id, NULL, 0);
+    if (metrics == (void *)-1)
+    {
+        perror("shmat metrics");
+        exit(1);
+    }
+    memset(metrics, 0, sizeof(Bank_Metrics));
+    metrics->server_pid = getpid();
+    metrics->shard_count = shard_count;
+    metrics->started = time(NULL);
+    memcpy(metrics->magic, METRICS_MAGIC, sizeof(metrics->magic));
+}
+
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metric_add(unsigned long long *counter, unsigned long long value)
+{
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+void metric_record(Metric_Histogram *histogram, long long us)
+{
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS - 1 && (1LL << (bucket + 1)) <= us)
+        bucket++;
+    metric_add(&histogram->counts[bucket], 1);
+    metric_add(&histogram->total_us, us > 0 ? us : 0);
+}
+
+// Kind of the request for the counters.
+int metric_op(const Request *request)
+{
+    if (strcmp(request->operation, "balance") == 0)
+        return METRIC_BALANCE;
+    if (strcmp(request->operation, "deposit") == 0)
+        return strcmp(request->account_id, "N") == 0 ? METRIC_CREATE : METRIC_DEPOSIT;
+    if (strcmp(request->operation, "withdraw") == 0 && strcmp(request->account_id, "N") != 0)
+        return METRIC_WITHDRAW;
+    if (strcmp(request->operation, "transfer") == 0)
+        return METRIC_TRANSFER;
+    return METRIC_INVALID;
+}
+
+// Forks and counts the time the fork took in the parent, which grows with the memory the server has mapped.
+pid_t timed_fork()
+{
+    long long start = now_us();
+    pid_t pid = fork();
+    if (pid > 0)
+    {
+        long long took = now_us() - start;
+        metric_add(&metrics->forks, 1);
+        metric_add(&metrics->fork_us, took);
+        metric_record(&metrics->fork_latency, took);
+    }
+    return pid;
+}
+
 // Sets up the signals
 void setup_sigaction(int signum, void (*handler)(int))
 {